@@ -0,0 +1,537 @@
+/*
+ * This file is part of LSA.
+ *
+ * Copyright © 2014–2017 Mark Karpov
+ *
+ * LSA is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * LSA is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Benchmark of LSA, run it with `make bench'. It does three things:
+
+   1. Checks every peak, statistics, and hash kernel of every instruction
+      set supported by this CPU against the scalar kernel for the same
+      format on all short lengths and alignments, so tails and unaligned
+      loads are covered.
+
+   2. Times every kernel on a buffer that doesn't fit into caches and
+      prints throughput in GB/s.
+
+   3. Generates deterministic corpus of WAVE, AIFF, AIFF-C, CAF, and FLAC
+      files in every sample format, width, and channel count that
+      `get_peak' handles, times `lsa_analyze' on every file (with and
+      without mapping files into memory), and checks the peaks against
+      peaks of samples that have been written.
+
+   Formats the Audio File library cannot write (e.g. FLAC when it's built
+   without libFLAC) are skipped. Exit status is non-zero if any check has
+   failed, so results of different builds and CPUs can be compared. */
+
+#include "../src/lsa.h"
+#include <time.h>     /* clock_gettime */
+#include <sys/stat.h> /* mkdir */
+
+#define BENCH_BUFFER  (64 << 20) /* bytes every kernel is timed on */
+#define BENCH_TIME    0.25       /* min seconds per measurement */
+#define BENCH_CHECK   257        /* lengths of buffers kernels are checked
+                                    on go from 0 to this */
+#define BENCH_RATE    48000
+#define BENCH_SECONDS 4          /* default duration of corpus files */
+#define BENCH_BLOCK   4096       /* frames written at once */
+#define BENCH_STRIPES 20         /* stripes hash kernels are checked on */
+
+/* structures & constants */
+
+struct corpus_format /* kind of files in the corpus */
+{
+  const char *ext;
+  int file_format;
+  int compression;
+  int format;
+  int width;
+};
+
+const struct corpus_format corpus[] =
+  { { "wav",   AF_FILE_WAVE,  AF_COMPRESSION_NONE, AF_SAMPFMT_UNSIGNED, 8  },
+    { "wav",   AF_FILE_WAVE,  AF_COMPRESSION_NONE, AF_SAMPFMT_TWOSCOMP, 16 },
+    { "wav",   AF_FILE_WAVE,  AF_COMPRESSION_NONE, AF_SAMPFMT_TWOSCOMP, 24 },
+    { "wav",   AF_FILE_WAVE,  AF_COMPRESSION_NONE, AF_SAMPFMT_TWOSCOMP, 32 },
+    { "wav",   AF_FILE_WAVE,  AF_COMPRESSION_NONE, AF_SAMPFMT_FLOAT,    32 },
+    { "wav",   AF_FILE_WAVE,  AF_COMPRESSION_NONE, AF_SAMPFMT_DOUBLE,   64 },
+    { "aiff",  AF_FILE_AIFF,  AF_COMPRESSION_NONE, AF_SAMPFMT_TWOSCOMP, 8  },
+    { "aiff",  AF_FILE_AIFF,  AF_COMPRESSION_NONE, AF_SAMPFMT_TWOSCOMP, 16 },
+    { "aiff",  AF_FILE_AIFF,  AF_COMPRESSION_NONE, AF_SAMPFMT_TWOSCOMP, 24 },
+    { "aiff",  AF_FILE_AIFF,  AF_COMPRESSION_NONE, AF_SAMPFMT_TWOSCOMP, 32 },
+    { "aiffc", AF_FILE_AIFFC, AF_COMPRESSION_NONE, AF_SAMPFMT_FLOAT,    32 },
+    { "aiffc", AF_FILE_AIFFC, AF_COMPRESSION_NONE, AF_SAMPFMT_DOUBLE,   64 },
+    { "caf",   AF_FILE_CAF,   AF_COMPRESSION_NONE, AF_SAMPFMT_TWOSCOMP, 16 },
+    { "caf",   AF_FILE_CAF,   AF_COMPRESSION_NONE, AF_SAMPFMT_TWOSCOMP, 24 },
+    { "caf",   AF_FILE_CAF,   AF_COMPRESSION_NONE, AF_SAMPFMT_TWOSCOMP, 32 },
+    { "caf",   AF_FILE_CAF,   AF_COMPRESSION_NONE, AF_SAMPFMT_FLOAT,    32 },
+    { "caf",   AF_FILE_CAF,   AF_COMPRESSION_NONE, AF_SAMPFMT_DOUBLE,   64 },
+    { "flac",  AF_FILE_FLAC,  AF_COMPRESSION_FLAC, AF_SAMPFMT_TWOSCOMP, 16 },
+    { "flac",  AF_FILE_FLAC,  AF_COMPRESSION_FLAC, AF_SAMPFMT_TWOSCOMP, 24 } };
+
+const int corpus_channels[] = { 1, 2, 6 };
+
+const char *kernel_names[K_TOTAL] =
+  { [K_INT32]     = "int32",
+    [K_INT16]     = "int16",
+    [K_INT8]      = "int8",
+    [K_UINT32]    = "uint32",
+    [K_UINT16]    = "uint16",
+    [K_UINT8]     = "uint8",
+    [K_FLOAT]     = "float",
+    [K_DOUBLE]    = "double",
+    [K_INT24]     = "int24",
+    [K_INT32_BE]  = "int32_be",
+    [K_INT24_BE]  = "int24_be",
+    [K_INT16_BE]  = "int16_be",
+    [K_FLOAT_BE]  = "float_be",
+    [K_DOUBLE_BE] = "double_be" };
+
+const int kernel_formats[K_STATS][2] = /* sample formats of statistics
+                                           kernels */
+  { [K_INT32]  = { AF_SAMPFMT_TWOSCOMP, 32 },
+    [K_INT16]  = { AF_SAMPFMT_TWOSCOMP, 16 },
+    [K_INT8]   = { AF_SAMPFMT_TWOSCOMP, 8  },
+    [K_UINT32] = { AF_SAMPFMT_UNSIGNED, 32 },
+    [K_UINT16] = { AF_SAMPFMT_UNSIGNED, 16 },
+    [K_UINT8]  = { AF_SAMPFMT_UNSIGNED, 8  },
+    [K_FLOAT]  = { AF_SAMPFMT_FLOAT,    32 },
+    [K_DOUBLE] = { AF_SAMPFMT_DOUBLE,   64 } };
+
+const int kernel_sizes[K_TOTAL] = /* bytes per sample */
+  { [K_INT32] = 4, [K_INT16] = 2, [K_INT8] = 1, [K_UINT32] = 4,
+    [K_UINT16] = 2, [K_UINT8] = 1, [K_FLOAT] = 4, [K_DOUBLE] = 8,
+    [K_INT24] = 3, [K_INT32_BE] = 4, [K_INT24_BE] = 3, [K_INT16_BE] = 2,
+    [K_FLOAT_BE] = 4, [K_DOUBLE_BE] = 8 };
+
+/* declarations */
+
+static uint32_t next_random (uint32_t *);
+static double now (void);
+static void fill_samples (int, unsigned char *, size_t, uint32_t);
+static int check_kernels (unsigned char *);
+static int same_stats (const struct channel_stats *,
+                       const struct channel_stats *,
+                       int,
+                       AFframecount);
+static void time_kernels (unsigned char *);
+static int run_corpus (const char *, int);
+static int write_file (const char *,
+                       const struct corpus_format *,
+                       int,
+                       AFframecount,
+                       double *);
+static double time_analyze (struct lsa_context *, const char *, double *);
+
+/* main */
+
+int main (int argc, char **argv)
+{
+  const char *dir = argc > 1 ? *(argv + 1) : "build/corpus";
+  int seconds = argc > 2 ? atoi (*(argv + 2)) : BENCH_SECONDS;
+  if (seconds < 1) seconds = BENCH_SECONDS;
+  select_kernels ();
+  int isa;
+  printf ("instruction sets:");
+  for (isa = ISA_SCALAR; isa < ISA_TOTAL; isa++)
+    {
+      if (isa_supported (isa)) printf (" %s", *(isa_names + isa));
+    }
+  printf ("\n\n");
+  unsigned char *buffer = NULL;
+  if (posix_memalign ((void **)&buffer, LSA_ALIGN,
+                      BENCH_BUFFER + LSA_ALIGN))
+    {
+      fprintf (stderr, "bench: cannot allocate memory\n");
+      return EXIT_FAILURE;
+    }
+  int fails = check_kernels (buffer);
+  time_kernels (buffer);
+  fails += run_corpus (dir, seconds);
+  free (buffer);
+  printf ("\n%d check%s failed\n", fails, fails == 1 ? "" : "s");
+  return fails ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/* functions */
+
+static uint32_t next_random (uint32_t *state)
+/* Simple linear congruential generator, so every run (and every machine)
+   gets the same data. */
+{
+  *state = *state * 1664525u + 1013904223u;
+  return *state >> 8;
+}
+
+static double now (void)
+/* Return monotonic time in seconds. */
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void fill_samples (int k, unsigned char *buffer, size_t bytes,
+                          uint32_t seed)
+/* Fill `buffer' with random samples for kernel `k'. Integer samples are
+   just random bytes, floating point ones are random numbers in
+   [-1.5, 1.5), so there are no NaNs and some samples are clipped. */
+{
+  size_t i;
+  switch (k)
+    {
+    case K_FLOAT :
+    case K_FLOAT_BE :
+      for (i = 0; i + 4 <= bytes; i += 4)
+        {
+          float f = next_random (&seed) / (double)(1 << 24) * 3 - 1.5;
+          uint32_t v;
+          memcpy (&v, &f, 4);
+          if (k == K_FLOAT_BE) v = __builtin_bswap32 (v);
+          memcpy (buffer + i, &v, 4);
+        }
+      break;
+    case K_DOUBLE :
+    case K_DOUBLE_BE :
+      for (i = 0; i + 8 <= bytes; i += 8)
+        {
+          double d = next_random (&seed) / (double)(1 << 24) * 3 - 1.5;
+          uint64_t v;
+          memcpy (&v, &d, 8);
+          if (k == K_DOUBLE_BE) v = __builtin_bswap64 (v);
+          memcpy (buffer + i, &v, 8);
+        }
+      break;
+    default :
+      for (i = 0; i < bytes; i++)
+        {
+          *(buffer + i) = next_random (&seed);
+        }
+    }
+}
+
+static int check_kernels (unsigned char *buffer)
+/* Compare every kernel with the scalar one on buffers of all lengths up
+   to `BENCH_CHECK' samples at all offsets within a vector. Return number
+   of failed checks. */
+{
+  int fails = 0, isa, k, ch;
+  long c, off;
+  struct sample_scale sc;
+  printf ("checking kernels against scalar ones...\n");
+  for (k = 0; k < K_TOTAL; k++)
+    {
+      fill_samples (k, buffer, (BENCH_CHECK + LSA_ALIGN) * 8, k + 1);
+      for (isa = ISA_SCALAR + 1; isa < ISA_TOTAL; isa++)
+        {
+          peak_kernel f = peak_kernel_table[isa][k];
+          if (!f || !isa_supported (isa)) continue;
+          for (off = 0; off < LSA_ALIGN; off += kernel_sizes[k])
+            for (c = 0; c <= BENCH_CHECK; c++)
+              {
+                unsigned char *p = buffer + off;
+                double r = peak_kernel_table[ISA_SCALAR][k] (p, c);
+                double v = f (p, c);
+                if (v == r) continue;
+                if (fails++ < 20)
+                  printf ("FAIL peak %s %s: %ld samples at offset %ld, "
+                          "%g instead of %g\n", kernel_names[k],
+                          isa_names[isa], c, off, v, r);
+              }
+        }
+      if (k >= K_STATS) continue;
+      stats_format (kernel_formats[k][0], kernel_formats[k][1], &sc);
+      for (isa = ISA_SCALAR + 1; isa < ISA_TOTAL; isa++)
+        {
+          stats_kernel f = stats_kernel_table[isa][k];
+          if (!f || !isa_supported (isa)) continue;
+          for (ch = 1; ch <= STATS_MAX_CHANNELS + 2; ch++)
+            for (c = 0; c * ch <= BENCH_CHECK; c++)
+              {
+                struct channel_stats *r = stats_alloc (ch);
+                struct channel_stats *v = stats_alloc (ch);
+                stats_kernel_table[ISA_SCALAR][k] (buffer, c, ch, &sc, r);
+                f (buffer, c, ch, &sc, v);
+                if (!same_stats (r, v, ch, c) && fails++ < 20)
+                  printf ("FAIL stats %s %s: %ld frames of %d channels\n",
+                          kernel_names[k], isa_names[isa], c, ch);
+                free (r);
+                free (v);
+              }
+        }
+    }
+  uint64_t key[BENCH_STRIPES + 8], mask = 0x8000800080008000ULL;
+  fill_samples (K_UINT8, (unsigned char *)key, sizeof (key), 99);
+  fill_samples (K_UINT8, buffer, (BENCH_STRIPES + 1) * HASH_STRIPE, 100);
+  for (isa = ISA_SCALAR + 1; isa < ISA_TOTAL; isa++)
+    {
+      hash_kernel f = hash_kernel_table[isa];
+      if (!f || !isa_supported (isa)) continue;
+      for (off = 0; off < LSA_ALIGN; off++)
+        for (c = 0; c <= BENCH_STRIPES; c++)
+          {
+            uint64_t r[8], v[8];
+            int i;
+            for (i = 0; i < 8; i++)
+              {
+                r[i] = v[i] = key[i] * (i + 1);
+              }
+            hash_kernel_table[ISA_SCALAR] (r, buffer + off, c, key, mask);
+            f (v, buffer + off, c, key, mask);
+            if (!memcmp (r, v, sizeof (r))) continue;
+            if (fails++ < 20)
+              printf ("FAIL hash %s: %ld stripes at offset %ld\n",
+                      isa_names[isa], c, off);
+          }
+    }
+  printf ("%d failed\n\n", fails);
+  return fails;
+}
+
+static int same_stats (const struct channel_stats *a,
+                       const struct channel_stats *b,
+                       int channels,
+                       AFframecount frames)
+/* Check if statistics of `frames' frames are the same. Sums are
+   accumulated in different order and precision by vector kernels, so they
+   may differ by a rounding error per sample. */
+{
+  int i;
+  for (i = 0; i < channels; i++)
+    {
+      const struct channel_stats *x = a + i, *y = b + i;
+      if (x->min != y->min || x->max != y->max || x->clips != y->clips ||
+          fabs (x->sum - y->sum) > 1e-6 * (frames + 1) ||
+          fabs (x->sum2 - y->sum2) > 1e-6 * (frames + 1))
+        return 0;
+    }
+  return 1;
+}
+
+static void time_kernels (unsigned char *buffer)
+/* Print throughput of every kernel on `BENCH_BUFFER' bytes. */
+{
+  int isa, k;
+  struct sample_scale sc;
+  printf ("kernel    isa       peak GB/s  stats GB/s\n");
+  for (k = 0; k < K_TOTAL; k++)
+    {
+      fill_samples (k, buffer, BENCH_BUFFER, k + 1);
+      long c = BENCH_BUFFER / kernel_sizes[k];
+      if (k < K_STATS)
+        stats_format (kernel_formats[k][0], kernel_formats[k][1], &sc);
+      for (isa = ISA_SCALAR; isa < ISA_TOTAL; isa++)
+        {
+          peak_kernel f = peak_kernel_table[isa][k];
+          stats_kernel g = k < K_STATS ? stats_kernel_table[isa][k] : NULL;
+          if ((!f && !g) || !isa_supported (isa)) continue;
+          printf ("%-9s %-9s", kernel_names[k], isa_names[isa]);
+          double t, start;
+          long n;
+          if (f)
+            {
+              volatile double sink;
+              for (n = 0, start = now (); (t = now () - start) < BENCH_TIME;
+                   n++)
+                sink = f (buffer, c);
+              (void)sink;
+              printf (" %9.2f", (double)n * c * kernel_sizes[k] / t / 1e9);
+            }
+          else printf ("         -");
+          if (g)
+            {
+              struct channel_stats *st = stats_alloc (2);
+              for (n = 0, start = now (); (t = now () - start) < BENCH_TIME;
+                   n++)
+                g (buffer, c / 2, 2, &sc, st);
+              free (st);
+              printf ("  %10.2f", (double)n * c * kernel_sizes[k] / t / 1e9);
+            }
+          printf ("\n");
+        }
+    }
+  printf ("\nisa       hash GB/s\n");
+  fill_samples (K_UINT8, buffer, BENCH_BUFFER, 1);
+  for (isa = ISA_SCALAR; isa < ISA_TOTAL; isa++)
+    {
+      hash_kernel f = hash_kernel_table[isa];
+      if (!f || !isa_supported (isa)) continue;
+      struct audio_params p = { .format = AF_SAMPFMT_TWOSCOMP, .width = 16 };
+      struct pcm_hash h;
+      hash_kernel saved = hash_stripes;
+      double t, start;
+      long n;
+      hash_stripes = f;
+      hash_init (&h, &p);
+      for (n = 0, start = now (); (t = now () - start) < BENCH_TIME; n++)
+        hash_add (&h, buffer, BENCH_BUFFER);
+      hash_stripes = saved;
+      printf ("%-9s %10.2f\n", isa_names[isa],
+              (double)n * BENCH_BUFFER / t / 1e9);
+    }
+  printf ("\n");
+}
+
+static int run_corpus (const char *dir, int seconds)
+/* Write corpus into `dir', then time `lsa_analyze' on every file and
+   check peaks. Return number of failed checks. */
+{
+  struct lsa_context *mapped = lsa_new (LSA_PEAK, 1, 0);
+  struct lsa_context *raw = lsa_new (LSA_PEAK | LSA_NO_MMAP, 1, 0);
+  int fails = 0;
+  unsigned int i, j;
+  AFframecount frames = (AFframecount)seconds * BENCH_RATE;
+  mkdir (dir, 0755);
+  printf ("file                MB    default MB/s  --no-mmap MB/s  "
+          "peak\n");
+  for (i = 0; i < sizeof (corpus) / sizeof (corpus[0]); i++)
+    for (j = 0; j < sizeof (corpus_channels) / sizeof (int); j++)
+      {
+        const struct corpus_format *f = corpus + i;
+        char name[BASENAME_MAX_LEN], path[PATH_MAX];
+        double expected, peak, rate, raw_rate;
+        snprintf (name, sizeof (name), "%c%d-%dch.%s",
+                  f->format == AF_SAMPFMT_UNSIGNED ? 'u' :
+                  f->format == AF_SAMPFMT_TWOSCOMP ? 's' :
+                  f->format == AF_SAMPFMT_FLOAT ? 'f' : 'd',
+                  f->width, corpus_channels[j], f->ext);
+        snprintf (path, sizeof (path), "%s/%s", dir, name);
+        if (write_file (path, f, corpus_channels[j], frames, &expected))
+          {
+            printf ("%-18s  skipped, the library cannot write it\n", name);
+            continue;
+          }
+        struct stat sb;
+        double mb = stat (path, &sb) ? 0 : sb.st_size / 1e6;
+        rate = mb / time_analyze (mapped, path, &peak);
+        int ok = fabs (peak - expected) < 1e-9;
+        raw_rate = mb / time_analyze (raw, path, &peak);
+        ok = ok && fabs (peak - expected) < 1e-9;
+        printf ("%-18s %6.1f %12.1f %15.1f  %f %s\n", name, mb, rate,
+                raw_rate, peak, ok ? "ok" : "FAIL");
+        if (!ok)
+          {
+            printf ("  expected peak %f\n", expected);
+            fails++;
+          }
+      }
+  lsa_free (mapped);
+  lsa_free (raw);
+  return fails;
+}
+
+static int write_file (const char *path,
+                       const struct corpus_format *f,
+                       int channels,
+                       AFframecount frames,
+                       double *peak)
+/* Write a file with a sine per channel, some noise, and one spike per
+   channel which is the peak of the channel. Put peak of the file as `lsa'
+   calculates it into `peak'. Return 0 on success. */
+{
+  AFfilesetup s = afNewFileSetup ();
+  afInitFileFormat (s, f->file_format);
+  afInitChannels (s, AF_DEFAULT_TRACK, channels);
+  afInitSampleFormat (s, AF_DEFAULT_TRACK, f->format, f->width);
+  afInitRate (s, AF_DEFAULT_TRACK, BENCH_RATE);
+  afInitCompression (s, AF_DEFAULT_TRACK, f->compression);
+  AFfilehandle h = afOpenFile (path, "w", s);
+  afFreeFileSetup (s);
+  if (h == AF_NULL_FILEHANDLE) return -1;
+  int size = f->format == AF_SAMPFMT_DOUBLE ? 8 :
+    f->width > 16 ? 4 : f->width > 8 ? 2 : 1;
+  unsigned char *block = malloc ((size_t)BENCH_BLOCK * channels * size);
+  double full = ldexp (1, f->width - 1), hi = 0;
+  uint32_t seed = f->width * 16 + channels;
+  AFframecount i, done;
+  int c, r = 0;
+  for (done = 0; done < frames; done += i)
+    {
+      for (i = 0; i < BENCH_BLOCK && done + i < frames; i++)
+        for (c = 0; c < channels; c++)
+          {
+            AFframecount n = done + i;
+            double x = 0.5 * sin (2 * M_PI * 220 * (c + 1) * n / BENCH_RATE)
+              + 0.1 * (next_random (&seed) / (double)(1 << 23) - 1);
+            if (n == frames * (c + 1) / (channels + 1))
+              x = (c & 1 ? -1 : 1) * (0.99 - 0.05 * c);
+            void *p = block + (i * channels + c) * size;
+            double v; /* magnitude as `lsa' sees it */
+            if (f->format == AF_SAMPFMT_FLOAT)
+              {
+                float y = x;
+                memcpy (p, &y, 4);
+                v = fabs (y);
+              }
+            else if (f->format == AF_SAMPFMT_DOUBLE)
+              {
+                memcpy (p, &x, 8);
+                v = fabs (x);
+              }
+            else
+              {
+                int32_t q = lrint (x * full);
+                if (q > full - 1) q = full - 1;
+                if (q < -full) q = -full;
+                if (f->format == AF_SAMPFMT_UNSIGNED)
+                  {
+                    /* Unsigned peaks are normalized by the greatest
+                       value, see `get_peak'. */
+                    uint32_t u = q + (uint32_t)full;
+                    v = u / (ldexp (1, f->width) - 1);
+                    q = u;
+                  }
+                else v = fabs ((double)q) / full;
+                if (size == 1) *(int8_t *)p = q;
+                else if (size == 2) memcpy (p, &(int16_t){ q }, 2);
+                else memcpy (p, &q, 4);
+              }
+            if (v > hi) hi = v;
+          }
+      if (afWriteFrames (h, AF_DEFAULT_TRACK, block, i) != i)
+        {
+          r = -1;
+          break;
+        }
+    }
+  free (block);
+  afCloseFile (h);
+  *peak = hi;
+  return r;
+}
+
+static double time_analyze (struct lsa_context *ctx,
+                            const char *path,
+                            double *peak)
+/* Analyze file on `path' in context `ctx' at least once and for at least
+   `BENCH_TIME' seconds, return time of one run. */
+{
+  double start = now (), t;
+  long n = 0;
+  *peak = -1;
+  do
+    {
+      struct audio_params p;
+      if (!lsa_analyze (ctx, path, &p))
+        {
+          *peak = p.peak;
+          lsa_release (&p);
+        }
+      n++;
+    }
+  while ((t = now () - start) < BENCH_TIME);
+  return t / n;
+}
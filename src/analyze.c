@@ -21,27 +21,111 @@
 
 /* declarations */
 
-static double get_peak    (void *, AFframecount, int, int);
-static double peak_int32  (void *, AFframecount);
-static double peak_int16  (void *, AFframecount);
-static double peak_int8   (void *, AFframecount);
-static double peak_uint32 (void *, AFframecount);
-static double peak_uint16 (void *, AFframecount);
-static double peak_uint8  (void *, AFframecount);
-static double peak_float  (void *, AFframecount);
-static double peak_double (void *, AFframecount);
+static int scan_frames (const struct lsa_context *,
+                        AFfilehandle,
+                        struct audio_params *,
+                        AFframecount,
+                        AFframecount,
+                        void *,
+                        double *,
+                        struct channel_stats *,
+                        struct channel_stats *,
+                        struct loudness *,
+                        struct pcm_hash *);
+static int scan_mapped (const struct lsa_context *,
+                        AFfilehandle,
+                        const char *,
+                        struct audio_params *,
+                        AFframecount,
+                        AFframecount,
+                        double *,
+                        struct channel_stats *,
+                        struct channel_stats *,
+                        struct loudness *,
+                        struct pcm_hash *);
+static void fold_buckets (const struct lsa_context *,
+                          const struct audio_params *,
+                          const char *,
+                          long,
+                          AFframecount,
+                          AFframecount,
+                          int,
+                          const struct sample_scale *,
+                          struct channel_stats *,
+                          long);
+static void merge_buckets (struct channel_stats *,
+                           const struct channel_stats *,
+                           long,
+                           int);
+static void scan_silence (const struct lsa_context *,
+                          AFfilehandle,
+                          const char *,
+                          struct audio_params *,
+                          void *);
+static AFframecount find_loud (const struct lsa_context *,
+                               const struct audio_params *,
+                               int,
+                               const char *,
+                               AFframecount,
+                               long,
+                               int);
+static int is_loud (const struct lsa_context *,
+                    const struct audio_params *,
+                    int,
+                    const char *,
+                    AFframecount);
+static int sample_peak (const struct lsa_context *,
+                        AFfilehandle,
+                        const char *,
+                        struct audio_params *,
+                        void *);
+static int raw_kernel (const struct audio_params *, int, double *);
+static double get_peak (void *, AFframecount, int, int);
 
 /* definitions */
 
-struct audio_params *analyze_file (char *path)
+int analyze_file (const struct lsa_context *ctx,
+                  const char *path,
+                  void *buffer,
+                  struct audio_params *result,
+                  int *chunks)
 /* This is the place where all the analyze happens. We take `path', open
-   file on this path with AudioFile library, allocate memory for `struct
-   audioParams', assign calculated values and return pointer to this
-   structure. If we return `NULL', this item will be ignored. */
+   file on this path with AudioFile library and put calculated values
+   into `result', what is calculated depends on flags of `ctx'. If we
+   return non-zero value (the file cannot be opened or its frames cannot
+   be read), this item will be ignored. `buffer' is an
+   aligned block of `buffer_size' bytes of `ctx' owned by the calling
+   thread, we decode audio into it block by block, so memory consumption
+   doesn't depend on length of the file. Big files that can be seeked are
+   not scanned here, instead we set `*chunks' to number of parts to split
+   them into (it's zero for other files) and let the caller distribute
+   their frame ranges among threads, see `analyze_range'. Peak,
+   statistics of samples, envelope, loudness, true peak, and hash are
+   calculated during the same pass over the frames. Filters of loudness
+   and true peak and the hash need all frames in order, so files they are
+   requested for are never split. When nothing but the peak is needed,
+   reading stops as soon as it reaches full scale, and with sampling of
+   peaks only some blocks are read, see `sample_peak'. Silence is found by
+   reading only the edges of the file, see `scan_silence'. */
 {
-  AFfilehandle h = afOpenFile ((const char *)path, "r", NULL);
-  if (h == AF_NULL_FILEHANDLE) return NULL;
-  struct audio_params *result = malloc (sizeof (*result));
+  int peak = ctx->flags & LSA_PEAK, stats = ctx->flags & LSA_STATS;
+  int loud = ctx->flags & (LSA_TRUE_PEAK | LSA_LOUDNESS);
+  int serial = loud || (ctx->flags & LSA_HASH);
+  long buckets = ctx->buckets;
+  int sample = peak && ctx->sample > 0 && !stats && !buckets && !serial;
+  /* If nothing needs to be decoded, try to get parameters from header of
+     the file without involving the library. */
+  *chunks = 0;
+  CTX_PROFILE_START (ctx, t);
+  if (!peak && !stats && !buckets && !serial && ctx->silence < 0 &&
+      !parse_header (path, result))
+    {
+      CTX_PROFILE_END (ctx, t, PH_OPEN, 0);
+      return 0;
+    }
+  AFfilehandle h = afOpenFile (path, "r", NULL);
+  CTX_PROFILE_END (ctx, t, PH_OPEN, 0);
+  if (h == AF_NULL_FILEHANDLE) return -1;
   result->rate = (int)afGetRate (h, AF_DEFAULT_TRACK);
   afGetSampleFormat (h, AF_DEFAULT_TRACK, &result->format, &result->width);
   result->channels = afGetChannels (h, AF_DEFAULT_TRACK);
@@ -49,262 +133,608 @@ struct audio_params *analyze_file (char *path)
   result->duration = (double)result->frames / result->rate;
   result->kbps = /* 8 / 1000 = 125, * 8 to get bits, / 1000 to get kilos */
     afGetTrackBytes (h, AF_DEFAULT_TRACK) / (result->duration * 125);
-  if (op_comp)
-    result->compression = afGetCompression (h, AF_DEFAULT_TRACK);
-  if (op_peak) /* check if any options that require calculations on frames
-                  are supplied */
+  result->compression = afGetCompression (h, AF_DEFAULT_TRACK);
+  result->peak = 0;
+  result->stats = stats ? stats_alloc (result->channels) : NULL;
+  result->overview =
+    buckets ? stats_alloc (buckets * result->channels) : NULL;
+  result->lead = result->trail = 0;
+  result->true_peak = 0;
+  result->loudness = -HUGE_VAL;
+  result->lra = 0;
+  result->hash = 0;
+  result->sampled = 0;
+  if (peak || stats || buckets || serial) /* check if any options that
+                                             require calculations on
+                                             frames are supplied */
     {
-      void *frames = NULL;
-      /* Calculate size of the buffer and allocate aligned memory. */
-      AFframecount count;
-      if (result->width > 32) count = 8;
-      else if (result->width > 16) count = 4;
-      else if (result->width > 8) count = 2;
-      else count = 1;
-      count *= result->frames * result->channels;
-      if (posix_memalign (&frames, 16, count))
+      AFframecount bytes = result->frames *
+        (AFframecount)afGetVirtualFrameSize (h, AF_DEFAULT_TRACK, 1);
+      struct loudness *l = loud ?
+        loudness_new (ctx->flags, result->channels, result->rate) : NULL;
+      struct pcm_hash hs, *hash = NULL;
+      if (ctx->flags & LSA_HASH) hash_init (hash = &hs, result);
+      /* If sampling would read the whole file anyway, it's scanned as
+         usual. */
+      int sampled = sample && !sample_peak (ctx, h, path, result, buffer),
+        failed = 0;
+      if (!sampled)
         {
-          fprintf (stderr,
-                   "lsa: cannot dynamically allocate aligned memory\n");
-          return result;
+          if (bytes > LSA_SPLIT_SIZE && !serial &&
+              (result->compression == AF_COMPRESSION_NONE ||
+               result->compression == AF_COMPRESSION_FLAC))
+            *chunks = (bytes + LSA_CHUNK_SIZE - 1) / LSA_CHUNK_SIZE;
+          else if (scan_mapped (ctx, h, path, result, 0, result->frames,
+                                &result->peak, result->stats,
+                                result->overview, l, hash) &&
+                   scan_frames (ctx, h, result, 0, result->frames, buffer,
+                                &result->peak, result->stats,
+                                result->overview, l, hash))
+            failed = 1;
         }
-      AFframecount c =
-        afReadFrames (h, AF_DEFAULT_TRACK, frames, result->frames);
-      if (c == result->frames)
+      if (l) loudness_done (l, result);
+      if (hash && !failed) result->hash = hash_done (hash);
+      if (failed)
         {
-          if (op_peak)
-            result->peak = get_peak (frames,
-                                     c * result->channels,
-                                     result->format,
-                                     result->width);
+          free (result->stats);
+          free (result->overview);
+          result->stats = result->overview = NULL;
+          afCloseFile (h);
+          return -1;
         }
-      free (frames);
     }
+  if (ctx->silence >= 0) scan_silence (ctx, h, path, result, buffer);
   afCloseFile (h);
-  return result;
+  return 0;
 }
 
-static double get_peak (void *frames, AFframecount c, int format, int width)
+int analyze_range (const struct lsa_context *ctx,
+                   const char *path,
+                   struct audio_params *params,
+                   AFframecount start,
+                   AFframecount count,
+                   void *buffer,
+                   double *peak,
+                   struct channel_stats *stats,
+                   struct channel_stats *overview)
+/* Calculate peak, statistics (if `stats' is not `NULL'), and envelope (if
+   `overview' is not `NULL') of `count' frames starting from `start' in
+   file on `path', its parameters are already in `params'. `overview'
+   holds empty buckets from the one `start' falls into, see
+   `bucket_range'. This is how parts of big files are processed in
+   parallel, every thread opens the file on its own, because file handles
+   cannot be shared between threads. Return 0 on success. */
 {
-  if (format == AF_SAMPFMT_TWOSCOMP)
-    {
-      if (width > 16) return peak_int32 (frames, c);
-      else if (width > 8) return peak_int16 (frames, c);
-      else return peak_int8 (frames, c);
-    }
-  else if (format == AF_SAMPFMT_UNSIGNED)
-    {
-      if (width > 16) return peak_uint32 (frames, c);
-      else if (width > 8) return peak_uint16 (frames, c);
-      else return peak_uint8 (frames, c);
-    }
-  else if (format == AF_SAMPFMT_FLOAT) return peak_float (frames, c);
-  else if (format == AF_SAMPFMT_DOUBLE) return peak_double (frames, c);
-  return 0;
+  CTX_PROFILE_START (ctx, t);
+  AFfilehandle h = afOpenFile (path, "r", NULL);
+  CTX_PROFILE_END (ctx, t, PH_OPEN, 0);
+  if (h == AF_NULL_FILEHANDLE) return -1;
+  int r = 0;
+  if (scan_mapped (ctx, h, path, params, start, count, peak, stats,
+                   overview, NULL, NULL))
+    r = afSeekFrame (h, AF_DEFAULT_TRACK, start) == start ?
+      scan_frames (ctx, h, params, start, count, buffer, peak, stats,
+                   overview, NULL, NULL) : -1;
+  afCloseFile (h);
+  return r;
 }
 
-static double peak_int32 (void *frames, AFframecount c)
+long bucket_range (long buckets,
+                   AFframecount frames,
+                   AFframecount start,
+                   AFframecount count,
+                   long *first)
+/* Find buckets of envelope of a file of `frames' frames divided into
+   `buckets' buckets that `count' frames from `start' fall into. Frame `f'
+   goes to bucket `f * buckets / frames'. Put index of the first bucket
+   into `first' and return number of buckets. */
 {
-  /* Doing trivial things here, because we use only SSE and SSE2 here, but
-     necessary instructions for this format of samples are only in
-     SSE4.1. */
-  register AFframecount i;
-  int32_t tmp0 = 0, tmp1 = 0;
-  for (i = 0; i < c; i++)
-    {
-      int32_t a = *((int32_t *)frames + i);
-      if (a > tmp0) tmp0 = a;
-      if (a < tmp1) tmp1 = a;
-    }
-  double tp0 = fabs(tmp0) / 0x80000000;
-  double tp1 = fabs(tmp1) / 0x80000000;
-  return tp0 > tp1 ? tp0 : tp1;
+  *first = 0;
+  if (!buckets || count <= 0) return 0;
+  *first = start * buckets / frames;
+  return (start + count - 1) * buckets / frames - *first + 1;
 }
 
-static double peak_int16 (void *frames, AFframecount c)
+double peak_limit (const struct audio_params *params)
+/* Return the greatest peak samples of given format may have. Integer
+   samples cannot go beyond full scale, so once it's reached the rest of
+   the file cannot change the peak. Signed samples are normalized by
+   2^(width-1), so the greatest positive one is a bit less than 1 and
+   reaching it is enough, only the most negative one gives 1. Floating
+   point samples can be louder than full scale, they have no limit. */
 {
-  AFframecount t = c / 8;
-  __m128i *src = (__m128i *)frames;
-  __m128i m0 = _mm_set1_epi16 (0);
-  __m128i m1 = _mm_set1_epi16 (0);
-  register AFframecount i;
-  for (i = 0; i < t; i++, src++)
+  if (params->format == AF_SAMPFMT_TWOSCOMP)
+    return 1 - ldexp (1, 1 - params->width);
+  return params->format == AF_SAMPFMT_UNSIGNED ? 1 : HUGE_VAL;
+}
+
+static int scan_mapped (const struct lsa_context *ctx,
+                        AFfilehandle h,
+                        const char *path,
+                        struct audio_params *params,
+                        AFframecount start,
+                        AFframecount count,
+                        double *peak,
+                        struct channel_stats *stats,
+                        struct channel_stats *overview,
+                        struct loudness *loud,
+                        struct pcm_hash *hash)
+/* Calculate peak of `count' frames starting from `start' right in the
+   file mapped into memory, so samples are not copied anywhere. This is
+   only possible for uncompressed files which samples we have kernels for.
+   Statistics kernels (they also build envelopes), `loud', and `hash' only
+   take samples in native byte order that have the same layout as ones
+   that come from the library. The file is mapped
+   by windows of `LSA_MAP_SIZE' bytes, so we don't keep more than that of
+   it mapped at once. When only the peak is needed, windows are as big as
+   the decoding buffer, so scanning may stop soon after the peak reaches
+   full scale and the rest of the file is never read. Return 0 on success,
+   otherwise the caller should decode the frames as usual, `h' is not
+   touched. */
+{
+  if ((ctx->flags & LSA_NO_MMAP) ||
+      params->compression != AF_COMPRESSION_NONE)
+    return -1;
+  double scale;
+  int k = raw_kernel (params, afGetByteOrder (h, AF_DEFAULT_TRACK), &scale);
+  struct sample_scale sc;
+  if (k < 0 || ((stats || overview || loud || hash) &&
+                 (k >= K_STATS ||
+                  stats_format (params->format, params->width, &sc) != k)))
+    return -1;
+  long frame_size = params->width / 8 * params->channels;
+  if ((long)afGetFrameSize (h, AF_DEFAULT_TRACK, 0) != frame_size)
+    return -1;
+  int fd = open (path, O_RDONLY);
+  if (fd < 0) return -1;
+  off_t from = afGetDataOffset (h, AF_DEFAULT_TRACK) + start * frame_size;
+  struct stat sb;
+  if (fstat (fd, &sb) || from + count * frame_size > sb.st_size)
+    {
+      close (fd);
+      return -1;
+    }
+  long page = sysconf (_SC_PAGESIZE), first;
+  long nb = bucket_range (ctx->buckets, params->frames, start, count, &first);
+  double limit = stats || overview || loud || hash ? HUGE_VAL
+    : peak_limit (params);
+  AFframecount window = (limit < HUGE_VAL ? ctx->buffer_size : LSA_MAP_SIZE)
+    / frame_size, left = count;
+  double result = 0;
+  struct channel_stats *acc = stats ? stats_alloc (params->channels) : NULL;
+  if (window < 1) window = 1;
+  while (left > 0 && result < limit)
     {
-      m0 = _mm_max_epi16 (m0, *src);
-      m1 = _mm_min_epi16 (m1, *src);
+      AFframecount n = left < window ? left : window;
+      CTX_PROFILE_START (ctx, t);
+      off_t base = from & ~(off_t)(page - 1);
+      size_t len = from - base + n * frame_size;
+      void *m = mmap (NULL, len, PROT_READ, MAP_PRIVATE, fd, base);
+      if (m == MAP_FAILED) break;
+      madvise (m, len, MADV_SEQUENTIAL);
+      char *data = (char *)m + (from - base);
+      if (ctx->flags & LSA_PEAK)
+        {
+          double p = peak_kernels[k] (data, n * params->channels) / scale;
+          if (p > result) result = p;
+        }
+      if (overview)
+        fold_buckets (ctx, params, data, frame_size, start + count - left, n,
+                      k, &sc, overview, first);
+      else if (acc) stats_kernels[k] (data, n, params->channels, &sc, acc);
+      if (loud) loudness_add (loud, data, n, k, &sc);
+      if (hash) hash_add (hash, data, n * frame_size);
+      munmap (m, len);
+      CTX_PROFILE_END (ctx, t, PH_MAPPED, n * frame_size);
+      from += n * frame_size;
+      left -= n;
     }
-  union u
-  {
-    __m128i m;
-    int16_t n[8];
-  } mx0, mx1;
-  mx0.m = m0;
-  mx1.m = m1;
-  double tmp0 = 0, tmp1 = 0;
-  for (i = 0; i < 8; i++)
+  close (fd);
+  if (result >= limit) left = 0;
+  if (!left)
     {
-      int16_t a = *(mx0.n + i);
-      if (a > tmp0) tmp0 = a;
-      int16_t b = *(mx1.n + i);
-      if (b < tmp1) tmp1 = b;
+      *peak = result;
+      if (acc && overview) merge_buckets (acc, overview, nb, params->channels);
+      if (acc) stats_merge (stats, acc, params->channels);
     }
-  for (i = t * 8; i < c; i++)
+  else
     {
-      int16_t a = *((int16_t *)frames + i);
-      if (a > tmp0) tmp0 = a;
-      if (a < tmp1) tmp1 = a;
+      if (overview) stats_reset (overview, nb * params->channels);
+      if (loud) loudness_reset (loud);
+      if (hash) hash_init (hash, params);
     }
-  tmp0 = fabs(tmp0) / 0x8000;
-  tmp1 = fabs(tmp1) / 0x8000;
-  return tmp0 > tmp1 ? tmp0 : tmp1;
+  free (acc);
+  return left ? -1 : 0;
 }
 
-static double peak_int8 (void *frames, AFframecount c)
+static void fold_buckets (const struct lsa_context *ctx,
+                          const struct audio_params *params,
+                          const char *data,
+                          long frame_size,
+                          AFframecount from,
+                          AFframecount n,
+                          int k,
+                          const struct sample_scale *sc,
+                          struct channel_stats *overview,
+                          long first)
+/* Fold `n' frames of `frame_size' bytes in `data', which start from frame
+   `from' of the file, into buckets of its envelope, `overview' starts with
+   bucket `first'. Every bucket is reduced by its own call of statistics
+   kernel `k', so a block is still read only once. */
 {
-  /* need SSE4.1 */
-  register AFframecount i;
-  int8_t tmp0 = 0, tmp1 = 0;
-  for (i = 0; i < c; i++)
+  AFframecount frames = params->frames, end = from + n;
+  long buckets = ctx->buckets;
+  while (from < end)
     {
-      int8_t a = *((int8_t *)frames + i);
-      if (a > tmp0) tmp0 = a;
-      if (a < tmp1) tmp1 = a;
+      long b = from * buckets / frames;
+      AFframecount next = ((b + 1) * frames + buckets - 1) / buckets;
+      if (next > end) next = end;
+      stats_kernels[k] (data, next - from, params->channels, sc,
+                        overview + (b - first) * params->channels);
+      data += (next - from) * frame_size;
+      from = next;
     }
-  double tp0 = fabs(tmp0) / 0x80;
-  double tp1 = fabs(tmp1) / 0x80;
-  return tp0 > tp1 ? tp0 : tp1;
 }
 
-static double peak_uint32 (void *frames, AFframecount c)
+static void merge_buckets (struct channel_stats *acc,
+                           const struct channel_stats *overview,
+                           long nb,
+                           int channels)
+/* Add statistics of `nb' buckets of envelope to `acc'. When envelope is
+   built, statistics of the whole range are taken from it instead of
+   another run of kernels. */
 {
-  /* need SSE4.1 */
-  register AFframecount i;
-  uint32_t tmp0 = 0;
-  for (i = 0; i < c; i++)
+  long b;
+  for (b = 0; b < nb; b++)
     {
-      uint32_t a = *((uint32_t *)frames + i);
-      if (a > tmp0) tmp0 = a;
+      stats_merge (acc, overview + b * channels, channels);
     }
-  double tp0 = tmp0;
-  return tp0 / 0xffffffff;
 }
 
-static double peak_uint16 (void *frames, AFframecount c)
+static void scan_silence (const struct lsa_context *ctx,
+                          AFfilehandle h,
+                          const char *path,
+                          struct audio_params *params,
+                          void *buffer)
+/* Find how many frames at the beginning and at the end of file `h' are
+   silent, that is none of their samples is louder than threshold of
+   `ctx', and put them into `lead' and `trail' of `params'. Blocks are
+   read forward from the beginning until a loud frame is found, then we
+   seek to the end and read backward down to that frame. Blocks start
+   short and grow, so a file that doesn't begin and end with long silence
+   costs a couple of short reads. If `h' cannot be seeked, the file is
+   opened again on `path' and decoded from the beginning. On errors both
+   numbers stay zero. */
 {
-  /* need SSE4.1 */
-  register AFframecount i;
-  uint16_t tmp0 = 0;
-  for (i = 0; i < c; i++)
+  long frame_size = (long)afGetVirtualFrameSize (h, AF_DEFAULT_TRACK, 1);
+  AFframecount max = frame_size > 0 ? ctx->buffer_size / frame_size : 0;
+  if (max < 1) return;
+  if (max > INT_MAX) max = INT_MAX;
+  /* Peak kernels find magnitudes of signed samples only, so unsigned
+     samples are converted by the library. */
+  int format = params->format == AF_SAMPFMT_UNSIGNED ? AF_SAMPFMT_TWOSCOMP
+    : params->format;
+  AFfilehandle g = h;
+  AFframecount frames = params->frames, pos = 0, first = -1, last = -1,
+    loud = -1, block = LSA_SILENCE_BLOCK < max ? LSA_SILENCE_BLOCK : max,
+    end = frames;
+  if (afSeekFrame (h, AF_DEFAULT_TRACK, 0)) g = AF_NULL_FILEHANDLE;
+  while (first < 0 && pos < frames)
     {
-      uint16_t a = *((uint16_t *)frames + i);
-      if (a > tmp0) tmp0 = a;
+      if (g == AF_NULL_FILEHANDLE &&
+          (g = afOpenFile (path, "r", NULL)) == AF_NULL_FILEHANDLE)
+        return;
+      if (pos == 0 && format != params->format)
+        afSetVirtualSampleFormat (g, AF_DEFAULT_TRACK, format,
+                                  params->width);
+      if (block > frames - pos) block = frames - pos;
+      CTX_PROFILE_START (ctx, t);
+      int c = afReadFrames (g, AF_DEFAULT_TRACK, buffer, block);
+      CTX_PROFILE_END (ctx, t, PH_DECODE, c > 0 ? c * frame_size : 0);
+      if (c != block) break;
+      CTX_PROFILE_START (ctx, u);
+      first = find_loud (ctx, params, format, buffer, c, frame_size, 1);
+      if (first >= 0)
+        {
+          loud = pos + find_loud (ctx, params, format, buffer, c, frame_size,
+                                  0);
+          first += pos;
+        }
+      CTX_PROFILE_END (ctx, u, PH_KERNEL, c * frame_size);
+      pos += c;
+      if (block < max) block = block * 2 < max ? block * 2 : max;
+    }
+  /* The last loud frame is somewhere from `loud', the last loud frame we
+     have read, on. If we cannot seek, the rest of the file is decoded. */
+  int seekable = 1;
+  block = LSA_SILENCE_BLOCK < max ? LSA_SILENCE_BLOCK : max;
+  while (first >= 0 && last < 0 && end > loud + 1)
+    {
+      if (seekable)
+        {
+          if (block > end - loud - 1) block = end - loud - 1;
+          seekable = afSeekFrame (g, AF_DEFAULT_TRACK, end - block)
+            == end - block;
+          if (!seekable && end < frames) break;
+        }
+      if (!seekable) block = frames - pos < max ? frames - pos : max;
+      CTX_PROFILE_START (ctx, t);
+      int c = afReadFrames (g, AF_DEFAULT_TRACK, buffer, block);
+      CTX_PROFILE_END (ctx, t, PH_DECODE, c > 0 ? c * frame_size : 0);
+      if (c != block) break;
+      CTX_PROFILE_START (ctx, u);
+      AFframecount k =
+        find_loud (ctx, params, format, buffer, c, frame_size, 0);
+      CTX_PROFILE_END (ctx, u, PH_KERNEL, c * frame_size);
+      if (seekable)
+        {
+          if (k >= 0) last = end - block + k;
+          end -= block;
+          if (block < max) block = block * 2 < max ? block * 2 : max;
+        }
+      else
+        {
+          if (k >= 0) loud = pos + k;
+          pos += block;
+          if (pos == frames) last = loud;
+        }
+    }
+  if (g != h && g != AF_NULL_FILEHANDLE) afCloseFile (g);
+  if (first >= 0 && last < 0 && end <= loud + 1) last = loud;
+  if (first < 0 && pos == frames) params->lead = params->trail = frames;
+  else if (last >= 0)
+    {
+      params->lead = first;
+      params->trail = frames - 1 - last;
     }
-  double tp0 = tmp0;
-  return tp0 / 0xffff;
 }
 
-static double peak_uint8 (void *frames, AFframecount c)
+static AFframecount find_loud (const struct lsa_context *ctx,
+                               const struct audio_params *params,
+                               int format,
+                               const char *frames,
+                               AFframecount n,
+                               long frame_size,
+                               int forward)
+/* Return index of the first (or the last, unless `forward' is set) of `n'
+   frames that is louder than threshold of `ctx', or -1 if all of them
+   are silent. Frames are checked with peak kernels by slices of
+   `LSA_SILENCE_SLICE' frames, so we stop soon after a loud sample, and
+   then the slice is bisected. */
 {
-  AFframecount t = c / 16;
-  __m128i *src = (__m128i *)frames;
-  __m128i m0 = _mm_set1_epi8 (0);
-  register AFframecount i;
-  for (i = 0; i < t; i++, src++)
+  AFframecount i, m;
+  for (i = 0; i < n; i += m)
     {
-      m0 = _mm_max_epu8 (m0, *src);
+      m = n - i < LSA_SILENCE_SLICE ? n - i : LSA_SILENCE_SLICE;
+      const char *s = forward ? frames + i * frame_size
+        : frames + (n - i - m) * frame_size;
+      if (!is_loud (ctx, params, format, s, m)) continue;
+      /* `hi' frames from the edge of the slice are loud, `lo' frames are
+         silent. */
+      AFframecount lo = 0, hi = m;
+      while (hi - lo > 1)
+        {
+          AFframecount mid = lo + (hi - lo) / 2;
+          if (is_loud (ctx, params, format,
+                       forward ? s : s + (m - mid) * frame_size, mid))
+            hi = mid;
+          else lo = mid;
+        }
+      return forward ? i + lo : n - i - m + (m - hi);
     }
-  union u
-  {
-    __m128i m;
-    uint8_t n[16];
-  } mx0;
-  mx0.m = m0;
-  double tmp0 = 0;
-  for (i = 0; i < 8; i++)
+  return -1;
+}
+
+static int is_loud (const struct lsa_context *ctx,
+                    const struct audio_params *params,
+                    int format,
+                    const char *frames,
+                    AFframecount n)
+/* Check if any sample of `n' frames is louder than threshold of `ctx'. */
+{
+  return get_peak ((void *)frames, n * params->channels, format,
+                   params->width) > ctx->silence;
+}
+
+static int sample_peak (const struct lsa_context *ctx,
+                        AFfilehandle h,
+                        const char *path,
+                        struct audio_params *params,
+                        void *buffer)
+/* Find lower bound of peak of file `h' on `path' reading only some of its
+   blocks of `LSA_SAMPLE_BLOCK' frames (or less, if the buffer is
+   smaller): the frames are divided into blocks and the part of them given
+   by sampling ratio of `ctx' is read, one from the middle of every group
+   of consecutive blocks of equal length, so the whole file is covered.
+   Blocks are scanned in the mapped file when possible, so only their
+   pages are read, otherwise every block needs a seek. If peak reaches
+   full scale, it's exact and the rest of the blocks are not read.
+   `sampled' field of `params' is set unless the peak is exact. Return -1
+   if all blocks would be read or the file cannot be seeked, in this case
+   the caller should scan all frames, `h' is not touched then. Otherwise
+   return 0, if reading fails on the way, peak of the blocks read before
+   is still a lower bound, so it's kept and `sampled' is set. */
+{
+  long frame_size = (long)afGetVirtualFrameSize (h, AF_DEFAULT_TRACK, 1);
+  AFframecount block = frame_size > 0 ? ctx->buffer_size / frame_size : 0;
+  if (block < 1) return -1;
+  if (block > LSA_SAMPLE_BLOCK) block = LSA_SAMPLE_BLOCK;
+  AFframecount frames = params->frames, total = (frames + block - 1) / block,
+    n = (AFframecount)ceil (total * ctx->sample), i;
+  if (n < 1) n = 1;
+  if (n >= total) return -1;
+  double result = 0, limit = peak_limit (params);
+  for (i = 0; i < n && result < limit; i++)
     {
-      uint8_t a = *(mx0.n + i);
-      if (a > tmp0) tmp0 = a;
+      AFframecount from = (2 * i + 1) * total / (2 * n) * block;
+      AFframecount c = frames - from < block ? frames - from : block;
+      double p = 0;
+      if (!scan_mapped (ctx, h, path, params, from, c, &p, NULL, NULL, NULL,
+                        NULL))
+        {
+          if (p > result) result = p;
+          continue;
+        }
+      CTX_PROFILE_START (ctx, t);
+      if (afSeekFrame (h, AF_DEFAULT_TRACK, from) != from)
+        {
+          if (i == 0) return -1;
+          break;
+        }
+      int r = afReadFrames (h, AF_DEFAULT_TRACK, buffer, c);
+      CTX_PROFILE_END (ctx, t, PH_DECODE, r > 0 ? r * frame_size : 0);
+      if (r != c) break;
+      CTX_PROFILE_START (ctx, u);
+      p = get_peak (buffer, c * params->channels, params->format,
+                    params->width);
+      if (p > result) result = p;
+      CTX_PROFILE_END (ctx, u, PH_KERNEL, c * frame_size);
     }
-  for (i = t * 8; i < c; i++)
+  params->peak = result;
+  params->sampled = result < limit;
+  return 0;
+}
+
+static int raw_kernel (const struct audio_params *params,
+                       int byte_order,
+                       double *scale)
+/* Find kernel for samples as they are stored in uncompressed file with
+   given byte order and put full scale value into `scale'. Return -1 if we
+   have no such kernel. Samples that don't occupy whole number of bytes are
+   left to the library. */
+{
+  int be = byte_order == AF_BYTEORDER_BIGENDIAN;
+  *scale = 1;
+  switch (params->format)
     {
-      uint8_t a = *((uint8_t *)frames + i);
-      if (a > tmp0) tmp0 = a;
+    case AF_SAMPFMT_TWOSCOMP :
+      *scale = ldexp (1, params->width - 1);
+      switch (params->width)
+        {
+        case 8  : return K_INT8;
+        case 16 : return be ? K_INT16_BE : K_INT16;
+        case 24 : return be ? K_INT24_BE : K_INT24;
+        case 32 : return be ? K_INT32_BE : K_INT32;
+        }
+      break;
+    case AF_SAMPFMT_UNSIGNED :
+      *scale = 0xff;
+      if (params->width == 8) return K_UINT8;
+      break;
+    case AF_SAMPFMT_FLOAT :
+      if (params->width == 32) return be ? K_FLOAT_BE : K_FLOAT;
+      break;
+    case AF_SAMPFMT_DOUBLE :
+      if (params->width == 64) return be ? K_DOUBLE_BE : K_DOUBLE;
+      break;
     }
-  return tmp0 / 0xff;
+  return -1;
 }
 
-static double peak_float (void *frames, AFframecount c)
+static int scan_frames (const struct lsa_context *ctx,
+                        AFfilehandle h,
+                        struct audio_params *params,
+                        AFframecount start,
+                        AFframecount count,
+                        void *buffer,
+                        double *peak,
+                        struct channel_stats *stats,
+                        struct channel_stats *overview,
+                        struct loudness *loud,
+                        struct pcm_hash *hash)
+/* Read `count' frames from current position `start' of `h' block by block
+   into `buffer' and fold every block into `peak', `stats', `overview',
+   `loud', and `hash' (unless they are `NULL'). They are only kept if all
+   frames have been read, in this case 0 is returned. If only the peak is
+   needed, reading stops once it reaches full scale. */
 {
-  AFframecount t = c / 4;
-  __m128 *src = (__m128 *)frames;
-  __m128 m0 = _mm_set1_ps (0);
-  __m128 m1 = _mm_set1_ps (0);
-  register AFframecount i;
-  for (i = 0; i < t; i++, src++)
+  /* Find out how many frames fit into the buffer. */
+  long frame_size = (long)afGetVirtualFrameSize (h, AF_DEFAULT_TRACK, 1);
+  AFframecount block = frame_size > 0 ? ctx->buffer_size / frame_size : 0;
+  if (block < 1)
     {
-      m0 = _mm_max_ps (m0, *src);
-      m1 = _mm_min_ps (m1, *src);
+      fprintf (stderr, "lsa: buffer is too small for frames of %ld bytes\n",
+               frame_size);
+      return -1;
     }
-  union u
-  {
-    __m128 m;
-    float n[4];
-  } mx0, mx1;
-  mx0.m = m0;
-  mx1.m = m1;
-  double tmp0 = 0, tmp1 = 0;
-  for (i = 0; i < 8; i++)
+  if (block > INT_MAX) block = INT_MAX;
+  AFframecount left = count;
+  double result = 0;
+  struct sample_scale sc;
+  int k = stats || overview || loud ?
+    stats_format (params->format, params->width, &sc) : -1;
+  struct channel_stats *acc =
+    stats && k >= 0 ? stats_alloc (params->channels) : NULL;
+  long first;
+  long nb = bucket_range (ctx->buckets, params->frames, start, count, &first);
+  double limit = stats || overview || loud || hash ? HUGE_VAL
+    : peak_limit (params);
+  while (left > 0 && result < limit)
     {
-      float a = *(mx0.n + i);
-      if (a > tmp0) tmp0 = a;
-      float b = *(mx1.n + i);
-      if (b < tmp1) tmp1 = b;
+      CTX_PROFILE_START (ctx, t);
+      int c = afReadFrames (h, AF_DEFAULT_TRACK, buffer,
+                            left < block ? left : block);
+      CTX_PROFILE_END (ctx, t, PH_DECODE, c > 0 ? c * frame_size : 0);
+      if (c <= 0) break;
+      CTX_PROFILE_START (ctx, u);
+      if (ctx->flags & LSA_PEAK)
+        {
+          double p = get_peak (buffer,
+                               (AFframecount)c * params->channels,
+                               params->format,
+                               params->width);
+          if (p > result) result = p;
+        }
+      if (overview && k >= 0)
+        fold_buckets (ctx, params, buffer, frame_size, start + count - left,
+                      c, k, &sc, overview, first);
+      else if (acc) stats_kernels[k] (buffer, c, params->channels, &sc, acc);
+      if (loud && k >= 0) loudness_add (loud, buffer, c, k, &sc);
+      if (hash) hash_add (hash, buffer, c * frame_size);
+      CTX_PROFILE_END (ctx, u, PH_KERNEL, c * frame_size);
+      left -= c;
     }
-  for (i = t * 8; i < c; i++)
+  if (result >= limit) left = 0;
+  if (!left)
     {
-      float a = *((float *)frames + i);
-      if (a > tmp0) tmp0 = a;
-      if (a < tmp1) tmp1 = a;
+      *peak = result;
+      if (acc && overview) merge_buckets (acc, overview, nb, params->channels);
+      if (acc) stats_merge (stats, acc, params->channels);
     }
-  tmp0 = fabs(tmp0);
-  tmp1 = fabs(tmp1);
-  return tmp0 > tmp1 ? tmp0 : tmp1;
+  else
+    {
+      if (overview) stats_reset (overview, nb * params->channels);
+      if (loud) loudness_reset (loud);
+      if (hash) hash_init (hash, params);
+    }
+  free (acc);
+  return left ? -1 : 0;
 }
 
-static double peak_double (void *frames, AFframecount c)
+static double get_peak (void *frames, AFframecount c, int format, int width)
+/* Find peak of `c' samples in `frames' as they come from the library with
+   the kernel selected for given sample format and normalize it. The
+   library keeps samples right-justified in containers of 1, 2, or 4 bytes
+   (24 bit samples are sign-extended to 32 bits, it has no virtual format
+   of packed ones, so packed 24 bit kernels only serve mapped files), and
+   we normalize by full scale of the real width, not of the container. */
 {
-  AFframecount t = c / 2;
-  __m128d *src = (__m128d *)frames;
-  __m128d m0 = _mm_set1_pd (0);
-  __m128d m1 = _mm_set1_pd (0);
-  register AFframecount i;
-  for (i = 0; i < t; i++, src++)
-    {
-      m0 = _mm_max_pd (m0, *src);
-      m1 = _mm_min_pd (m1, *src);
-    }
-  union u
-  {
-    __m128d m;
-    double n[2];
-  } mx0, mx1;
-  mx0.m = m0;
-  mx1.m = m1;
-  double tmp0 = 0, tmp1 = 0;
-  for (i = 0; i < 8; i++)
+  if (format == AF_SAMPFMT_TWOSCOMP)
     {
-      double a = *(mx0.n + i);
-      if (a > tmp0) tmp0 = a;
-      double b = *(mx1.n + i);
-      if (b < tmp1) tmp1 = b;
+      double scale = ldexp (1, width - 1);
+      if (width > 16) return peak_kernels[K_INT32] (frames, c) / scale;
+      else if (width > 8) return peak_kernels[K_INT16] (frames, c) / scale;
+      else return peak_kernels[K_INT8] (frames, c) / scale;
     }
-  for (i = t * 8; i < c; i++)
+  else if (format == AF_SAMPFMT_UNSIGNED)
     {
-      double a = *((double *)frames + i);
-      if (a > tmp0) tmp0 = a;
-      if (a < tmp1) tmp1 = a;
+      double scale = ldexp (1, width) - 1;
+      if (width > 16) return peak_kernels[K_UINT32] (frames, c) / scale;
+      else if (width > 8) return peak_kernels[K_UINT16] (frames, c) / scale;
+      else return peak_kernels[K_UINT8] (frames, c) / scale;
     }
-  tmp0 = fabs(tmp0);
-  tmp1 = fabs(tmp1);
-  return tmp0 > tmp1 ? tmp0 : tmp1;
+  else if (format == AF_SAMPFMT_FLOAT) return peak_kernels[K_FLOAT] (frames, c);
+  else if (format == AF_SAMPFMT_DOUBLE)
+    return peak_kernels[K_DOUBLE] (frames, c);
+  return 0;
 }
@@ -0,0 +1,98 @@
+/*
+ * This file is part of LSA.
+ *
+ * Copyright © 2014–2017 Mark Karpov
+ *
+ * LSA is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * LSA is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "lsa.h"
+
+/* Arenas hold lots of small objects that live until the whole listing is
+   printed: names of files and their results. Objects are carved one after
+   another out of big blocks, so they cost no `malloc' each, have no
+   per-object overhead, and objects that are created together lie next to
+   each other in memory. Everything is freed at once. An arena is used by
+   one thread at a time, every worker has its own. */
+
+/* structures */
+
+struct arena_block /* block objects are carved from */
+{
+  struct arena_block *prev; /* previous block of the arena */
+  size_t size; /* bytes in `data' */
+  max_align_t data[]; /* aligned for any object */
+};
+
+/* declarations */
+
+static int arena_grow (struct arena *, size_t);
+
+/* functions */
+
+void *arena_alloc (struct arena *a, size_t size)
+/* Allocate `size' bytes in arena `a', aligned for any object. Return
+   `NULL' if there's no memory. */
+{
+  size_t align = sizeof (max_align_t),
+    off = (a->used + align - 1) & ~(align - 1);
+  if (!a->block || off + size > a->block->size)
+    {
+      if (arena_grow (a, size)) return NULL;
+      off = 0;
+    }
+  a->used = off + size;
+  return (char *)a->block->data + off;
+}
+
+char *arena_string (struct arena *a, const char *s, size_t len)
+/* Copy first `len' chars of string `s' into arena `a'. Strings are not
+   aligned, so names of files are packed tightly. Return `NULL' if there's
+   no memory. */
+{
+  if ((!a->block || a->used + len + 1 > a->block->size) &&
+      arena_grow (a, len + 1))
+    return NULL;
+  char *p = (char *)a->block->data + a->used;
+  memcpy (p, s, len);
+  *(p + len) = '\0';
+  a->used += len + 1;
+  return p;
+}
+
+void arena_free (struct arena *a)
+/* Free everything allocated in arena `a', it may be used again. */
+{
+  while (a->block)
+    {
+      struct arena_block *b = a->block;
+      a->block = b->prev;
+      free (b);
+    }
+  a->used = 0;
+}
+
+static int arena_grow (struct arena *a, size_t size)
+/* Start new block of arena `a' that has room for at least `size' bytes,
+   the rest of the current block is left unused. Return 0 on success. */
+{
+  size_t n = size > LSA_ARENA_BLOCK ? size : LSA_ARENA_BLOCK;
+  struct arena_block *b = malloc (sizeof (*b) + n);
+  if (!b) return -1;
+  b->prev = a->block;
+  b->size = n;
+  a->block = b;
+  a->used = 0;
+  return 0;
+}
@@ -0,0 +1,331 @@
+/*
+ * This file is part of LSA.
+ *
+ * Copyright © 2014–2017 Mark Karpov
+ *
+ * LSA is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * LSA is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "lsa.h"
+
+/* The cache is a file per directory stored in `$XDG_CACHE_HOME/lsa' (or
+   `~/.cache/lsa'), its name is made of device and inode numbers of the
+   directory, so it survives renaming of the directory. The file starts
+   with a header followed by records sorted by device and inode numbers of
+   files. A record is valid only if size and modification time of its file
+   haven't changed. The file is mapped into memory and searched with binary
+   search, so lookups cost nothing but `stat' of the file. With `--shard'
+   a run sees only some of the files, so records of other files are kept
+   when the cache is written back. */
+
+/* structures & constants */
+
+#define CACHE_MAGIC   "LSAC"
+#define CACHE_VERSION 2
+
+struct cache_header
+{
+  char magic[4];
+  uint32_t version;
+  uint64_t count; /* number of records that follow the header */
+};
+
+struct cache_record
+{
+  uint64_t dev;
+  uint64_t ino;
+  uint64_t size;
+  uint64_t mtime; /* in nanoseconds */
+  int64_t frames;
+  double kbps;
+  double peak;
+  uint64_t hash;
+  int32_t channels;
+  int32_t compression;
+  int32_t format;
+  int32_t rate;
+  int32_t width;
+  int32_t flags; /* set of `CACHE_*' flags */
+};
+
+struct cache
+{
+  char *path; /* name of cache file */
+  void *map; /* mapped cache file or `NULL' */
+  size_t map_len;
+  struct cache_record *records; /* points into `map' */
+  uint64_t count;
+};
+
+/* declarations */
+
+static void cache_map (struct cache *);
+static long merge_records (struct cache *, struct cache_record **, long);
+static char *cache_path (const char *);
+static void make_dirs (char *);
+static int cmp_record (const void *, const void *);
+
+/* definitions */
+
+struct cache *cache_open (const char *dir, int load)
+/* Find cache file for directory `dir' and map it into memory if `load' is
+   set. Return `NULL' if there's no place to store cache for the
+   directory. */
+{
+  char *path = cache_path (dir);
+  if (!path) return NULL;
+  struct cache *c = calloc (1, sizeof (*c));
+  c->path = path;
+  if (load) cache_map (c);
+  return c;
+}
+
+static void cache_map (struct cache *c)
+/* Map cache file of `c' into memory, unless it's missing or damaged. */
+{
+  int fd = open (c->path, O_RDONLY);
+  if (fd < 0) return;
+  struct stat sb;
+  if (fstat (fd, &sb) == 0 &&
+      sb.st_size >= (off_t)sizeof (struct cache_header))
+    {
+      c->map = mmap (NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+      if (c->map == MAP_FAILED) c->map = NULL;
+      else c->map_len = sb.st_size;
+    }
+  close (fd);
+  if (!c->map) return;
+  /* Check that the file is not damaged and has the right version. */
+  struct cache_header *h = c->map;
+  if (memcmp (h->magic, CACHE_MAGIC, 4) ||
+      h->version != CACHE_VERSION ||
+      h->count != (c->map_len - sizeof (*h)) / sizeof (struct cache_record) ||
+      (c->map_len - sizeof (*h)) % sizeof (struct cache_record))
+    {
+      munmap (c->map, c->map_len);
+      c->map = NULL;
+      return;
+    }
+  c->records = (struct cache_record *)(h + 1);
+  c->count = h->count;
+}
+
+void cache_key (const struct stat *sb, struct cache_key *key)
+/* Fill `key' with information from `sb' that identifies contents of a
+   file. */
+{
+  key->dev = sb->st_dev;
+  key->ino = sb->st_ino;
+  key->size = sb->st_size;
+  key->mtime = (uint64_t)sb->st_mtim.tv_sec * 1000000000 +
+    sb->st_mtim.tv_nsec;
+  key->flags = 0;
+}
+
+int cache_lookup (struct cache *c,
+                  struct cache_key *key,
+                  struct audio_params *p)
+/* Find record for file identified by `key'. If found record is up to date
+   and has everything that has been requested, put parameters of the file
+   into `p', flags of the record into `key', and return 0, otherwise
+   return -1. */
+{
+  if (!c || !c->records) return -1;
+  struct cache_record k;
+  k.dev = key->dev;
+  k.ino = key->ino;
+  struct cache_record *r =
+    bsearch (&k, c->records, c->count, sizeof (k), cmp_record);
+  if (!r || r->size != key->size || r->mtime != key->mtime) return -1;
+  if (op_peak && !(r->flags & CACHE_PEAK)) return -1;
+  if (op_hash && !(r->flags & CACHE_HASH)) return -1;
+  /* statistics, envelopes, silence, and loudness are not cached */
+  if (op_stats || overview_buckets || op_silence || op_true_peak ||
+      op_loudness)
+    return -1;
+  p->frames = r->frames;
+  p->kbps = r->kbps;
+  p->peak = r->flags & CACHE_PEAK ? r->peak : 0;
+  p->channels = r->channels;
+  p->compression = r->compression;
+  p->format = r->format;
+  p->rate = r->rate;
+  p->width = r->width;
+  p->duration = (double)p->frames / p->rate;
+  p->stats = NULL;
+  p->overview = NULL;
+  p->lead = p->trail = 0;
+  p->true_peak = 0;
+  p->loudness = -HUGE_VAL;
+  p->lra = 0;
+  p->hash = r->flags & CACHE_HASH ? r->hash : 0;
+  p->sampled = 0;
+  key->flags = r->flags;
+  return 0;
+}
+
+void cache_save (struct cache *c,
+                 struct audio_params **params,
+                 struct cache_key *keys,
+                 long n)
+/* Replace cache file with records for given files. Files that have
+   `NULL' parameters or zero device and inode numbers are skipped. The new
+   file is written under temporary name and then renamed, so readers never
+   see incomplete file. With `--shard' other records of the file are kept,
+   see `merge_records'. Errors are not reported, cache is optional. */
+{
+  if (!c) return;
+  struct cache_record *records = calloc (n ? n : 1, sizeof (*records));
+  long i, count = 0;
+  for (i = 0; i < n; i++)
+    {
+      struct audio_params *p = *(params + i);
+      struct cache_key *k = keys + i;
+      if (!p || (!k->dev && !k->ino)) continue;
+      struct cache_record *r = records + count++;
+      r->dev = k->dev;
+      r->ino = k->ino;
+      r->size = k->size;
+      r->mtime = k->mtime;
+      r->frames = p->frames;
+      r->kbps = p->kbps;
+      r->peak = p->peak;
+      r->hash = p->hash;
+      r->channels = p->channels;
+      r->compression = p->compression;
+      r->format = p->format;
+      r->rate = p->rate;
+      r->width = p->width;
+      r->flags = k->flags;
+    }
+  qsort (records, count, sizeof (*records), cmp_record);
+  make_dirs (c->path);
+  /* Shards of one directory may be run at the same time, so they take
+     turns to merge their records, locking directory of cache files. */
+  int lock = -1;
+  if (shard_count > 1)
+    {
+      char *dir = malloc (strlen (c->path) + 1);
+      strcpy (dir, c->path);
+      *strrchr (dir, '/') = '\0';
+      lock = open (dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+      free (dir);
+      if (lock >= 0) flock (lock, LOCK_EX);
+      count = merge_records (c, &records, count);
+    }
+  struct cache_header h;
+  memcpy (h.magic, CACHE_MAGIC, 4);
+  h.version = CACHE_VERSION;
+  h.count = count;
+  char *temp = malloc (strlen (c->path) + 32);
+  sprintf (temp, "%s.%ld", c->path, (long)getpid ());
+  FILE *f = fopen (temp, "wb");
+  if (f)
+    {
+      int ok = fwrite (&h, sizeof (h), 1, f) == 1 &&
+        fwrite (records, sizeof (*records), count, f) == (size_t)count;
+      if (fclose (f) == 0 && ok) rename (temp, c->path);
+      else unlink (temp);
+    }
+  if (lock >= 0) close (lock);
+  free (temp);
+  free (records);
+}
+
+static long merge_records (struct cache *c,
+                           struct cache_record **records,
+                           long n)
+/* Add records of cache file of `c' for files that are not among `n'
+   sorted `records' to them and sort them again. The file is mapped again,
+   because other runs may have written it since it has been opened.
+   Records of deleted files stay until a run over all files rewrites the
+   cache, but they never match a file: inodes of new files differ or have
+   other sizes or modification times. Return new number of records. */
+{
+  if (c->map) munmap (c->map, c->map_len);
+  c->map = NULL;
+  c->records = NULL;
+  c->count = 0;
+  cache_map (c);
+  if (!c->count) return n;
+  struct cache_record *v = realloc (*records, sizeof (*v) * (n + c->count));
+  if (!v) return n;
+  *records = v;
+  long total = n;
+  uint64_t i;
+  for (i = 0; i < c->count; i++)
+    {
+      struct cache_record *r = c->records + i;
+      if (!bsearch (r, v, n, sizeof (*v), cmp_record))
+        *(v + total++) = *r;
+    }
+  qsort (v, total, sizeof (*v), cmp_record);
+  return total;
+}
+
+void cache_close (struct cache *c)
+/* Unmap cache file and free the structure. */
+{
+  if (!c) return;
+  if (c->map) munmap (c->map, c->map_len);
+  free (c->path);
+  free (c);
+}
+
+static char *cache_path (const char *dir)
+/* Return newly allocated name of cache file for directory `dir'.
+   Directories leading to it are only created when it's written, see
+   `make_dirs', so reading the cache costs no system calls but `stat'
+   and `open'. */
+{
+  struct stat sb;
+  if (stat (dir, &sb)) return NULL;
+  const char *base = getenv ("XDG_CACHE_HOME");
+  const char *suffix = "/lsa";
+  if (!base || *base != '/')
+    {
+      base = getenv ("HOME");
+      suffix = "/.cache/lsa";
+    }
+  if (!base || !*base) return NULL;
+  char *path = malloc (strlen (base) + strlen (suffix) + 40);
+  strcpy (path, base);
+  strcat (path, suffix);
+  sprintf (path + strlen (path), "/%lx-%lx",
+           (unsigned long)sb.st_dev, (unsigned long)sb.st_ino);
+  return path;
+}
+
+static void make_dirs (char *path)
+/* Create every missing directory on the way to file on `path', `path' is
+   changed temporarily. */
+{
+  char *s, *end = strrchr (path, '/');
+  for (s = path + 1; s <= end; s++)
+    {
+      if (*s != '/') continue;
+      *s = '\0';
+      mkdir (path, 0755);
+      *s = '/';
+    }
+}
+
+static int cmp_record (const void *a, const void *b)
+/* Compare cache records by device and inode numbers. */
+{
+  const struct cache_record *x = a, *y = b;
+  if (x->dev != y->dev) return x->dev < y->dev ? -1 : 1;
+  if (x->ino != y->ino) return x->ino < y->ino ? -1 : 1;
+  return 0;
+}
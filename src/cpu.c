@@ -0,0 +1,111 @@
+/*
+ * This file is part of LSA.
+ *
+ * Copyright © 2014–2017 Mark Karpov
+ *
+ * LSA is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * LSA is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE /* sched_getaffinity, pthread_setaffinity_np */
+
+#include "lsa.h"
+#include <sched.h>     /* CPU sets */
+
+/* Number of CPUs we may use and pinning of worker threads to them
+   (`--pin'). By default we start as many workers as there are CPUs in
+   affinity mask of the process, but no more than its cgroup CPU quota
+   allows, so in a container limited to 4 CPUs on a big host we don't
+   start a thread per CPU of the host. */
+
+/* global variables */
+
+static cpu_set_t cpus; /* CPUs the process may run on */
+static long next_cpu; /* index of CPU the next pinned thread takes,
+                         accessed atomically */
+
+/* declarations */
+
+static long cgroup_quota (void);
+
+/* functions */
+
+long cpu_count (void)
+/* Return number of worker threads to start by default. This must be
+   called before any threads are started. */
+{
+  long n;
+  if (!sched_getaffinity (0, sizeof (cpus), &cpus)) n = CPU_COUNT (&cpus);
+  else
+    {
+      n = sysconf (_SC_NPROCESSORS_ONLN);
+      long i;
+      CPU_ZERO (&cpus);
+      for (i = 0; i < n && i < CPU_SETSIZE; i++)
+        {
+          CPU_SET (i, &cpus);
+        }
+    }
+  long quota = cgroup_quota ();
+  if (quota > 0 && quota < n) n = quota;
+  return n > 0 ? n : 1;
+}
+
+void cpu_pin (void)
+/* Pin calling thread to the next CPU it may run on. Threads take CPUs in
+   order, so they are spread evenly when there are as many of them as
+   CPUs. */
+{
+  long count = CPU_COUNT (&cpus);
+  if (!count) return;
+  long k = __atomic_fetch_add (&next_cpu, 1, __ATOMIC_RELAXED) % count;
+  long i;
+  for (i = 0; i < CPU_SETSIZE; i++)
+    {
+      if (CPU_ISSET (i, &cpus) && !k--)
+        {
+          cpu_set_t one;
+          CPU_ZERO (&one);
+          CPU_SET (i, &one);
+          pthread_setaffinity_np (pthread_self (), sizeof (one), &one);
+          return;
+        }
+    }
+}
+
+static long cgroup_quota (void)
+/* Return CPU quota of our cgroup rounded up to whole CPUs, or 0 if there
+   is no quota. Both cgroup v2 (`cpu.max') and v1 (`cpu.cfs_quota_us' and
+   `cpu.cfs_period_us') are understood. */
+{
+  long quota = -1, period = 0;
+  FILE *f = fopen ("/sys/fs/cgroup/cpu.max", "r");
+  if (f)
+    {
+      if (fscanf (f, "%ld %ld", &quota, &period) != 2) quota = -1;
+      fclose (f);
+    }
+  else if ((f = fopen ("/sys/fs/cgroup/cpu/cpu.cfs_quota_us", "r")))
+    {
+      if (fscanf (f, "%ld", &quota) != 1) quota = -1;
+      fclose (f);
+      if ((f = fopen ("/sys/fs/cgroup/cpu/cpu.cfs_period_us", "r")))
+        {
+          if (fscanf (f, "%ld", &period) != 1) period = 0;
+          fclose (f);
+        }
+    }
+  /* "max" in `cpu.max' doesn't scan as a number, so `quota' stays -1. */
+  if (quota <= 0 || period <= 0) return 0;
+  return (quota + period - 1) / period;
+}
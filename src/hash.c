@@ -0,0 +1,289 @@
+/*
+ * This file is part of LSA.
+ *
+ * Copyright © 2014–2017 Mark Karpov
+ *
+ * LSA is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * LSA is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "lsa.h"
+
+/* Hash of samples (`--hash'), so the same audio stored in different
+   containers can be found. Samples are hashed as they come from the
+   library: in native byte order, right-justified in containers of 1, 2,
+   or 4 bytes, so WAVE, AIFF, and FLAC files with the same samples get the
+   same hash. Unsigned samples that fill their containers are hashed as
+   signed ones (the sign bit is flipped on the fly). Sample rate, number
+   of channels, and width are mixed into the result.
+
+   The hash is modeled after XXH3: 8 lanes of 64 bit accumulators take a
+   stripe of `HASH_STRIPE' bytes at a time, every lane adds product of low
+   and high halves of its data mixed with a key and adds the data itself
+   to the neighbor lane. After every `HASH_BLOCK' stripes the accumulators
+   are scrambled. Hash kernels only accumulate stripes, lanes are
+   independent, so vector kernels give exactly the same result as scalar
+   code. Incomplete stripes are kept between calls, so the hash doesn't
+   depend on how samples are split into blocks. */
+
+#define HASH_BLOCK 16 /* stripes between scrambles */
+
+#define PRIME32_1 0x9e3779b1ULL
+#define PRIME32_2 0x85ebca77ULL
+#define PRIME32_3 0xc2b2ae3dULL
+#define PRIME64_1 0x9e3779b185ebca87ULL
+#define PRIME64_2 0xc2b2ae3d27d4eb4fULL
+#define PRIME64_3 0x165667b19e3779f9ULL
+#define PRIME64_4 0x85ebca77c2b2ae63ULL
+#define PRIME64_5 0x27d4eb2f165667c5ULL
+
+/* global variables */
+
+hash_kernel hash_stripes; /* kernel selected by `select_kernels' */
+
+/* Keys: stripe `s' of a block uses 64 bytes from byte `8 * s', the last 64
+   bytes also scramble the accumulators. */
+
+static const uint64_t hash_secret[24] =
+  { 0x64439a36ce77a7f6ULL, 0x05def1f163014f4dULL, 0xb85b3dae384c6ac4ULL,
+    0x4428fe557d940af0ULL, 0x5e4d8004366178baULL, 0x0c7c3cfd370893c5ULL,
+    0xb4ac554802cfb12dULL, 0x0439189414795f51ULL, 0x4642d50e2d9460e2ULL,
+    0x2b9436a3c5e22d7fULL, 0x982327f7edd4adcdULL, 0xa29ede9bcfe973f5ULL,
+    0x16e8bac53c390e46ULL, 0x858fcbf74a3b76f2ULL, 0xf68e567273a8962fULL,
+    0x4e95d94b30a85f0cULL, 0x12f3104d0ed9ca68ULL, 0xea1384316d68fd4aULL,
+    0x54f44c3880b4cdd9ULL, 0x948983633a0b2616ULL, 0x3bc78f67a38290daULL,
+    0xcade03a9d482e34eULL, 0x6348d8ffc2e53029ULL, 0xf17dd4a2db47ad08ULL };
+
+/* declarations */
+
+static void hash_scalar (uint64_t *, const void *, long, const void *,
+                         uint64_t);
+static void hash_sse2 (uint64_t *, const void *, long, const void *,
+                       uint64_t);
+static void hash_avx2 (uint64_t *, const void *, long, const void *,
+                       uint64_t);
+static void add_stripes (struct pcm_hash *, const unsigned char *, long);
+static uint64_t mix (uint64_t, uint64_t);
+static uint64_t avalanche (uint64_t);
+
+/* kernels */
+
+const hash_kernel hash_kernel_table[ISA_TOTAL] =
+  { [ISA_SCALAR] = hash_scalar,
+    [ISA_SSE2]   = hash_sse2,
+    [ISA_AVX2]   = hash_avx2 };
+
+static void hash_scalar (uint64_t *acc,
+                         const void *data,
+                         long n,
+                         const void *key,
+                         uint64_t mask)
+/* Fold `n' stripes of `data' into accumulators `acc', stripe `s' uses
+   keys from `key' + 8 * `s' bytes. */
+{
+  const unsigned char *d = data, *k = key;
+  long s;
+  int i;
+  for (s = 0; s < n; s++, d += HASH_STRIPE, k += 8)
+    for (i = 0; i < 8; i++)
+      {
+        uint64_t v = load_sample (uint64_t, d, i) ^ mask;
+        uint64_t x = v ^ load_sample (uint64_t, k, i);
+        *(acc + (i ^ 1)) += v;
+        *(acc + i) += (x & 0xffffffff) * (x >> 32);
+      }
+}
+
+/* A vector step folds `sizeof (vec)' bytes of a stripe at `d' with keys
+   at `k' into accumulators `a'. */
+
+#define HASH_STEP(a, d, k, m, vec, load, xor, shuffle, add, mul)        \
+  do                                                                    \
+    {                                                                   \
+      vec _v = xor (load ((const vec *)(d)), (m));                      \
+      vec _x = xor (_v, load ((const vec *)(k)));                       \
+      (a) = add ((a), shuffle (_v, _MM_SHUFFLE (1, 0, 3, 2)));          \
+      (a) = add ((a), mul (_x, shuffle (_x, _MM_SHUFFLE (0, 3, 0, 1)))); \
+    }                                                                   \
+  while (0)
+
+#define SSE2_STEP(a, d, k)                                              \
+  HASH_STEP (a, d, k, m, __m128i, _mm_loadu_si128, _mm_xor_si128,       \
+             _mm_shuffle_epi32, _mm_add_epi64, _mm_mul_epu32)
+#define AVX2_STEP(a, d, k)                                              \
+  HASH_STEP (a, d, k, m, __m256i, _mm256_loadu_si256, _mm256_xor_si256, \
+             _mm256_shuffle_epi32, _mm256_add_epi64, _mm256_mul_epu32)
+
+__attribute__ ((target ("sse2")))
+static void hash_sse2 (uint64_t *acc,
+                       const void *data,
+                       long n,
+                       const void *key,
+                       uint64_t mask)
+/* SSE2 version of `hash_scalar'. */
+{
+  const unsigned char *d = data, *k = key;
+  __m128i m = _mm_set1_epi64x (mask);
+  __m128i a0 = _mm_loadu_si128 ((const __m128i *)acc);
+  __m128i a1 = _mm_loadu_si128 ((const __m128i *)acc + 1);
+  __m128i a2 = _mm_loadu_si128 ((const __m128i *)acc + 2);
+  __m128i a3 = _mm_loadu_si128 ((const __m128i *)acc + 3);
+  long s;
+  for (s = 0; s < n; s++, d += HASH_STRIPE, k += 8)
+    {
+      SSE2_STEP (a0, d, k);
+      SSE2_STEP (a1, d + 16, k + 16);
+      SSE2_STEP (a2, d + 32, k + 32);
+      SSE2_STEP (a3, d + 48, k + 48);
+    }
+  _mm_storeu_si128 ((__m128i *)acc, a0);
+  _mm_storeu_si128 ((__m128i *)acc + 1, a1);
+  _mm_storeu_si128 ((__m128i *)acc + 2, a2);
+  _mm_storeu_si128 ((__m128i *)acc + 3, a3);
+}
+
+__attribute__ ((target ("avx2")))
+static void hash_avx2 (uint64_t *acc,
+                       const void *data,
+                       long n,
+                       const void *key,
+                       uint64_t mask)
+/* AVX2 version of `hash_scalar'. */
+{
+  const unsigned char *d = data, *k = key;
+  __m256i m = _mm256_set1_epi64x (mask);
+  __m256i a0 = _mm256_loadu_si256 ((const __m256i *)acc);
+  __m256i a1 = _mm256_loadu_si256 ((const __m256i *)acc + 1);
+  long s;
+  for (s = 0; s < n; s++, d += HASH_STRIPE, k += 8)
+    {
+      AVX2_STEP (a0, d, k);
+      AVX2_STEP (a1, d + 32, k + 32);
+    }
+  _mm256_storeu_si256 ((__m256i *)acc, a0);
+  _mm256_storeu_si256 ((__m256i *)acc + 1, a1);
+}
+
+/* functions */
+
+void hash_init (struct pcm_hash *h, const struct audio_params *params)
+/* Start hash of samples of file with given `params'. */
+{
+  static const uint64_t init[8] =
+    { PRIME32_3, PRIME64_1, PRIME64_2, PRIME64_3, PRIME64_4, PRIME32_2,
+      PRIME64_5, PRIME32_1 };
+  int format = params->format, width = params->width;
+  memcpy (h->acc, init, sizeof (init));
+  h->tail_len = 0;
+  h->stripe = 0;
+  h->length = 0;
+  h->mask = 0;
+  if (format == AF_SAMPFMT_UNSIGNED &&
+      (width == 8 || width == 16 || width == 32))
+    {
+      h->mask = width == 8 ? 0x8080808080808080ULL
+        : width == 16 ? 0x8000800080008000ULL : 0x8000000080000000ULL;
+      format = AF_SAMPFMT_TWOSCOMP;
+    }
+  h->format = (uint64_t)params->rate << 32 |
+    (uint64_t)(params->channels & 0xffff) << 16 | (width & 0xff) << 8 |
+    (format & 0xff);
+}
+
+void hash_add (struct pcm_hash *h, const void *data, size_t len)
+/* Add `len' bytes of samples in `data' to hash `h'. */
+{
+  const unsigned char *d = data;
+  h->length += len;
+  if (h->tail_len)
+    {
+      size_t n = HASH_STRIPE - h->tail_len;
+      if (n > len) n = len;
+      memcpy (h->tail + h->tail_len, d, n);
+      h->tail_len += n;
+      d += n;
+      len -= n;
+      if (h->tail_len < HASH_STRIPE) return;
+      add_stripes (h, h->tail, 1);
+      h->tail_len = 0;
+    }
+  long stripes = len / HASH_STRIPE;
+  add_stripes (h, d, stripes);
+  d += stripes * HASH_STRIPE;
+  h->tail_len = len - stripes * HASH_STRIPE;
+  memcpy (h->tail, d, h->tail_len);
+}
+
+uint64_t hash_done (struct pcm_hash *h)
+/* Return hash of everything added to `h'. The last incomplete stripe is
+   padded with bytes that become zeros once the mask is applied, the
+   length tells them from real zeros. */
+{
+  if (h->tail_len)
+    {
+      const unsigned char *m = (const unsigned char *)&h->mask;
+      size_t i;
+      for (i = h->tail_len; i < HASH_STRIPE; i++)
+        *(h->tail + i) = *(m + i % 8);
+      add_stripes (h, h->tail, 1);
+    }
+  uint64_t r = h->length * PRIME64_1 + h->format * PRIME64_2;
+  int i;
+  for (i = 0; i < 4; i++)
+    {
+      r += mix (h->acc[2 * i] ^ hash_secret[2 * i + 1],
+                h->acc[2 * i + 1] ^ hash_secret[2 * i + 2]);
+    }
+  return avalanche (r);
+}
+
+static void add_stripes (struct pcm_hash *h,
+                         const unsigned char *d,
+                         long n)
+/* Fold `n' complete stripes of `d' into `h' and scramble its accumulators
+   at the end of every block. */
+{
+  const unsigned char *secret = (const unsigned char *)hash_secret;
+  int i;
+  while (n > 0)
+    {
+      long m = HASH_BLOCK - h->stripe < n ? HASH_BLOCK - h->stripe : n;
+      hash_stripes (h->acc, d, m, secret + 8 * h->stripe, h->mask);
+      d += m * HASH_STRIPE;
+      n -= m;
+      if ((h->stripe += m) < HASH_BLOCK) continue;
+      for (i = 0; i < 8; i++)
+        {
+          uint64_t a = h->acc[i];
+          a ^= a >> 47;
+          a ^= hash_secret[16 + i];
+          h->acc[i] = a * PRIME32_1;
+        }
+      h->stripe = 0;
+    }
+}
+
+static uint64_t mix (uint64_t a, uint64_t b)
+/* Fold 128 bit product of `a' and `b' into 64 bits. */
+{
+  unsigned __int128 p = (unsigned __int128)a * b;
+  return (uint64_t)p ^ (uint64_t)(p >> 64);
+}
+
+static uint64_t avalanche (uint64_t h)
+/* Make every bit of the result depend on every bit of `h'. */
+{
+  h ^= h >> 37;
+  h *= 0x165667919e3779f9ULL;
+  return h ^ (h >> 32);
+}
@@ -0,0 +1,425 @@
+/*
+ * This file is part of LSA.
+ *
+ * Copyright © 2014–2017 Mark Karpov
+ *
+ * LSA is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * LSA is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "lsa.h"
+
+/* Native parsers of headers of the most common formats. They are used
+   when nothing needs to be decoded, because opening a file with the Audio
+   File library is expensive: it sets up codecs, allocates state of
+   tracks, and sometimes scans the file. These parsers read a few KB at
+   most with `pread' and allocate nothing. If a parser doesn't understand
+   something, it gives up and the file is opened with the library as
+   usual, so the parsers only need to handle straightforward cases. */
+
+/* structures & constants */
+
+#define WINDOW_SIZE 4096 /* how many bytes we read at once */
+#define MAX_CHUNKS  64   /* how many chunks we look at before giving up */
+
+struct reader /* window into a file */
+{
+  int fd;
+  off_t size; /* size of the file */
+  off_t start; /* offset of the window in the file */
+  ssize_t len; /* number of valid bytes in the window */
+  unsigned char window[WINDOW_SIZE];
+};
+
+/* declarations */
+
+static const unsigned char *peek (struct reader *, off_t, size_t);
+static int parse_wave (struct reader *, struct audio_params *, off_t *);
+static int parse_aiff (struct reader *, struct audio_params *, off_t *);
+static int parse_flac (struct reader *, struct audio_params *, off_t *);
+static int parse_caf (struct reader *, struct audio_params *, off_t *);
+static uint16_t le16 (const unsigned char *);
+static uint32_t le32 (const unsigned char *);
+static uint64_t le64 (const unsigned char *);
+static uint16_t be16 (const unsigned char *);
+static uint32_t be32 (const unsigned char *);
+static uint64_t be64 (const unsigned char *);
+static double ieee_extended (const unsigned char *);
+
+/* definitions */
+
+int parse_header (const char *path, struct audio_params *result)
+/* Try to fill `result' reading header of file on `path'. Return 0 on
+   success. Track bytes are returned in `kbps' field by individual parsers
+   and converted here. */
+{
+  struct reader r;
+  r.fd = open (path, O_RDONLY);
+  if (r.fd < 0) return -1;
+  struct stat sb;
+  if (fstat (r.fd, &sb))
+    {
+      close (r.fd);
+      return -1;
+    }
+  r.size = sb.st_size;
+  r.start = 0;
+  r.len = pread (r.fd, r.window, WINDOW_SIZE, 0);
+  off_t bytes = 0; /* number of bytes of audio data */
+  int e = -1;
+  const unsigned char *m = peek (&r, 0, 12);
+  if (!m) e = -1;
+  else if ((!memcmp (m, "RIFF", 4) || !memcmp (m, "RF64", 4)) &&
+           !memcmp (m + 8, "WAVE", 4))
+    e = parse_wave (&r, result, &bytes);
+  else if (!memcmp (m, "FORM", 4) &&
+           (!memcmp (m + 8, "AIFF", 4) || !memcmp (m + 8, "AIFC", 4)))
+    e = parse_aiff (&r, result, &bytes);
+  else if (!memcmp (m, "fLaC", 4))
+    e = parse_flac (&r, result, &bytes);
+  else if (!memcmp (m, "caff", 4))
+    e = parse_caf (&r, result, &bytes);
+  close (r.fd);
+  if (e || result->rate <= 0 || result->channels <= 0 || result->frames < 0)
+    return -1;
+  result->duration = (double)result->frames / result->rate;
+  result->kbps = /* 8 / 1000 = 125, * 8 to get bits, / 1000 to get kilos */
+    bytes / (result->duration * 125);
+  result->peak = 0;
+  result->stats = NULL;
+  result->overview = NULL;
+  result->lead = result->trail = 0;
+  result->true_peak = 0;
+  result->loudness = -HUGE_VAL;
+  result->lra = 0;
+  result->hash = 0;
+  result->sampled = 0;
+  return 0;
+}
+
+static const unsigned char *peek (struct reader *r, off_t off, size_t len)
+/* Return pointer to `len' bytes at offset `off' in the file, reading a
+   new window if necessary, or `NULL' if the bytes are not available. */
+{
+  if (len > WINDOW_SIZE || off < 0) return NULL;
+  if (off < r->start || off + (off_t)len > r->start + r->len)
+    {
+      r->start = off;
+      r->len = pread (r->fd, r->window, WINDOW_SIZE, off);
+      if (r->len < (ssize_t)len) return NULL;
+    }
+  return r->window + (off - r->start);
+}
+
+static int parse_wave (struct reader *r,
+                       struct audio_params *p,
+                       off_t *bytes)
+/* Parse RIFF WAVE and RF64 files. RF64 keeps real sizes in `ds64' chunk
+   that precedes all other chunks. */
+{
+  int rf64 = !memcmp (peek (r, 0, 4), "RF64", 4), n, got_fmt = 0,
+    block_align = 0;
+  uint64_t ds64_data = 0;
+  off_t off = 12;
+  for (n = 0; n < MAX_CHUNKS; n++)
+    {
+      const unsigned char *c = peek (r, off, 8);
+      if (!c) return -1;
+      uint64_t size = le32 (c + 4);
+      if (!memcmp (c, "ds64", 4))
+        {
+          const unsigned char *d = peek (r, off + 8, 16);
+          if (!d) return -1;
+          ds64_data = le64 (d + 8);
+        }
+      else if (!memcmp (c, "fmt ", 4))
+        {
+          const unsigned char *f = peek (r, off + 8, size < 40 ? size : 40);
+          if (!f || size < 16) return -1;
+          int tag = le16 (f);
+          p->channels = le16 (f + 2);
+          p->rate = le32 (f + 4);
+          /* Frames are `nBlockAlign' bytes long, valid bits of
+             WAVE_FORMAT_EXTENSIBLE only give width of samples. */
+          block_align = le16 (f + 12);
+          p->width = le16 (f + 14);
+          if (tag == 0xfffe) /* WAVE_FORMAT_EXTENSIBLE */
+            {
+              if (size < 40) return -1;
+              if (le16 (f + 18)) p->width = le16 (f + 18);
+              tag = le16 (f + 24);
+            }
+          p->compression = AF_COMPRESSION_NONE;
+          switch (tag)
+            {
+            case 1 : /* PCM */
+              if (p->width < 1 || p->width > 32) return -1;
+              p->format = p->width > 8 ?
+                AF_SAMPFMT_TWOSCOMP : AF_SAMPFMT_UNSIGNED;
+              break;
+            case 3 : /* IEEE float */
+              if (p->width == 32) p->format = AF_SAMPFMT_FLOAT;
+              else if (p->width == 64) p->format = AF_SAMPFMT_DOUBLE;
+              else return -1;
+              break;
+            case 6 : /* A-law */
+            case 7 : /* u-law */
+              p->compression = tag == 6 ?
+                AF_COMPRESSION_G711_ALAW : AF_COMPRESSION_G711_ULAW;
+              p->format = AF_SAMPFMT_TWOSCOMP;
+              p->width = 16;
+              break;
+            default : return -1;
+            }
+          got_fmt = 1;
+        }
+      else if (!memcmp (c, "data", 4))
+        {
+          if (!got_fmt) return -1;
+          if (rf64 && size == 0xffffffff) size = ds64_data;
+          if (off + 8 + (off_t)size > r->size) size = r->size - off - 8;
+          *bytes = size;
+          int sample = p->compression == AF_COMPRESSION_NONE ?
+            (p->width + 7) / 8 : 1;
+          if (p->format == AF_SAMPFMT_FLOAT) sample = 4;
+          if (p->format == AF_SAMPFMT_DOUBLE) sample = 8;
+          p->frames = size / (block_align ? block_align
+                              : sample * p->channels);
+          return 0;
+        }
+      off += 8 + size + (size & 1);
+    }
+  return -1;
+}
+
+static int parse_aiff (struct reader *r,
+                       struct audio_params *p,
+                       off_t *bytes)
+/* Parse AIFF and AIFF-C files. Only compression types that the Audio File
+   library reports as uncompressed or G.711 are supported. */
+{
+  int aifc = !memcmp (peek (r, 8, 4), "AIFC", 4), n, got_comm = 0;
+  off_t off = 12;
+  for (n = 0; n < MAX_CHUNKS; n++)
+    {
+      const unsigned char *c = peek (r, off, 8);
+      if (!c) return -1;
+      uint64_t size = be32 (c + 4);
+      if (!memcmp (c, "COMM", 4))
+        {
+          const unsigned char *f = peek (r, off + 8, aifc ? 22 : 18);
+          if (!f || size < (aifc ? 22 : 18)) return -1;
+          p->channels = be16 (f);
+          p->frames = be32 (f + 2);
+          p->width = be16 (f + 6);
+          p->rate = (int)ieee_extended (f + 8);
+          p->format = AF_SAMPFMT_TWOSCOMP;
+          p->compression = AF_COMPRESSION_NONE;
+          if (aifc)
+            {
+              const unsigned char *t = f + 18;
+              if (!memcmp (t, "NONE", 4) || !memcmp (t, "twos", 4) ||
+                  !memcmp (t, "sowt", 4))
+                ;
+              else if (!memcmp (t, "fl32", 4) || !memcmp (t, "FL32", 4))
+                {
+                  p->format = AF_SAMPFMT_FLOAT;
+                  p->width = 32;
+                }
+              else if (!memcmp (t, "fl64", 4) || !memcmp (t, "FL64", 4))
+                {
+                  p->format = AF_SAMPFMT_DOUBLE;
+                  p->width = 64;
+                }
+              else if (!memcmp (t, "ulaw", 4) || !memcmp (t, "ULAW", 4))
+                {
+                  p->compression = AF_COMPRESSION_G711_ULAW;
+                  p->width = 16;
+                }
+              else if (!memcmp (t, "alaw", 4) || !memcmp (t, "ALAW", 4))
+                {
+                  p->compression = AF_COMPRESSION_G711_ALAW;
+                  p->width = 16;
+                }
+              else return -1;
+            }
+          if (p->width < 1 || p->width > 64 ||
+              (p->format == AF_SAMPFMT_TWOSCOMP && p->width > 32))
+            return -1;
+          got_comm = 1;
+        }
+      else if (!memcmp (c, "SSND", 4))
+        {
+          const unsigned char *s = peek (r, off + 8, 8);
+          if (!s || size < 8) return -1;
+          uint64_t skip = 8 + be32 (s); /* offset and block size fields */
+          if (off + 8 + (off_t)size > r->size) size = r->size - off - 8;
+          *bytes = size > skip ? size - skip : 0;
+          if (got_comm) return 0;
+        }
+      off += 8 + size + (size & 1);
+    }
+  return -1;
+}
+
+static int parse_flac (struct reader *r,
+                       struct audio_params *p,
+                       off_t *bytes)
+/* Parse FLAC files. STREAMINFO is always the first metadata block, but we
+   need to walk all the blocks to find where audio data starts. */
+{
+  off_t off = 4;
+  int n, last = 0;
+  const unsigned char *s = peek (r, off, 4 + 18);
+  if (!s || (*s & 0x7f) != 0) return -1;
+  s += 4;
+  p->rate = (s[10] << 12) | (s[11] << 4) | (s[12] >> 4);
+  p->channels = ((s[12] >> 1) & 0x07) + 1;
+  p->width = (((s[12] & 0x01) << 4) | (s[13] >> 4)) + 1;
+  p->frames = ((uint64_t)(s[13] & 0x0f) << 32) | be32 (s + 14);
+  p->format = AF_SAMPFMT_TWOSCOMP;
+  p->compression = AF_COMPRESSION_FLAC;
+  if (!p->frames) return -1; /* unknown length */
+  for (n = 0; n < MAX_CHUNKS && !last; n++)
+    {
+      const unsigned char *h = peek (r, off, 4);
+      if (!h) return -1;
+      last = *h & 0x80;
+      off += 4 + ((h[1] << 16) | (h[2] << 8) | h[3]);
+    }
+  if (!last || off > r->size) return -1;
+  *bytes = r->size - off;
+  return 0;
+}
+
+static int parse_caf (struct reader *r,
+                      struct audio_params *p,
+                      off_t *bytes)
+/* Parse Core Audio Format files. Number of frames of ALAC files is taken
+   from packet table, for PCM it's calculated from size of data. */
+{
+  off_t off = 8;
+  int n, got_desc = 0, bytes_per_packet = 0;
+  int64_t data = -1, valid_frames = -1;
+  for (n = 0; n < MAX_CHUNKS && off + 12 <= r->size; n++)
+    {
+      const unsigned char *c = peek (r, off, 12);
+      if (!c) return -1;
+      int64_t size = be64 (c + 4);
+      if (!memcmp (c, "desc", 4))
+        {
+          const unsigned char *d = peek (r, off + 12, 32);
+          if (!d || size < 32) return -1;
+          union { uint64_t i; double d; } rate;
+          rate.i = be64 (d);
+          uint32_t flags = be32 (d + 12);
+          bytes_per_packet = be32 (d + 16);
+          p->rate = (int)rate.d;
+          p->channels = be32 (d + 24);
+          p->width = be32 (d + 28);
+          p->format = AF_SAMPFMT_TWOSCOMP;
+          p->compression = AF_COMPRESSION_NONE;
+          if (!memcmp (d + 8, "lpcm", 4))
+            {
+              if (flags & 1) /* kCAFLinearPCMFormatFlagIsFloat */
+                {
+                  if (p->width == 32) p->format = AF_SAMPFMT_FLOAT;
+                  else if (p->width == 64) p->format = AF_SAMPFMT_DOUBLE;
+                  else return -1;
+                }
+              if (bytes_per_packet <= 0) return -1;
+            }
+          else if (!memcmp (d + 8, "ulaw", 4) || !memcmp (d + 8, "alaw", 4))
+            {
+              p->compression = d[8] == 'u' ?
+                AF_COMPRESSION_G711_ULAW : AF_COMPRESSION_G711_ALAW;
+              p->width = 16;
+              bytes_per_packet = p->channels;
+            }
+          else if (!memcmp (d + 8, "alac", 4))
+            {
+              static const int widths[] = { 0, 16, 20, 24, 32 };
+              if (!flags || flags > 4) return -1;
+              p->compression = AF_COMPRESSION_ALAC;
+              p->width = widths[flags];
+              bytes_per_packet = 0;
+            }
+          else return -1;
+          got_desc = 1;
+        }
+      else if (!memcmp (c, "pakt", 4))
+        {
+          const unsigned char *k = peek (r, off + 12, 16);
+          if (!k || size < 16) return -1;
+          valid_frames = be64 (k + 8);
+        }
+      else if (!memcmp (c, "data", 4))
+        {
+          /* Size of -1 means that data goes till the end of file. First
+             4 bytes of the chunk are edit count. */
+          data = size < 0 || off + 12 + size > r->size ?
+            r->size - off - 12 : size;
+          data = data > 4 ? data - 4 : 0;
+          if (size < 0) break;
+        }
+      if (size < 0) return -1;
+      off += 12 + size;
+    }
+  if (!got_desc || data < 0) return -1;
+  *bytes = data;
+  if (bytes_per_packet) p->frames = data / bytes_per_packet;
+  else if (valid_frames >= 0) p->frames = valid_frames;
+  else return -1;
+  return 0;
+}
+
+static uint16_t le16 (const unsigned char *b)
+{
+  return b[0] | (b[1] << 8);
+}
+
+static uint32_t le32 (const unsigned char *b)
+{
+  return b[0] | (b[1] << 8) | (b[2] << 16) | ((uint32_t)b[3] << 24);
+}
+
+static uint64_t le64 (const unsigned char *b)
+{
+  return le32 (b) | ((uint64_t)le32 (b + 4) << 32);
+}
+
+static uint16_t be16 (const unsigned char *b)
+{
+  return (b[0] << 8) | b[1];
+}
+
+static uint32_t be32 (const unsigned char *b)
+{
+  return ((uint32_t)b[0] << 24) | (b[1] << 16) | (b[2] << 8) | b[3];
+}
+
+static uint64_t be64 (const unsigned char *b)
+{
+  return ((uint64_t)be32 (b) << 32) | be32 (b + 4);
+}
+
+static double ieee_extended (const unsigned char *b)
+/* Convert 80 bit IEEE 754 extended precision number (used for sample rate
+   in AIFF) to double. */
+{
+  int e = ((b[0] & 0x7f) << 8) | b[1];
+  uint64_t m = be64 (b + 2);
+  if (!e && !m) return 0;
+  double v = ldexp ((double)m, e - 16383 - 63);
+  return b[0] & 0x80 ? -v : v;
+}
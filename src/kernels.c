@@ -0,0 +1,651 @@
+/*
+ * This file is part of LSA.
+ *
+ * Copyright © 2014–2017 Mark Karpov
+ *
+ * LSA is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * LSA is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "lsa.h"
+
+/* Every kernel takes a vector of `c' samples and returns the greatest
+   magnitude among them in units of samples, normalization is up to the
+   caller. Kernels are generated with macros below for every instruction
+   set, they use unaligned loads, so they can work on any memory. Tails
+   that don't fill whole vectors are processed with scalar code. Kernels
+   with `_be' suffix work on big-endian samples as they are stored in AIFF
+   files, they are used when samples are scanned right in mapped files. */
+
+/* global variables */
+
+peak_kernel peak_kernels[K_TOTAL]; /* kernels selected by `select_kernels' */
+
+/* kernel templates */
+
+#define SCALAR_SIGNED(name, type, fix)                                  \
+  static double name (void *frames, AFframecount c)                     \
+  {                                                                     \
+    register AFframecount i;                                            \
+    type hi = 0, lo = 0;                                                \
+    for (i = 0; i < c; i++)                                             \
+      {                                                                 \
+        type a = fix (load_sample (type, frames, i));                   \
+        if (a > hi) hi = a;                                             \
+        if (a < lo) lo = a;                                             \
+      }                                                                 \
+    double h = hi, l = -(double)lo;                                     \
+    return h > l ? h : l;                                               \
+  }
+
+#define SCALAR_UNSIGNED(name, type)                                     \
+  static double name (void *frames, AFframecount c)                     \
+  {                                                                     \
+    register AFframecount i;                                            \
+    type hi = 0;                                                        \
+    for (i = 0; i < c; i++)                                             \
+      {                                                                 \
+        type a = load_sample (type, frames, i);                         \
+        if (a > hi) hi = a;                                             \
+      }                                                                 \
+    return hi;                                                          \
+  }
+
+/* Signed kernels (floating point ones included) keep two pairs of
+   accumulators, so two independent chains of max/min instructions can
+   run at the same time. `load' must return samples in native byte order,
+   `fix' does the same for single samples in the scalar tail. */
+
+#define VECTOR_SIGNED(name, isa, type, vec, lanes, load, vmax, vmin, zero, \
+                      fix)                                              \
+  __attribute__ ((target (isa)))                                        \
+  static double name (void *frames, AFframecount c)                     \
+  {                                                                     \
+    const type *src = frames;                                           \
+    AFframecount t = c / (lanes * 2);                                   \
+    vec m0 = zero, m1 = zero, n0 = zero, n1 = zero;                     \
+    register AFframecount i;                                            \
+    for (i = 0; i < t; i++, src += lanes * 2)                           \
+      {                                                                 \
+        vec a = load ((const void *)src);                               \
+        vec b = load ((const void *)(src + lanes));                     \
+        m0 = vmax (m0, a);                                              \
+        n0 = vmin (n0, a);                                              \
+        m1 = vmax (m1, b);                                              \
+        n1 = vmin (n1, b);                                              \
+      }                                                                 \
+    union { vec m; type n[lanes]; } mx, mn;                             \
+    mx.m = vmax (m0, m1);                                               \
+    mn.m = vmin (n0, n1);                                               \
+    type hi = 0, lo = 0;                                                \
+    for (i = 0; i < lanes; i++)                                         \
+      {                                                                 \
+        if (*(mx.n + i) > hi) hi = *(mx.n + i);                         \
+        if (*(mn.n + i) < lo) lo = *(mn.n + i);                         \
+      }                                                                 \
+    for (i = t * lanes * 2; i < c; i++)                                 \
+      {                                                                 \
+        type a = fix (load_sample (type, frames, i));                   \
+        if (a > hi) hi = a;                                             \
+        if (a < lo) lo = a;                                             \
+      }                                                                 \
+    double h = hi, l = -(double)lo;                                     \
+    return h > l ? h : l;                                               \
+  }
+
+#define VECTOR_UNSIGNED(name, isa, type, vec, lanes, load, vmax, zero)  \
+  __attribute__ ((target (isa)))                                        \
+  static double name (void *frames, AFframecount c)                     \
+  {                                                                     \
+    const type *src = frames;                                           \
+    AFframecount t = c / (lanes * 2);                                   \
+    vec m0 = zero, m1 = zero;                                           \
+    register AFframecount i;                                            \
+    for (i = 0; i < t; i++, src += lanes * 2)                           \
+      {                                                                 \
+        m0 = vmax (m0, load ((const void *)src));                       \
+        m1 = vmax (m1, load ((const void *)(src + lanes)));             \
+      }                                                                 \
+    union { vec m; type n[lanes]; } mx;                                 \
+    mx.m = vmax (m0, m1);                                               \
+    type hi = 0;                                                        \
+    for (i = 0; i < lanes; i++)                                         \
+      {                                                                 \
+        if (*(mx.n + i) > hi) hi = *(mx.n + i);                         \
+      }                                                                 \
+    for (i = t * lanes * 2; i < c; i++)                                 \
+      {                                                                 \
+        type a = load_sample (type, frames, i);                         \
+        if (a > hi) hi = a;                                             \
+      }                                                                 \
+    return hi;                                                          \
+  }
+
+/* Packed 24 bit samples are spread by a byte shuffle into the upper three
+   bytes of 32 bit lanes, so signed comparison of the lanes works as
+   comparison of samples, and the result is shifted back at the end.
+   `load' reads 4 bytes past the samples it returns, so vector loop stops
+   earlier and the rest is done by `tail'. */
+
+#define VECTOR_INT24(name, isa, vec, lanes, load, vmax, vmin, zero, tail) \
+  __attribute__ ((target (isa)))                                        \
+  static double name (void *frames, AFframecount c)                     \
+  {                                                                     \
+    const unsigned char *src = frames;                                  \
+    AFframecount t = c * 3 >= 4 ? (c * 3 - 4) / (lanes * 3) : 0;        \
+    vec m0 = zero, n0 = zero;                                           \
+    register AFframecount i;                                            \
+    for (i = 0; i < t; i++, src += lanes * 3)                           \
+      {                                                                 \
+        vec a = load (src);                                             \
+        m0 = vmax (m0, a);                                              \
+        n0 = vmin (n0, a);                                              \
+      }                                                                 \
+    union { vec m; int32_t n[lanes]; } mx, mn;                          \
+    mx.m = m0;                                                          \
+    mn.m = n0;                                                          \
+    int32_t hi = 0, lo = 0;                                             \
+    for (i = 0; i < lanes; i++)                                         \
+      {                                                                 \
+        if (*(mx.n + i) > hi) hi = *(mx.n + i);                         \
+        if (*(mn.n + i) < lo) lo = *(mn.n + i);                         \
+      }                                                                 \
+    double h = hi >> 8, l = -(double)(lo >> 8);                         \
+    double r = tail ((void *)src, c - t * lanes);                       \
+    if (l > h) h = l;                                                   \
+    return r > h ? r : h;                                               \
+  }
+
+/* byte order helpers */
+
+#define NATIVE(x) (x)
+#define SWAP16(x) ((int16_t)__builtin_bswap16 (x))
+#define SWAP32(x) ((int32_t)__builtin_bswap32 (x))
+
+static inline float swap_float (float x)
+{
+  union { float f; uint32_t i; } u;
+  u.f = x;
+  u.i = __builtin_bswap32 (u.i);
+  return u.f;
+}
+
+static inline double swap_double (double x)
+{
+  union { double d; uint64_t i; } u;
+  u.d = x;
+  u.i = __builtin_bswap64 (u.i);
+  return u.d;
+}
+
+/* Vector loads that swap bytes. 16 bit samples are swapped with shifts,
+   which is possible with SSE2, wider samples need byte shuffles. */
+
+#define SHUFFLE_32                                                      \
+  3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12
+#define SHUFFLE_64                                                      \
+  7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8
+
+__attribute__ ((target ("sse2")))
+static inline __m128i load_be16_sse2 (const void *p)
+{
+  __m128i x = _mm_loadu_si128 (p);
+  return _mm_or_si128 (_mm_slli_epi16 (x, 8), _mm_srli_epi16 (x, 8));
+}
+
+__attribute__ ((target ("sse4.1")))
+static inline __m128i load_be32_sse41 (const void *p)
+{
+  return _mm_shuffle_epi8 (_mm_loadu_si128 (p),
+                           _mm_setr_epi8 (SHUFFLE_32));
+}
+
+__attribute__ ((target ("sse4.1")))
+static inline __m128 load_be32f_sse41 (const void *p)
+{
+  return _mm_castsi128_ps (load_be32_sse41 (p));
+}
+
+__attribute__ ((target ("sse4.1")))
+static inline __m128d load_be64f_sse41 (const void *p)
+{
+  return _mm_castsi128_pd (_mm_shuffle_epi8 (_mm_loadu_si128 (p),
+                                             _mm_setr_epi8 (SHUFFLE_64)));
+}
+
+__attribute__ ((target ("avx2")))
+static inline __m256i load_be16_avx2 (const void *p)
+{
+  __m256i x = _mm256_loadu_si256 (p);
+  return _mm256_or_si256 (_mm256_slli_epi16 (x, 8),
+                          _mm256_srli_epi16 (x, 8));
+}
+
+__attribute__ ((target ("avx2")))
+static inline __m256i load_be32_avx2 (const void *p)
+{
+  return _mm256_shuffle_epi8 (_mm256_loadu_si256 (p),
+                              _mm256_setr_epi8 (SHUFFLE_32, SHUFFLE_32));
+}
+
+__attribute__ ((target ("avx2")))
+static inline __m256 load_be32f_avx2 (const void *p)
+{
+  return _mm256_castsi256_ps (load_be32_avx2 (p));
+}
+
+__attribute__ ((target ("avx2")))
+static inline __m256d load_be64f_avx2 (const void *p)
+{
+  return _mm256_castsi256_pd
+    (_mm256_shuffle_epi8 (_mm256_loadu_si256 (p),
+                          _mm256_setr_epi8 (SHUFFLE_64, SHUFFLE_64)));
+}
+
+__attribute__ ((target ("avx512f,avx512bw")))
+static inline __m512i load_be16_avx512 (const void *p)
+{
+  __m512i x = _mm512_loadu_si512 (p);
+  return _mm512_or_si512 (_mm512_slli_epi16 (x, 8),
+                          _mm512_srli_epi16 (x, 8));
+}
+
+__attribute__ ((target ("avx512f,avx512bw")))
+static inline __m512i load_be32_avx512 (const void *p)
+{
+  return _mm512_shuffle_epi8
+    (_mm512_loadu_si512 (p),
+     _mm512_broadcast_i32x4 (_mm_setr_epi8 (SHUFFLE_32)));
+}
+
+__attribute__ ((target ("avx512f,avx512bw")))
+static inline __m512 load_be32f_avx512 (const void *p)
+{
+  return _mm512_castsi512_ps (load_be32_avx512 (p));
+}
+
+__attribute__ ((target ("avx512f,avx512bw")))
+static inline __m512d load_be64f_avx512 (const void *p)
+{
+  return _mm512_castsi512_pd
+    (_mm512_shuffle_epi8
+     (_mm512_loadu_si512 (p),
+      _mm512_broadcast_i32x4 (_mm_setr_epi8 (SHUFFLE_64))));
+}
+
+/* Loads of packed 24 bit samples, see `VECTOR_INT24'. Wider vectors are
+   assembled from 12 byte pieces, because byte shuffles can't cross 128
+   bit lanes. */
+
+#define SHUFFLE_24                                                      \
+  -128, 0, 1, 2, -128, 3, 4, 5, -128, 6, 7, 8, -128, 9, 10, 11
+#define SHUFFLE_24_BE                                                   \
+  -128, 2, 1, 0, -128, 5, 4, 3, -128, 8, 7, 6, -128, 11, 10, 9
+
+__attribute__ ((target ("sse4.1")))
+static inline __m128i load_int24_sse41 (const unsigned char *p)
+{
+  return _mm_shuffle_epi8 (_mm_loadu_si128 ((const void *)p),
+                           _mm_setr_epi8 (SHUFFLE_24));
+}
+
+__attribute__ ((target ("sse4.1")))
+static inline __m128i load_int24_be_sse41 (const unsigned char *p)
+{
+  return _mm_shuffle_epi8 (_mm_loadu_si128 ((const void *)p),
+                           _mm_setr_epi8 (SHUFFLE_24_BE));
+}
+
+__attribute__ ((target ("avx2")))
+static inline __m256i gather_int24_avx2 (const unsigned char *p)
+{
+  return _mm256_inserti128_si256
+    (_mm256_castsi128_si256 (_mm_loadu_si128 ((const void *)p)),
+     _mm_loadu_si128 ((const void *)(p + 12)), 1);
+}
+
+__attribute__ ((target ("avx2")))
+static inline __m256i load_int24_avx2 (const unsigned char *p)
+{
+  return _mm256_shuffle_epi8 (gather_int24_avx2 (p),
+                              _mm256_setr_epi8 (SHUFFLE_24, SHUFFLE_24));
+}
+
+__attribute__ ((target ("avx2")))
+static inline __m256i load_int24_be_avx2 (const unsigned char *p)
+{
+  return _mm256_shuffle_epi8 (gather_int24_avx2 (p),
+                              _mm256_setr_epi8 (SHUFFLE_24_BE,
+                                                SHUFFLE_24_BE));
+}
+
+__attribute__ ((target ("avx512f,avx512bw")))
+static inline __m512i gather_int24_avx512 (const unsigned char *p)
+{
+  __m512i x = _mm512_castsi128_si512 (_mm_loadu_si128 ((const void *)p));
+  x = _mm512_inserti32x4 (x, _mm_loadu_si128 ((const void *)(p + 12)), 1);
+  x = _mm512_inserti32x4 (x, _mm_loadu_si128 ((const void *)(p + 24)), 2);
+  return _mm512_inserti32x4 (x, _mm_loadu_si128 ((const void *)(p + 36)), 3);
+}
+
+__attribute__ ((target ("avx512f,avx512bw")))
+static inline __m512i load_int24_avx512 (const unsigned char *p)
+{
+  return _mm512_shuffle_epi8
+    (gather_int24_avx512 (p),
+     _mm512_broadcast_i32x4 (_mm_setr_epi8 (SHUFFLE_24)));
+}
+
+__attribute__ ((target ("avx512f,avx512bw")))
+static inline __m512i load_int24_be_avx512 (const unsigned char *p)
+{
+  return _mm512_shuffle_epi8
+    (gather_int24_avx512 (p),
+     _mm512_broadcast_i32x4 (_mm_setr_epi8 (SHUFFLE_24_BE)));
+}
+
+/* scalar kernels */
+
+SCALAR_SIGNED   (peak_int32_scalar,     int32_t,  NATIVE)
+SCALAR_SIGNED   (peak_int16_scalar,     int16_t,  NATIVE)
+SCALAR_SIGNED   (peak_int8_scalar,      int8_t,   NATIVE)
+SCALAR_UNSIGNED (peak_uint32_scalar,    uint32_t)
+SCALAR_UNSIGNED (peak_uint16_scalar,    uint16_t)
+SCALAR_UNSIGNED (peak_uint8_scalar,     uint8_t)
+SCALAR_SIGNED   (peak_float_scalar,     float,    NATIVE)
+SCALAR_SIGNED   (peak_double_scalar,    double,   NATIVE)
+SCALAR_SIGNED   (peak_int32_be_scalar,  int32_t,  SWAP32)
+SCALAR_SIGNED   (peak_int16_be_scalar,  int16_t,  SWAP16)
+SCALAR_SIGNED   (peak_float_be_scalar,  float,    swap_float)
+SCALAR_SIGNED   (peak_double_be_scalar, double,   swap_double)
+
+static double peak_int24_scalar (void *frames, AFframecount c)
+/* Packed 24 bit little-endian samples. */
+{
+  const unsigned char *b = frames;
+  register AFframecount i;
+  int32_t hi = 0, lo = 0;
+  for (i = 0; i < c; i++, b += 3)
+    {
+      int32_t a = (int32_t)((uint32_t)b[0] << 8 | (uint32_t)b[1] << 16 |
+                            (uint32_t)b[2] << 24) >> 8;
+      if (a > hi) hi = a;
+      if (a < lo) lo = a;
+    }
+  double h = hi, l = -(double)lo;
+  return h > l ? h : l;
+}
+
+static double peak_int24_be_scalar (void *frames, AFframecount c)
+/* Packed 24 bit big-endian samples. */
+{
+  const unsigned char *b = frames;
+  register AFframecount i;
+  int32_t hi = 0, lo = 0;
+  for (i = 0; i < c; i++, b += 3)
+    {
+      int32_t a = (int32_t)((uint32_t)b[2] << 8 | (uint32_t)b[1] << 16 |
+                            (uint32_t)b[0] << 24) >> 8;
+      if (a > hi) hi = a;
+      if (a < lo) lo = a;
+    }
+  double h = hi, l = -(double)lo;
+  return h > l ? h : l;
+}
+
+/* SSE2 kernels */
+
+VECTOR_SIGNED (peak_int16_sse2, "sse2", int16_t, __m128i, 8,
+               _mm_loadu_si128, _mm_max_epi16, _mm_min_epi16,
+               _mm_setzero_si128 (), NATIVE)
+VECTOR_UNSIGNED (peak_uint8_sse2, "sse2", uint8_t, __m128i, 16,
+                 _mm_loadu_si128, _mm_max_epu8, _mm_setzero_si128 ())
+VECTOR_SIGNED (peak_float_sse2, "sse2", float, __m128, 4,
+               _mm_loadu_ps, _mm_max_ps, _mm_min_ps, _mm_setzero_ps (),
+               NATIVE)
+VECTOR_SIGNED (peak_double_sse2, "sse2", double, __m128d, 2,
+               _mm_loadu_pd, _mm_max_pd, _mm_min_pd, _mm_setzero_pd (),
+               NATIVE)
+VECTOR_SIGNED (peak_int16_be_sse2, "sse2", int16_t, __m128i, 8,
+               load_be16_sse2, _mm_max_epi16, _mm_min_epi16,
+               _mm_setzero_si128 (), SWAP16)
+
+/* SSE4.1 kernels, they cover formats that SSE2 lacks instructions for */
+
+VECTOR_SIGNED (peak_int32_sse41, "sse4.1", int32_t, __m128i, 4,
+               _mm_loadu_si128, _mm_max_epi32, _mm_min_epi32,
+               _mm_setzero_si128 (), NATIVE)
+VECTOR_SIGNED (peak_int8_sse41, "sse4.1", int8_t, __m128i, 16,
+               _mm_loadu_si128, _mm_max_epi8, _mm_min_epi8,
+               _mm_setzero_si128 (), NATIVE)
+VECTOR_UNSIGNED (peak_uint32_sse41, "sse4.1", uint32_t, __m128i, 4,
+                 _mm_loadu_si128, _mm_max_epu32, _mm_setzero_si128 ())
+VECTOR_UNSIGNED (peak_uint16_sse41, "sse4.1", uint16_t, __m128i, 8,
+                 _mm_loadu_si128, _mm_max_epu16, _mm_setzero_si128 ())
+VECTOR_SIGNED (peak_int32_be_sse41, "sse4.1", int32_t, __m128i, 4,
+               load_be32_sse41, _mm_max_epi32, _mm_min_epi32,
+               _mm_setzero_si128 (), SWAP32)
+VECTOR_SIGNED (peak_float_be_sse41, "sse4.1", float, __m128, 4,
+               load_be32f_sse41, _mm_max_ps, _mm_min_ps, _mm_setzero_ps (),
+               swap_float)
+VECTOR_SIGNED (peak_double_be_sse41, "sse4.1", double, __m128d, 2,
+               load_be64f_sse41, _mm_max_pd, _mm_min_pd, _mm_setzero_pd (),
+               swap_double)
+
+VECTOR_INT24 (peak_int24_sse41, "sse4.1", __m128i, 4, load_int24_sse41,
+              _mm_max_epi32, _mm_min_epi32, _mm_setzero_si128 (),
+              peak_int24_scalar)
+VECTOR_INT24 (peak_int24_be_sse41, "sse4.1", __m128i, 4,
+              load_int24_be_sse41, _mm_max_epi32, _mm_min_epi32,
+              _mm_setzero_si128 (), peak_int24_be_scalar)
+
+/* AVX2 kernels */
+
+VECTOR_SIGNED (peak_int32_avx2, "avx2", int32_t, __m256i, 8,
+               _mm256_loadu_si256, _mm256_max_epi32, _mm256_min_epi32,
+               _mm256_setzero_si256 (), NATIVE)
+VECTOR_SIGNED (peak_int16_avx2, "avx2", int16_t, __m256i, 16,
+               _mm256_loadu_si256, _mm256_max_epi16, _mm256_min_epi16,
+               _mm256_setzero_si256 (), NATIVE)
+VECTOR_SIGNED (peak_int8_avx2, "avx2", int8_t, __m256i, 32,
+               _mm256_loadu_si256, _mm256_max_epi8, _mm256_min_epi8,
+               _mm256_setzero_si256 (), NATIVE)
+VECTOR_UNSIGNED (peak_uint32_avx2, "avx2", uint32_t, __m256i, 8,
+                 _mm256_loadu_si256, _mm256_max_epu32,
+                 _mm256_setzero_si256 ())
+VECTOR_UNSIGNED (peak_uint16_avx2, "avx2", uint16_t, __m256i, 16,
+                 _mm256_loadu_si256, _mm256_max_epu16,
+                 _mm256_setzero_si256 ())
+VECTOR_UNSIGNED (peak_uint8_avx2, "avx2", uint8_t, __m256i, 32,
+                 _mm256_loadu_si256, _mm256_max_epu8,
+                 _mm256_setzero_si256 ())
+VECTOR_SIGNED (peak_float_avx2, "avx2", float, __m256, 8,
+               _mm256_loadu_ps, _mm256_max_ps, _mm256_min_ps,
+               _mm256_setzero_ps (), NATIVE)
+VECTOR_SIGNED (peak_double_avx2, "avx2", double, __m256d, 4,
+               _mm256_loadu_pd, _mm256_max_pd, _mm256_min_pd,
+               _mm256_setzero_pd (), NATIVE)
+VECTOR_SIGNED (peak_int32_be_avx2, "avx2", int32_t, __m256i, 8,
+               load_be32_avx2, _mm256_max_epi32, _mm256_min_epi32,
+               _mm256_setzero_si256 (), SWAP32)
+VECTOR_SIGNED (peak_int16_be_avx2, "avx2", int16_t, __m256i, 16,
+               load_be16_avx2, _mm256_max_epi16, _mm256_min_epi16,
+               _mm256_setzero_si256 (), SWAP16)
+VECTOR_SIGNED (peak_float_be_avx2, "avx2", float, __m256, 8,
+               load_be32f_avx2, _mm256_max_ps, _mm256_min_ps,
+               _mm256_setzero_ps (), swap_float)
+VECTOR_SIGNED (peak_double_be_avx2, "avx2", double, __m256d, 4,
+               load_be64f_avx2, _mm256_max_pd, _mm256_min_pd,
+               _mm256_setzero_pd (), swap_double)
+
+VECTOR_INT24 (peak_int24_avx2, "avx2", __m256i, 8, load_int24_avx2,
+              _mm256_max_epi32, _mm256_min_epi32, _mm256_setzero_si256 (),
+              peak_int24_scalar)
+VECTOR_INT24 (peak_int24_be_avx2, "avx2", __m256i, 8, load_int24_be_avx2,
+              _mm256_max_epi32, _mm256_min_epi32, _mm256_setzero_si256 (),
+              peak_int24_be_scalar)
+
+/* AVX-512 kernels, 8 and 16 bit formats need AVX-512BW */
+
+VECTOR_SIGNED (peak_int32_avx512, "avx512f", int32_t, __m512i, 16,
+               _mm512_loadu_si512, _mm512_max_epi32, _mm512_min_epi32,
+               _mm512_setzero_si512 (), NATIVE)
+VECTOR_SIGNED (peak_int16_avx512, "avx512f,avx512bw", int16_t, __m512i, 32,
+               _mm512_loadu_si512, _mm512_max_epi16, _mm512_min_epi16,
+               _mm512_setzero_si512 (), NATIVE)
+VECTOR_SIGNED (peak_int8_avx512, "avx512f,avx512bw", int8_t, __m512i, 64,
+               _mm512_loadu_si512, _mm512_max_epi8, _mm512_min_epi8,
+               _mm512_setzero_si512 (), NATIVE)
+VECTOR_UNSIGNED (peak_uint32_avx512, "avx512f", uint32_t, __m512i, 16,
+                 _mm512_loadu_si512, _mm512_max_epu32,
+                 _mm512_setzero_si512 ())
+VECTOR_UNSIGNED (peak_uint16_avx512, "avx512f,avx512bw", uint16_t, __m512i,
+                 32, _mm512_loadu_si512, _mm512_max_epu16,
+                 _mm512_setzero_si512 ())
+VECTOR_UNSIGNED (peak_uint8_avx512, "avx512f,avx512bw", uint8_t, __m512i,
+                 64, _mm512_loadu_si512, _mm512_max_epu8,
+                 _mm512_setzero_si512 ())
+VECTOR_SIGNED (peak_float_avx512, "avx512f", float, __m512, 16,
+               _mm512_loadu_ps, _mm512_max_ps, _mm512_min_ps,
+               _mm512_setzero_ps (), NATIVE)
+VECTOR_SIGNED (peak_double_avx512, "avx512f", double, __m512d, 8,
+               _mm512_loadu_pd, _mm512_max_pd, _mm512_min_pd,
+               _mm512_setzero_pd (), NATIVE)
+VECTOR_SIGNED (peak_int32_be_avx512, "avx512f,avx512bw", int32_t, __m512i,
+               16, load_be32_avx512, _mm512_max_epi32, _mm512_min_epi32,
+               _mm512_setzero_si512 (), SWAP32)
+VECTOR_SIGNED (peak_int16_be_avx512, "avx512f,avx512bw", int16_t, __m512i,
+               32, load_be16_avx512, _mm512_max_epi16, _mm512_min_epi16,
+               _mm512_setzero_si512 (), SWAP16)
+VECTOR_SIGNED (peak_float_be_avx512, "avx512f,avx512bw", float, __m512, 16,
+               load_be32f_avx512, _mm512_max_ps, _mm512_min_ps,
+               _mm512_setzero_ps (), swap_float)
+VECTOR_SIGNED (peak_double_be_avx512, "avx512f,avx512bw", double, __m512d,
+               8, load_be64f_avx512, _mm512_max_pd, _mm512_min_pd,
+               _mm512_setzero_pd (), swap_double)
+
+VECTOR_INT24 (peak_int24_avx512, "avx512f,avx512bw", __m512i, 16,
+              load_int24_avx512, _mm512_max_epi32, _mm512_min_epi32,
+              _mm512_setzero_si512 (), peak_int24_scalar)
+VECTOR_INT24 (peak_int24_be_avx512, "avx512f,avx512bw", __m512i, 16,
+              load_int24_be_avx512, _mm512_max_epi32, _mm512_min_epi32,
+              _mm512_setzero_si512 (), peak_int24_be_scalar)
+
+/* structures & constants */
+
+const peak_kernel peak_kernel_table[ISA_TOTAL][K_TOTAL] =
+  /* missing kernel means that instruction set gives nothing for the
+     format, so a kernel from less capable instruction set is used */
+  { [ISA_SCALAR] =
+    { [K_INT32]     = peak_int32_scalar,
+      [K_INT16]     = peak_int16_scalar,
+      [K_INT8]      = peak_int8_scalar,
+      [K_UINT32]    = peak_uint32_scalar,
+      [K_UINT16]    = peak_uint16_scalar,
+      [K_UINT8]     = peak_uint8_scalar,
+      [K_FLOAT]     = peak_float_scalar,
+      [K_DOUBLE]    = peak_double_scalar,
+      [K_INT24]     = peak_int24_scalar,
+      [K_INT32_BE]  = peak_int32_be_scalar,
+      [K_INT24_BE]  = peak_int24_be_scalar,
+      [K_INT16_BE]  = peak_int16_be_scalar,
+      [K_FLOAT_BE]  = peak_float_be_scalar,
+      [K_DOUBLE_BE] = peak_double_be_scalar },
+    [ISA_SSE2] =
+    { [K_INT16]     = peak_int16_sse2,
+      [K_UINT8]     = peak_uint8_sse2,
+      [K_FLOAT]     = peak_float_sse2,
+      [K_DOUBLE]    = peak_double_sse2,
+      [K_INT16_BE]  = peak_int16_be_sse2 },
+    [ISA_SSE41] =
+    { [K_INT32]     = peak_int32_sse41,
+      [K_INT8]      = peak_int8_sse41,
+      [K_UINT32]    = peak_uint32_sse41,
+      [K_UINT16]    = peak_uint16_sse41,
+      [K_INT24]     = peak_int24_sse41,
+      [K_INT32_BE]  = peak_int32_be_sse41,
+      [K_INT24_BE]  = peak_int24_be_sse41,
+      [K_FLOAT_BE]  = peak_float_be_sse41,
+      [K_DOUBLE_BE] = peak_double_be_sse41 },
+    [ISA_AVX2] =
+    { [K_INT32]     = peak_int32_avx2,
+      [K_INT16]     = peak_int16_avx2,
+      [K_INT8]      = peak_int8_avx2,
+      [K_UINT32]    = peak_uint32_avx2,
+      [K_UINT16]    = peak_uint16_avx2,
+      [K_UINT8]     = peak_uint8_avx2,
+      [K_FLOAT]     = peak_float_avx2,
+      [K_DOUBLE]    = peak_double_avx2,
+      [K_INT24]     = peak_int24_avx2,
+      [K_INT32_BE]  = peak_int32_be_avx2,
+      [K_INT24_BE]  = peak_int24_be_avx2,
+      [K_INT16_BE]  = peak_int16_be_avx2,
+      [K_FLOAT_BE]  = peak_float_be_avx2,
+      [K_DOUBLE_BE] = peak_double_be_avx2 },
+    [ISA_AVX512] =
+    { [K_INT32]     = peak_int32_avx512,
+      [K_INT16]     = peak_int16_avx512,
+      [K_INT8]      = peak_int8_avx512,
+      [K_UINT32]    = peak_uint32_avx512,
+      [K_UINT16]    = peak_uint16_avx512,
+      [K_UINT8]     = peak_uint8_avx512,
+      [K_FLOAT]     = peak_float_avx512,
+      [K_DOUBLE]    = peak_double_avx512,
+      [K_INT24]     = peak_int24_avx512,
+      [K_INT32_BE]  = peak_int32_be_avx512,
+      [K_INT24_BE]  = peak_int24_be_avx512,
+      [K_INT16_BE]  = peak_int16_be_avx512,
+      [K_FLOAT_BE]  = peak_float_be_avx512,
+      [K_DOUBLE_BE] = peak_double_be_avx512 } };
+
+const char *isa_names[ISA_TOTAL] = /* names of instruction sets */
+  { "scalar", "sse2", "sse4.1", "avx2", "avx512" };
+
+/* functions */
+
+int isa_supported (int isa)
+/* Check if CPU and OS support given instruction set. */
+{
+  switch (isa)
+    {
+    case ISA_SCALAR : return 1;
+    case ISA_SSE2   : return __builtin_cpu_supports ("sse2");
+    case ISA_SSE41  : return __builtin_cpu_supports ("sse4.1");
+    case ISA_AVX2   : return __builtin_cpu_supports ("avx2");
+    case ISA_AVX512 : return __builtin_cpu_supports ("avx512f") &&
+        __builtin_cpu_supports ("avx512bw");
+    }
+  return 0;
+}
+
+void select_kernels (void)
+/* Fill `peak_kernels', `stats_kernels', and `hash_stripes' with the
+   best kernels available on this CPU. This is called once, when the first
+   context of the library is created (see `lsa_new'). We go from the least
+   capable instruction set to the most capable one, so every format ends
+   up with its fastest supported kernel. */
+{
+  int isa, k;
+  for (isa = ISA_SCALAR; isa < ISA_TOTAL; isa++)
+    {
+      if (!isa_supported (isa)) continue;
+      for (k = 0; k < K_TOTAL; k++)
+        {
+          if (peak_kernel_table[isa][k])
+            peak_kernels[k] = peak_kernel_table[isa][k];
+          if (k < K_STATS && stats_kernel_table[isa][k])
+            stats_kernels[k] = stats_kernel_table[isa][k];
+        }
+      if (hash_kernel_table[isa]) hash_stripes = hash_kernel_table[isa];
+    }
+}
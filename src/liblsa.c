@@ -0,0 +1,241 @@
+/*
+ * This file is part of LSA.
+ *
+ * Copyright © 2014–2017 Mark Karpov
+ *
+ * LSA is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * LSA is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "lsa.h"
+
+/* Contexts of liblsa, see liblsa.h. Kernels are selected once per process,
+   when the first context is created. Every thread of
+   `lsa_analyze_batch' has its own slot in the context with a decoding
+   buffer, the buffer is allocated by the thread that uses it first and
+   kept for the next calls. Big files are scanned as a whole here, only
+   the `lsa' program splits them between threads. */
+
+/* structures */
+
+struct batch /* state of one call of `lsa_analyze_batch' */
+{
+  struct lsa_context *ctx;
+  const char *const *paths;
+  struct audio_params *out;
+  int *ok;
+  long total;
+  long index; /* index of next file, accessed atomically */
+  long done; /* number of analyzed files, accessed atomically */
+};
+
+struct batch_thread /* argument of a thread of `lsa_analyze_batch' */
+{
+  struct batch *b;
+  long slot; /* index of buffer of the thread */
+};
+
+/* global variables */
+
+static pthread_once_t kernels_once = PTHREAD_ONCE_INIT;
+
+/* declarations */
+
+static void *batch_thread (void *);
+static int analyze_with (struct lsa_context *,
+                         const char *,
+                         void *,
+                         struct audio_params *);
+static void *get_buffer (struct lsa_context *, long);
+
+/* functions */
+
+struct lsa_context *lsa_new (int flags, long threads, long buffer_size)
+/* Create analysis context with given set of `LSA_*' `flags'.
+   `lsa_analyze_batch' uses up to `threads' threads (one per CPU if it's 0)
+   and every thread decodes audio into a buffer of `buffer_size' bytes (or
+   the default size if it's 0). Return `NULL' if arguments are invalid or
+   memory cannot be allocated. */
+{
+  if (threads < 0 || (buffer_size && buffer_size < LSA_BUFFER_MIN))
+    return NULL;
+  pthread_once (&kernels_once, select_kernels);
+  struct lsa_context *ctx = malloc (sizeof (*ctx));
+  if (!ctx) return NULL;
+  ctx->flags = flags;
+  ctx->threads = threads ? threads : sysconf (_SC_NPROCESSORS_ONLN);
+  if (ctx->threads < 1) ctx->threads = 1;
+  ctx->buffer_size = buffer_size ? buffer_size : LSA_BUFFER_SIZE;
+  ctx->buckets = 0;
+  ctx->silence = -1;
+  ctx->sample = 0;
+  ctx->timings = 0;
+  ctx->buffers = calloc (ctx->threads, sizeof (void *));
+  if (!ctx->buffers)
+    {
+      free (ctx);
+      return NULL;
+    }
+  return ctx;
+}
+
+void lsa_free (struct lsa_context *ctx)
+/* Free context `ctx' with its buffers. */
+{
+  if (!ctx) return;
+  long i;
+  for (i = 0; i < ctx->threads; i++)
+    {
+      free (*(ctx->buffers + i));
+    }
+  free (ctx->buffers);
+  free (ctx);
+}
+
+int lsa_set_overview (struct lsa_context *ctx, long buckets)
+/* Calculate envelope of every file: its frames are divided into `buckets'
+   buckets of (almost) equal length and statistics of samples of every
+   channel are collected per bucket, 0 disables this. Return 0 on
+   success. */
+{
+  if (buckets < 0 || buckets > LSA_OVERVIEW_MAX) return -1;
+  ctx->buckets = buckets;
+  return 0;
+}
+
+int lsa_set_silence (struct lsa_context *ctx, double threshold)
+/* Count silent frames at the beginning and at the end of every file, a
+   frame is silent if none of its samples is louder than `threshold' (full
+   scale is 1), negative `threshold' disables this. Only the edges of
+   files are decoded for it. Return 0 on success. */
+{
+  if (threshold > 1) return -1;
+  ctx->silence = threshold < 0 ? -1 : threshold;
+  return 0;
+}
+
+int lsa_set_peak_sample (struct lsa_context *ctx, double ratio)
+/* Find peaks reading only part `ratio' of blocks of every file (spread
+   evenly over the file), so they are lower bounds, 0 or 1 makes them
+   exact again. It only applies when nothing but peaks is calculated.
+   Return 0 on success. */
+{
+  if (ratio < 0 || ratio > 1) return -1;
+  ctx->sample = ratio < 1 ? ratio : 0;
+  return 0;
+}
+
+int lsa_analyze (struct lsa_context *ctx,
+                 const char *path,
+                 struct audio_params *out)
+/* Analyze file on `path' and put its parameters into `out', statistics
+   of samples and envelope (if requested) should be freed with
+   `lsa_release'. Return 0 on success. */
+{
+  void *buffer = get_buffer (ctx, 0);
+  return buffer ? analyze_with (ctx, path, buffer, out) : -1;
+}
+
+long lsa_analyze_batch (struct lsa_context *ctx,
+                        const char *const *paths,
+                        long total,
+                        struct audio_params *out,
+                        int *ok)
+/* Analyze `total' files on `paths' with threads of the context and put
+   their parameters into `out', results of files that could not be
+   analyzed are zeroed. If `ok' is not `NULL', it gets a flag per file
+   that is set on success. Return number of analyzed files. */
+{
+  struct batch b = { ctx, paths, out, ok, total, 0, 0 };
+  long n = ctx->threads < total ? ctx->threads : total, i;
+  pthread_t *tidv = malloc (sizeof (pthread_t) * (n ? n : 1));
+  struct batch_thread *args =
+    malloc (sizeof (struct batch_thread) * (n ? n : 1));
+  for (i = 0; i < n; i++)
+    {
+      (args + i)->b = &b;
+      (args + i)->slot = i;
+      pthread_create (tidv + i, NULL, batch_thread, args + i);
+    }
+  for (i = 0; i < n; i++)
+    {
+      pthread_join (*(tidv + i), NULL);
+    }
+  free (args);
+  free (tidv);
+  return b.done;
+}
+
+void lsa_release (struct audio_params *p)
+/* Free statistics of samples and envelope of `p', it can be reused
+   afterwards. */
+{
+  free (p->stats);
+  free (p->overview);
+  p->stats = NULL;
+  p->overview = NULL;
+}
+
+static void *batch_thread (void *arg)
+/* This function describes behavior of an individual thread of
+   `lsa_analyze_batch'. It takes files one by one until there are none
+   left. */
+{
+  struct batch_thread *t = arg;
+  struct batch *b = t->b;
+  void *buffer = get_buffer (b->ctx, t->slot);
+  long i;
+  while ((i = __atomic_fetch_add (&b->index, 1, __ATOMIC_RELAXED))
+         < b->total)
+    {
+      struct audio_params *p = b->out + i;
+      int r = buffer ? analyze_with (b->ctx, *(b->paths + i), buffer, p) : -1;
+      if (r)
+        {
+          char *name = p->name;
+          memset (p, 0, sizeof (*p));
+          p->name = name;
+        }
+      else __atomic_add_fetch (&b->done, 1, __ATOMIC_RELAXED);
+      if (b->ok) *(b->ok + i) = !r;
+    }
+  return NULL;
+}
+
+static int analyze_with (struct lsa_context *ctx,
+                         const char *path,
+                         void *buffer,
+                         struct audio_params *out)
+/* Analyze file on `path' using `buffer', scan big files as a whole. */
+{
+  int chunks;
+  if (analyze_file (ctx, path, buffer, out, &chunks)) return -1;
+  if (chunks)
+    {
+      if (analyze_range (ctx, path, out, 0, out->frames, buffer, &out->peak,
+                         out->stats, out->overview))
+        {
+          lsa_release (out);
+          return -1;
+        }
+    }
+  return 0;
+}
+
+static void *get_buffer (struct lsa_context *ctx, long slot)
+/* Return decoding buffer of `slot', allocate it on first use. */
+{
+  void **b = ctx->buffers + slot;
+  if (!*b && posix_memalign (b, LSA_ALIGN, ctx->buffer_size)) *b = NULL;
+  return *b;
+}
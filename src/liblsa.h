@@ -0,0 +1,106 @@
+/*
+ * This file is part of LSA.
+ *
+ * Copyright © 2014–2017 Mark Karpov
+ *
+ * LSA is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * LSA is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Public interface of liblsa, the library that analyzes audio files for
+   the `lsa' program and can be embedded into other programs. Everything
+   happens in a context that holds options of analysis and decoding
+   buffers, so creating a context once and reusing it for many files costs
+   nothing per file. A context may be used by one thread at a time, but
+   `lsa_analyze_batch' spreads its files between threads of its own. */
+
+#ifndef LIBLSA_H
+#define LIBLSA_H
+
+#include <stdint.h>    /* intN_t things */
+#include <audiofile.h> /* http://www.68k.org/~michael/audiofile/ */
+
+/* structures */
+
+struct channel_stats /* statistics of samples of one channel, see
+                        stats.c */
+{
+  double min;
+  double max;
+  double sum; /* sum of samples, gives DC offset */
+  double sum2; /* sum of squares of samples, gives RMS */
+  AFframecount clips; /* number of samples at full scale */
+};
+
+struct audio_params /* this structure contains various parameters of files
+                       that have been analyzed */
+{
+  AFframecount frames;
+  char *name; /* not touched by the library */
+  double duration;
+  double kbps;
+  double peak;
+  int channels;
+  struct channel_stats *stats; /* one per channel, `NULL' unless some
+                                  statistics are requested */
+  struct channel_stats *overview; /* envelope: statistics of every channel
+                                     in every bucket, bucket after bucket,
+                                     `NULL' unless it's requested with
+                                     `lsa_set_overview' */
+  AFframecount lead; /* silent frames at the beginning */
+  AFframecount trail; /* silent frames at the end, both are zero unless
+                         silence is detected, see `lsa_set_silence' */
+  double true_peak; /* inter-sample peak, full scale is 1 */
+  double loudness; /* integrated loudness in LUFS, -inf if the file is too
+                      short or too quiet to be measured */
+  double lra; /* loudness range in LU */
+  uint64_t hash; /* hash of decoded samples, zero unless it's requested */
+  int sampled; /* set if only some frames have been read, so `peak' is a
+                  lower bound, see `lsa_set_peak_sample' */
+  int compression;
+  int format;
+  int rate;
+  int width;
+};
+
+enum /* flags of analysis context */
+  { LSA_PEAK = 1, /* calculate peaks */
+    LSA_STATS = 2, /* calculate statistics of samples of every channel */
+    LSA_NO_MMAP = 4, /* always decode audio with the library */
+    LSA_TRUE_PEAK = 8, /* calculate true peaks, see loudness.c */
+    LSA_LOUDNESS = 16, /* calculate integrated loudness and loudness
+                          range */
+    LSA_HASH = 32 /* calculate hash of samples, see hash.c */ };
+
+struct lsa_context; /* opaque, see liblsa.c */
+
+/* declarations */
+
+struct lsa_context *lsa_new (int, long, long);
+void lsa_free (struct lsa_context *);
+int lsa_set_overview (struct lsa_context *, long);
+int lsa_set_silence (struct lsa_context *, double);
+int lsa_set_peak_sample (struct lsa_context *, double);
+int lsa_analyze (struct lsa_context *, const char *, struct audio_params *);
+long lsa_analyze_batch (struct lsa_context *,
+                        const char *const *,
+                        long,
+                        struct audio_params *,
+                        int *);
+void lsa_release (struct audio_params *);
+double stats_peak (const struct channel_stats *);
+double stats_rms (const struct channel_stats *, int, AFframecount);
+double stats_dc (const struct channel_stats *, int, AFframecount);
+AFframecount stats_clips (const struct channel_stats *, int);
+
+#endif /* LIBLSA_H */
@@ -0,0 +1,354 @@
+/*
+ * This file is part of LSA.
+ *
+ * Copyright © 2014–2017 Mark Karpov
+ *
+ * LSA is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * LSA is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "lsa.h"
+
+/* List mode (several arguments, a file argument, or `--files-from').
+   The main thread produces paths from arguments and the list, expanding
+   directories into their audio files, and puts them into a ring window
+   of `LSA_LIST_WINDOW' slots. Worker threads take paths from the window
+   as soon as they arrive, so analysis starts while the list is still
+   being read. Rows are printed in order of paths: the thread that
+   finishes a file prints every finished file at the head of the window
+   and frees its slot, so memory consumption doesn't depend on length of
+   the list. Workers are started as paths arrive and no worker is waiting
+   for them, so short lists don't start `threads_total' threads (each with
+   a decoding buffer). Since rows are printed before the whole list is
+   known, the table is not sorted and its layout is fixed in advance. The
+   cache is not used: paths of a list may come from any number of
+   directories, and cache of a directory is only written as a whole. */
+
+/* structures */
+
+struct list_slot /* path in the window */
+{
+  char *path;
+  struct audio_params *params; /* result, `NULL' if analysis has failed */
+  int done; /* set once the file has been analyzed */
+};
+
+/* global variables */
+
+static pthread_mutex_t list_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t room_cond = PTHREAD_COND_INITIALIZER;
+static struct list_slot window[LSA_LIST_WINDOW];
+static long list_head, /* index of next path to print */
+  list_next, /* index of next path to analyze */
+  list_tail; /* index of next free slot, indices grow forever and are
+                taken modulo `LSA_LIST_WINDOW' */
+static int list_end; /* set when there are no more paths */
+static pthread_t *list_tidv; /* workers, `threads_total' at most */
+static long list_started, /* number of started workers */
+  list_waiting; /* number of workers that are waiting for paths */
+static int list_failed; /* set by workers if some file cannot be read,
+                           `list_mutex' must be locked */
+static int read_failed; /* set by the main thread if the list or some
+                           directory cannot be read */
+static struct table list_table; /* layout and totals of the table */
+static struct audio_params **kept; /* results kept for `--dupes' */
+static long kept_total, kept_size;
+
+/* declarations */
+
+static void *list_thread (void *);
+static void add_worker (void);
+static void print_ready (void);
+static void add_arg (const char *);
+static void add_dir (const char *);
+static void push_path (char *);
+static int cmpname (const struct dirent **, const struct dirent **);
+
+/* functions */
+
+int list_files (char **args, long n, const char *from)
+/* Analyze files given by `n' arguments `args' and then by the list in
+   file `from' (standard input if it's "-"), unless it's `NULL', with
+   `threads_total' threads and print them in one table. Return exit
+   status. */
+{
+  table_init (&list_table);
+  /* Rows of files we haven't seen yet must fit into the columns. */
+  list_table.show_hours = 1;
+  list_table.max_channels = 2;
+  list_table.bound = peak_sample > 0;
+  if (!op_dupes) print_header (&list_table);
+  PROFILE_START (t);
+  list_tidv = malloc (sizeof (pthread_t) * threads_total);
+  long i;
+  for (i = 0; i < n; i++)
+    {
+      add_arg (*(args + i));
+    }
+  if (from)
+    {
+      FILE *f = strcmp (from, "-") ? fopen (from, "r") : stdin;
+      if (f)
+        {
+          char *line = NULL;
+          size_t cap = 0;
+          int delim = op_null ? '\0' : '\n';
+          ssize_t len;
+          while ((len = getdelim (&line, &cap, delim, f)) > 0)
+            {
+              if (*(line + len - 1) == delim) *(line + --len) = '\0';
+              if (len) add_arg (line);
+            }
+          free (line);
+          if (ferror (f))
+            {
+              fprintf (stderr, "lsa: cannot read '%s'\n", from);
+              read_failed = 1;
+            }
+          if (f != stdin) fclose (f);
+        }
+      else
+        {
+          fprintf (stderr, "lsa: cannot read '%s'\n", from);
+          read_failed = 1;
+        }
+    }
+  pthread_mutex_lock (&list_mutex);
+  list_end = 1;
+  pthread_cond_broadcast (&work_cond);
+  pthread_mutex_unlock (&list_mutex);
+  /* Workers may start more workers until they quit, once all started
+     workers are joined, no more can appear. */
+  for (i = 0;; i++)
+    {
+      pthread_mutex_lock (&list_mutex);
+      long started = list_started;
+      pthread_mutex_unlock (&list_mutex);
+      if (i == started) break;
+      pthread_join (*(list_tidv + i), NULL);
+    }
+  free (list_tidv);
+  if (op_timings) profile_pool (t);
+  PROFILE_START (u);
+  if (op_dupes)
+    {
+      /* Duplicates can only be found once everything is analyzed. */
+      print_table (kept, kept_total);
+      for (i = 0; i < kept_total; i++)
+        {
+          struct audio_params *p = *(kept + i);
+          free (p->name);
+          free (p->stats);
+          free (p->overview);
+          free (p);
+        }
+      free (kept);
+    }
+  else if (op_total) print_totals (&list_table);
+  PROFILE_END (u, PH_PRINT, 0);
+  return read_failed || list_failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+static void *list_thread (void *arg)
+/* This function describes behavior of an individual thread in list mode.
+   It takes paths from the window one by one until the list ends. There
+   are no other threads to process chunks of big files here, so
+   `analyze_item' scans them as a whole. A thread that has no decoding
+   buffer still takes paths and fails them, so the window never stays
+   full. */
+{
+  if (op_pin) cpu_pin ();
+  if (op_timings) profile_thread ();
+  void *buffer = alloc_buffer ();
+  pthread_mutex_lock (&list_mutex);
+  for (;;)
+    {
+      if (list_next < list_tail)
+        {
+          struct list_slot *s = window + list_next++ % LSA_LIST_WINDOW;
+          if (list_next < list_tail) add_worker ();
+          pthread_mutex_unlock (&list_mutex);
+          PROFILE_START (t);
+          struct cache_key k;
+          int dirty;
+          struct audio_params *p = buffer ?
+            analyze_item (s->path, buffer, NULL, &k, &dirty, NULL, NULL)
+            : NULL;
+          if (p) p->name = s->path;
+          else fprintf (stderr, "lsa: cannot analyze '%s'\n", s->path);
+          if (op_timings) profile_busy (t, 1);
+          pthread_mutex_lock (&list_mutex);
+          s->params = p;
+          s->done = 1;
+          if (!p) list_failed = 1;
+          print_ready ();
+        }
+      else if (list_end) break;
+      else
+        {
+          list_waiting++;
+          pthread_cond_wait (&work_cond, &list_mutex);
+          list_waiting--;
+        }
+    }
+  pthread_mutex_unlock (&list_mutex);
+  free (buffer);
+  return NULL;
+}
+
+static void add_worker (void)
+/* Start another worker if none is waiting for paths and fewer than
+   `threads_total' have been started, `list_mutex' must be locked. */
+{
+  if (list_waiting || list_started == threads_total) return;
+  if (!pthread_create (list_tidv + list_started, NULL, list_thread, NULL))
+    list_started++;
+}
+
+static void print_ready (void)
+/* Print rows of finished files at the head of the window and free their
+   slots, `list_mutex' must be locked. */
+{
+  if (!(window + list_head % LSA_LIST_WINDOW)->done) return;
+  PROFILE_START (t);
+  while (list_head < list_next &&
+         (window + list_head % LSA_LIST_WINDOW)->done)
+    {
+      struct list_slot *s = window + list_head++ % LSA_LIST_WINDOW;
+      struct audio_params *p = s->params;
+      s->done = 0;
+      if (!p)
+        {
+          free (s->path);
+          continue;
+        }
+      partial_add ("", &p, 1);
+      if (op_dupes)
+        {
+          if (kept_total == kept_size)
+            {
+              kept_size = kept_size ? kept_size * 2 : 64;
+              kept = realloc (kept, sizeof (*kept) * kept_size);
+            }
+          *(kept + kept_total++) = p;
+          continue;
+        }
+      table_add (&list_table, p);
+      print_row (&list_table, p);
+      free (p->stats);
+      free (p->overview);
+      free (p);
+      free (s->path);
+    }
+  fflush (stdout);
+  pthread_cond_signal (&room_cond);
+  PROFILE_END (t, PH_PRINT, 0);
+}
+
+static void add_arg (const char *path)
+/* Queue file on `path', or audio files of directory on `path'. Names
+   with extensions of audio files are taken as files without checking,
+   so long lists cost no extra system calls. */
+{
+  struct stat sb;
+  if (!is_audio (path, DT_REG) && !stat (path, &sb) && S_ISDIR (sb.st_mode))
+    {
+      add_dir (path);
+      return;
+    }
+  if (!in_shard ("", path)) return;
+  char *p = malloc (strlen (path) + 1);
+  strcpy (p, path);
+  push_path (p);
+}
+
+static void add_dir (const char *dir)
+/* Queue audio files of directory `dir' in order of their names, with
+   `-R' files of its subdirectories follow. Symbolic links to directories
+   are not followed. */
+{
+  PROFILE_START (t);
+  struct dirent **v;
+  long total = scandir (dir, &v, NULL, cmpname), i;
+  PROFILE_END (t, PH_SCAN, 0);
+  if (total < 0)
+    {
+      fprintf (stderr, "lsa: cannot read directory '%s'\n", dir);
+      read_failed = 1;
+      return;
+    }
+  size_t dir_len = strlen (dir), size = dir_len + 2;
+  int slash = dir_len && *(dir + dir_len - 1) != '/';
+  char *path = malloc (size);
+  memcpy (path, dir, dir_len);
+  if (slash) *(path + dir_len++) = '/';
+  for (i = 0; i < total; i++)
+    {
+      struct dirent *d = *(v + i);
+      unsigned char type = d->d_type;
+      path = make_path (path, &size, dir_len, d->d_name);
+      if (type == DT_UNKNOWN)
+        {
+          struct stat sb;
+          if (lstat (path, &sb)) continue;
+          type = S_ISDIR (sb.st_mode) ? DT_DIR :
+            S_ISLNK (sb.st_mode) ? DT_LNK :
+            S_ISREG (sb.st_mode) ? DT_REG : DT_UNKNOWN;
+        }
+      if (is_audio (d->d_name, type) && in_shard ("", path))
+        {
+          char *p = malloc (strlen (path) + 1);
+          strcpy (p, path);
+          push_path (p);
+        }
+      /* Directories are marked for the second pass. */
+      if (type != DT_DIR || !op_recursive || !strcmp (d->d_name, ".") ||
+          !strcmp (d->d_name, ".."))
+        {
+          free (d);
+          *(v + i) = NULL;
+        }
+    }
+  for (i = 0; i < total; i++)
+    {
+      if (!*(v + i)) continue;
+      path = make_path (path, &size, dir_len, (*(v + i))->d_name);
+      free (*(v + i));
+      add_dir (path);
+    }
+  free (path);
+  free (v);
+}
+
+static void push_path (char *path)
+/* Put `path' into the window, waiting for a free slot if necessary. The
+   window takes ownership of `path'. */
+{
+  pthread_mutex_lock (&list_mutex);
+  while (list_tail - list_head == LSA_LIST_WINDOW)
+    pthread_cond_wait (&room_cond, &list_mutex);
+  struct list_slot *s = window + list_tail++ % LSA_LIST_WINDOW;
+  s->path = path;
+  s->params = NULL;
+  s->done = 0;
+  pthread_cond_signal (&work_cond);
+  add_worker ();
+  pthread_mutex_unlock (&list_mutex);
+}
+
+static int cmpname (const struct dirent **a, const struct dirent **b)
+/* Order directory entries by name, like `print_table' orders files. */
+{
+  return strcmp ((*a)->d_name, (*b)->d_name);
+}
@@ -0,0 +1,489 @@
+/*
+ * This file is part of LSA.
+ *
+ * Copyright © 2014–2017 Mark Karpov
+ *
+ * LSA is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * LSA is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "lsa.h"
+
+/* Loudness and true peak after ITU-R BS.1770-4 and EBU Tech 3341 and 3342
+   (`--loudness', `--true-peak'). State of a file is fed with the same
+   blocks peak kernels get, so nothing is read twice. Blocks are converted
+   to normalized floats `LOUD_BLOCK' frames at a time (so the converted
+   samples stay in cache) and then:
+
+   - K-weighting filter (a high shelf and a high pass, two biquads) runs
+     in double precision with a pair of channels per SSE2 vector. Weighted
+     mean squares of all channels are kept per 100 ms step, integrated
+     loudness and loudness range are calculated from them with gating once
+     the file is over;
+
+   - every channel is oversampled 4 times with the polyphase FIR filter of
+     BS.1770 with SSE, the greatest magnitude of the result is the true
+     peak.
+
+   The filters need continuous input, so files are always scanned as a
+   whole by the thread that analyzes them. */
+
+#define LOUD_BLOCK  1024  /* frames converted to floats at once */
+#define LOUD_STEPS  4     /* steps of 100 ms per gating block */
+#define LOUD_SHORT  30    /* steps per short-term window of loudness
+                             range */
+#define LOUD_HOP    10    /* steps between short-term windows */
+#define TP_TAPS     12    /* taps per phase of oversampling filter */
+
+/* structures */
+
+struct loudness
+{
+  int flags; /* `LSA_TRUE_PEAK' and `LSA_LOUDNESS' */
+  int channels;
+  int width; /* channels rounded up to pairs, converted frames are padded
+                to this many samples */
+  long step; /* frames per 100 ms */
+  long done; /* frames of current step that have been filtered */
+  double acc; /* weighted sum of squares of current step */
+  double *steps; /* weighted mean squares of complete steps */
+  long steps_total, steps_size;
+  __m128d coef[10]; /* b0, b1, b2, a1, a2 of both biquads, broadcast */
+  __m128d *state; /* 4 per pair of channels: delays of both biquads */
+  __m128d *weight; /* per pair of channels */
+  float *history; /* last `TP_TAPS' - 1 samples of every channel */
+  float *x; /* converted frames */
+  float *line; /* history and samples of one channel */
+  float true_peak;
+};
+
+/* Coefficients of oversampling filter by phase, BS.1770-4 Annex 2. The
+   last two phases are the first two reversed. */
+
+static const float tp_coef[2][TP_TAPS] =
+  { { 0.0017089843750, 0.0109863281250, -0.0196533203125, 0.0332031250000,
+      -0.0594482421875, 0.1373291015625, 0.9721679687500, -0.1022949218750,
+      0.0476074218750, -0.0266113281250, 0.0148925781250,
+      -0.0083007812500 },
+    { -0.0291748046875, 0.0292968750000, -0.0517578125000, 0.0891113281250,
+      -0.1665039062500, 0.4650878906250, 0.7797851562500, -0.2003173828125,
+      0.1015625000000, -0.0582275390625, 0.0330810546875,
+      -0.0189208984375 } };
+
+/* declarations */
+
+static void to_float (const void *,
+                      AFframecount,
+                      int,
+                      int,
+                      int,
+                      const struct sample_scale *,
+                      float *);
+static long sample_size (int);
+static void k_weight (struct loudness *, const float *, long);
+static void true_peak (struct loudness *, const float *, long);
+static void add_step (struct loudness *, double);
+static double gated_mean (const double *, long, double);
+static double power_to_lufs (double);
+static int cmp_double (const void *, const void *);
+
+/* functions */
+
+struct loudness *loudness_new (int flags, int channels, int rate)
+/* Create empty state for a file of given number of `channels' and sample
+   `rate', `flags' tell what to measure. Return `NULL' if the file cannot
+   be measured. */
+{
+  if (channels < 1 || rate < 10) return NULL;
+  struct loudness *l = calloc (1, sizeof (*l));
+  int pairs = (channels + 1) / 2, i;
+  l->flags = flags;
+  l->channels = channels;
+  l->width = pairs * 2;
+  l->step = rate / 10;
+  l->state = malloc (sizeof (__m128d) * 4 * pairs);
+  l->weight = malloc (sizeof (__m128d) * pairs);
+  l->history = malloc (sizeof (float) * (TP_TAPS - 1) * channels);
+  l->x = malloc (sizeof (float) * LOUD_BLOCK * l->width);
+  l->line = malloc (sizeof (float) * (TP_TAPS - 1 + LOUD_BLOCK));
+  /* Channel weights assume the usual order: L, R, C, (LFE,) Ls, Rs. */
+  double w[2];
+  for (i = 0; i < l->width; i++)
+    {
+      if (i >= channels || (channels == 6 && i == 3)) w[i % 2] = 0;
+      else if ((channels == 5 && i >= 3) || (channels == 6 && i >= 4))
+        w[i % 2] = 1.41;
+      else w[i % 2] = 1;
+      if (i % 2) *(l->weight + i / 2) = _mm_set_pd (w[1], w[0]);
+    }
+  /* Coefficients are derived for any sample rate, at 48 kHz they are the
+     ones given in BS.1770. */
+  double f0 = 1681.974450955533, g = 3.999843853973347,
+    q = 0.7071752369554196;
+  double k = tan (M_PI * f0 / rate), vh = pow (10, g / 20),
+    vb = pow (vh, 0.4996667741545416), a0 = 1 + k / q + k * k;
+  double c[10];
+  c[0] = (vh + vb * k / q + k * k) / a0;
+  c[1] = 2 * (k * k - vh) / a0;
+  c[2] = (vh - vb * k / q + k * k) / a0;
+  c[3] = 2 * (k * k - 1) / a0;
+  c[4] = (1 - k / q + k * k) / a0;
+  f0 = 38.13547087602444;
+  q = 0.5003270373238773;
+  k = tan (M_PI * f0 / rate);
+  a0 = 1 + k / q + k * k;
+  c[5] = 1;
+  c[6] = -2;
+  c[7] = 1;
+  c[8] = 2 * (k * k - 1) / a0;
+  c[9] = (1 - k / q + k * k) / a0;
+  for (i = 0; i < 10; i++)
+    {
+      *(l->coef + i) = _mm_set1_pd (c[i]);
+    }
+  loudness_reset (l);
+  return l;
+}
+
+void loudness_reset (struct loudness *l)
+/* Forget all frames `l' has been fed with. */
+{
+  int pairs = l->width / 2, i;
+  for (i = 0; i < 4 * pairs; i++)
+    {
+      *(l->state + i) = _mm_setzero_pd ();
+    }
+  for (i = 0; i < (TP_TAPS - 1) * l->channels; i++)
+    {
+      *(l->history + i) = 0;
+    }
+  for (i = 0; i < LOUD_BLOCK * l->width; i++)
+    {
+      *(l->x + i) = 0;
+    }
+  l->done = 0;
+  l->acc = 0;
+  l->steps_total = 0;
+  l->true_peak = 0;
+}
+
+void loudness_add (struct loudness *l,
+                   const void *frames,
+                   AFframecount n,
+                   int k,
+                   const struct sample_scale *sc)
+/* Feed `l' with `n' frames of samples of statistics kernel format `k'
+   that are normalized with `sc', see `stats_format'. */
+{
+  /* Filters that are fed with silence decay into denormals, which are
+     very slow, so they are flushed to zero here. */
+  unsigned int csr = _mm_getcsr ();
+  _mm_setcsr (csr | 0x8040);
+  const char *src = frames;
+  long size = sample_size (k) * l->channels;
+  while (n > 0)
+    {
+      long m = n < LOUD_BLOCK ? n : LOUD_BLOCK, i;
+      to_float (src, m, l->channels, l->width, k, sc, l->x);
+      if (l->flags & LSA_TRUE_PEAK) true_peak (l, l->x, m);
+      if (l->flags & LSA_LOUDNESS)
+        for (i = 0; i < m;)
+          {
+            long s = m - i < l->step - l->done ? m - i : l->step - l->done;
+            k_weight (l, l->x + i * l->width, s);
+            i += s;
+            if ((l->done += s) == l->step)
+              {
+                add_step (l, l->acc / l->step);
+                l->acc = 0;
+                l->done = 0;
+              }
+          }
+      src += m * size;
+      n -= m;
+    }
+  _mm_setcsr (csr);
+}
+
+void loudness_done (struct loudness *l, struct audio_params *params)
+/* Put true peak, integrated loudness, and loudness range measured by `l'
+   into `params' and free `l'. Frames of the last incomplete step don't
+   count for loudness. */
+{
+  params->true_peak = l->true_peak;
+  double *e = calloc (l->steps_total ? l->steps_total : 1,
+                      sizeof (double));
+  long i, j, n = 0;
+  double sum = 0;
+  /* Gating blocks of 400 ms overlap by 75%. */
+  for (i = 0; i < l->steps_total; i++)
+    {
+      sum += *(l->steps + i);
+      if (i >= LOUD_STEPS) sum -= *(l->steps + i - LOUD_STEPS);
+      if (i >= LOUD_STEPS - 1) *(e + n++) = sum / LOUD_STEPS;
+    }
+  params->loudness = power_to_lufs (gated_mean (e, n, 0.1));
+  /* Loudness range is spread of short-term loudness of 3 s windows that
+     start every second. */
+  for (i = n = 0; i + LOUD_SHORT <= l->steps_total; i += LOUD_HOP)
+    {
+      for (j = 0, sum = 0; j < LOUD_SHORT; j++)
+        {
+          sum += *(l->steps + i + j);
+        }
+      *(e + n++) = sum / LOUD_SHORT;
+    }
+  /* Relative gate is 20 LU below mean of windows that pass absolute
+     gate. */
+  double mean = gated_mean (e, n, 0);
+  for (i = j = 0; i < n; i++)
+    {
+      if (*(e + i) > mean * 0.01 && power_to_lufs (*(e + i)) > -70)
+        *(e + j++) = power_to_lufs (*(e + i));
+    }
+  params->lra = 0;
+  if (j)
+    {
+      qsort (e, j, sizeof (double), cmp_double);
+      params->lra = *(e + (long)round ((j - 1) * 0.95))
+        - *(e + (long)round ((j - 1) * 0.1));
+    }
+  free (e);
+  free (l->steps);
+  free (l->state);
+  free (l->weight);
+  free (l->history);
+  free (l->x);
+  free (l->line);
+  free (l);
+}
+
+/* `conv' turns single raw sample into float like statistics kernels do,
+   32 bit unsigned containers are flipped to signed ones. */
+
+#define PLAIN(x) ((float)(x))
+#define FLIP32(x) ((float)(int32_t)((x) ^ 0x80000000u))
+#define CONVERT(type, conv)                                             \
+  for (i = 0; i < n; i++)                                               \
+    for (c = 0; c < channels; c++)                                      \
+      *(dst + i * width + c) =                                          \
+        (conv (load_sample (type, src, i * channels + c)) - sc->offset) \
+        * sc->inv
+
+static void to_float (const void *src,
+                      AFframecount n,
+                      int channels,
+                      int width,
+                      int k,
+                      const struct sample_scale *sc,
+                      float *dst)
+/* Convert `n' frames of `channels' channels in `src' (format `k') to
+   normalized floats in `dst', `width' floats per frame. Padding is not
+   touched. */
+{
+  AFframecount i;
+  int c;
+  switch (k)
+    {
+    case K_INT32  : CONVERT (int32_t, PLAIN); break;
+    case K_INT16  : CONVERT (int16_t, PLAIN); break;
+    case K_INT8   : CONVERT (int8_t, PLAIN); break;
+    case K_UINT32 : CONVERT (uint32_t, FLIP32); break;
+    case K_UINT16 : CONVERT (uint16_t, PLAIN); break;
+    case K_UINT8  : CONVERT (uint8_t, PLAIN); break;
+    case K_FLOAT  : CONVERT (float, PLAIN); break;
+    case K_DOUBLE : CONVERT (double, PLAIN); break;
+    }
+}
+
+static long sample_size (int k)
+/* Return size of a sample of statistics kernel format `k'. */
+{
+  switch (k)
+    {
+    case K_DOUBLE : return 8;
+    case K_INT32  :
+    case K_UINT32 :
+    case K_FLOAT  : return 4;
+    case K_INT16  :
+    case K_UINT16 : return 2;
+    default       : return 1;
+    }
+}
+
+static void k_weight (struct loudness *l, const float *x, long n)
+/* Run `n' converted frames in `x' through K-weighting filter and add
+   weighted squares of the output to the current step. Biquads are in
+   transposed direct form II, a vector holds two channels. */
+{
+  const __m128d *c = l->coef;
+  int pairs = l->width / 2, p;
+  long i;
+  for (p = 0; p < pairs; p++)
+    {
+      __m128d *z = l->state + 4 * p, sum = _mm_setzero_pd ();
+      __m128d z1 = *z, z2 = *(z + 1), z3 = *(z + 2), z4 = *(z + 3);
+      const float *s = x + 2 * p;
+      for (i = 0; i < n; i++, s += l->width)
+        {
+          __m128d v = _mm_cvtps_pd (_mm_castsi128_ps
+                                    (_mm_loadl_epi64 ((const __m128i *)s)));
+          __m128d y = _mm_add_pd (_mm_mul_pd (*c, v), z1);
+          z1 = _mm_add_pd (_mm_sub_pd (_mm_mul_pd (*(c + 1), v),
+                                       _mm_mul_pd (*(c + 3), y)), z2);
+          z2 = _mm_sub_pd (_mm_mul_pd (*(c + 2), v),
+                           _mm_mul_pd (*(c + 4), y));
+          v = y;
+          y = _mm_add_pd (_mm_mul_pd (*(c + 5), v), z3);
+          z3 = _mm_add_pd (_mm_sub_pd (_mm_mul_pd (*(c + 6), v),
+                                       _mm_mul_pd (*(c + 8), y)), z4);
+          z4 = _mm_sub_pd (_mm_mul_pd (*(c + 7), v),
+                           _mm_mul_pd (*(c + 9), y));
+          sum = _mm_add_pd (sum, _mm_mul_pd (y, y));
+        }
+      *z = z1;
+      *(z + 1) = z2;
+      *(z + 2) = z3;
+      *(z + 3) = z4;
+      union { __m128d m; double n[2]; } u;
+      u.m = _mm_mul_pd (sum, *(l->weight + p));
+      l->acc += *u.n + *(u.n + 1);
+    }
+}
+
+static void true_peak (struct loudness *l, const float *x, long n)
+/* Oversample `n' converted frames in `x' channel by channel and fold
+   magnitudes of the result into true peak. A vector holds a phase of 4
+   consecutive samples, so the 4 phases are accumulated independently and
+   every tap is a single unaligned load. The filter reaches back `TP_TAPS'
+   - 1 samples, they are kept between blocks. */
+{
+  __m128 coef[4][TP_TAPS], mx = _mm_setzero_ps ();
+  __m128 sign = _mm_set1_ps (-0.0f);
+  float k[4][TP_TAPS], *line = l->line, peak = l->true_peak;
+  long i;
+  int c, p, t;
+  for (t = 0; t < TP_TAPS; t++)
+    {
+      k[0][t] = tp_coef[0][t];
+      k[1][t] = tp_coef[1][t];
+      k[2][t] = tp_coef[1][TP_TAPS - 1 - t];
+      k[3][t] = tp_coef[0][TP_TAPS - 1 - t];
+      for (p = 0; p < 4; p++)
+        {
+          coef[p][t] = _mm_set1_ps (k[p][t]);
+        }
+    }
+  for (c = 0; c < l->channels; c++)
+    {
+      float *h = l->history + c * (TP_TAPS - 1);
+      memcpy (line, h, sizeof (float) * (TP_TAPS - 1));
+      for (i = 0; i < n; i++)
+        {
+          *(line + TP_TAPS - 1 + i) = *(x + i * l->width + c);
+        }
+      for (i = 0; i + 4 <= n; i += 4)
+        {
+          const float *s = line + i + TP_TAPS - 1;
+          __m128 a0 = _mm_setzero_ps (), a1 = a0, a2 = a0, a3 = a0;
+          for (t = 0; t < TP_TAPS; t++)
+            {
+              __m128 v = _mm_loadu_ps (s - t);
+              a0 = _mm_add_ps (a0, _mm_mul_ps (coef[0][t], v));
+              a1 = _mm_add_ps (a1, _mm_mul_ps (coef[1][t], v));
+              a2 = _mm_add_ps (a2, _mm_mul_ps (coef[2][t], v));
+              a3 = _mm_add_ps (a3, _mm_mul_ps (coef[3][t], v));
+            }
+          mx = _mm_max_ps (mx, _mm_andnot_ps (sign, a0));
+          mx = _mm_max_ps (mx, _mm_andnot_ps (sign, a1));
+          mx = _mm_max_ps (mx, _mm_andnot_ps (sign, a2));
+          mx = _mm_max_ps (mx, _mm_andnot_ps (sign, a3));
+        }
+      for (; i < n; i++)
+        {
+          const float *s = line + i + TP_TAPS - 1;
+          for (p = 0; p < 4; p++)
+            {
+              float y = 0;
+              for (t = 0; t < TP_TAPS; t++)
+                {
+                  y += k[p][t] * *(s - t);
+                }
+              if (fabsf (y) > peak) peak = fabsf (y);
+            }
+        }
+      memcpy (h, line + n, sizeof (float) * (TP_TAPS - 1));
+    }
+  union { __m128 m; float n[4]; } u;
+  u.m = mx;
+  for (t = 0; t < 4; t++)
+    {
+      if (*(u.n + t) > peak) peak = *(u.n + t);
+    }
+  l->true_peak = peak;
+}
+
+static void add_step (struct loudness *l, double e)
+/* Remember weighted mean square `e' of a complete step. */
+{
+  if (l->steps_total == l->steps_size)
+    {
+      l->steps_size = l->steps_size ? l->steps_size * 2 : 1024;
+      l->steps = realloc (l->steps, sizeof (double) * l->steps_size);
+    }
+  *(l->steps + l->steps_total++) = e;
+}
+
+static double gated_mean (const double *e, long n, double relative)
+/* Return mean of `n' mean squares `e' of blocks gated first by absolute
+   threshold of -70 LUFS and then by `relative' times mean of the blocks
+   that pass it, zero `relative' leaves only the absolute gate. Return 0
+   if no block passes. */
+{
+  double sum = 0, gate;
+  long i, m = 0;
+  for (i = 0; i < n; i++)
+    {
+      if (power_to_lufs (*(e + i)) > -70)
+        {
+          sum += *(e + i);
+          m++;
+        }
+    }
+  if (!m) return 0;
+  gate = sum / m * relative;
+  sum = 0;
+  m = 0;
+  for (i = 0; i < n; i++)
+    {
+      if (power_to_lufs (*(e + i)) > -70 && *(e + i) > gate)
+        {
+          sum += *(e + i);
+          m++;
+        }
+    }
+  return m ? sum / m : 0;
+}
+
+static double power_to_lufs (double e)
+/* Convert weighted mean square to loudness, -inf for silence. */
+{
+  return e > 0 ? -0.691 + 10 * log10 (e) : -HUGE_VAL;
+}
+
+static int cmp_double (const void *a, const void *b)
+/* Compare doubles for `qsort'. */
+{
+  double x = *(const double *)a, y = *(const double *)b;
+  return (x > y) - (x < y);
+}
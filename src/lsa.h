@@ -23,16 +23,24 @@
 #include <stdlib.h>    /* standard stuff */
 #include <stdio.h>     /* printf */
 #include <stdint.h>    /* intN_t things */
+#include <stddef.h>    /* offsetof */
 #include <getopt.h>    /* getopt_long */
 #include <math.h>      /* round */
 #include <sys/stat.h>  /* stat */
+#include <sys/mman.h>  /* mmap */
+#include <sys/file.h>  /* flock */
+#include <sys/syscall.h> /* getdents64 */
+#include <fcntl.h>     /* open */
 #include <dirent.h>    /* scan directories */
 #include <unistd.h>    /* getcwd, sysconf */
 #include <string.h>    /* strcpy, strcat */
-#include <audiofile.h> /* http://www.68k.org/~michael/audiofile/ */
+#include <limits.h>    /* INT_MAX */
+#include <time.h>      /* clock_gettime */
+#include "liblsa.h"    /* public part of the library */
 #include <pthread.h>   /* create and manage posix threads */
 #include <xmmintrin.h> /* for SSE intrinsics */
 #include <emmintrin.h> /* for SSE2 intrinsics */
+#include <immintrin.h> /* for SSE4.1, AVX2, and AVX-512 intrinsics */
 
 /* some definitions */
 
@@ -50,7 +58,7 @@
   "You should have received a copy of the GNU General Public License\n" \
   "along with this program. If not, see <http://www.gnu.org/licenses/>.\n"
 #define LSA_HELP "lsa — list properties of audio files\n\n"             \
-  "Usage: lsa [OPTIONS] [DIRECTORY]\n\n"                                \
+  "Usage: lsa [OPTIONS] [DIRECTORY | PATH...]\n\n"                      \
   "Available options:\n"                                                \
   "  --help                  Show this help text\n"                     \
   "  --license               Show license of the program\n"             \
@@ -59,31 +67,330 @@
   "  -f,--frames             Show number of frames per file\n"          \
   "  -b,--bitrate            Show bitrate per file\n"                   \
   "  -p,--peak               Show peak per file\n"                      \
-  "  -c,--compression        Show compression scheme per file\n"
+  "  -c,--compression        Show compression scheme per file\n"      \
+  "  -P,--peaks              Show peak of every channel per file\n"    \
+  "  -r,--rms                Show RMS level per file\n"                \
+  "  -d,--dc                 Show DC offset per file\n"                \
+  "  --clips                 Show number of clipped samples per file\n" \
+  "  --overview=N            Save N-bucket envelopes of files\n"      \
+  "  --silence=THRESH        Show leading and trailing silence per file\n" \
+  "  --true-peak             Show true peak per file (dBTP)\n"         \
+  "  --loudness              Show loudness and loudness range per file\n" \
+  "  --peak-sample=R         Find peaks reading only part R of frames\n" \
+  "  --hash                  Show hash of decoded samples per file\n"  \
+  "  --dupes                 Only show files with the same samples\n"  \
+  "  -R,--recursive          List subdirectories recursively\n"        \
+  "  --files-from=FILE       Also analyze paths listed in FILE (- stdin)\n" \
+  "  -0,--null               Paths in --files-from end with NUL\n"     \
+  "  -j,--jobs=N             Number of worker threads\n"                \
+  "  --pin                   Pin worker threads to CPUs\n"              \
+  "  --watch                 Keep listing up to date as files change\n" \
+  "  --shard=K/N             Only analyze files of shard K of N\n"      \
+  "  --emit-partial=FILE     Write results to FILE for --merge\n"       \
+  "  --merge FILE...         Print results merged from partial files\n" \
+  "  --buffer-size=SIZE      Size of per-thread decoding buffer (K, M)\n" \
+  "  --no-mmap               Always decode audio with the library\n"    \
+  "  --read-ahead=N          Read up to N files ahead of analysis\n"    \
+  "  --io-threads=N          Number of files read ahead at once\n"      \
+  "  --no-cache              Don't read or write cache of results\n"    \
+  "  --rebuild-cache         Ignore cached results and write new ones\n" \
+  "  --timings               Print timings of phases of work to stderr\n" \
+  "  --timings-json=FILE     Also write the timings to FILE as JSON\n"
 
 #define BASENAME_MAX_LEN     256 /* according to definition of `d_name'
                                     field in `struct dirent' */
+#define LSA_BUFFER_SIZE  (1 << 20) /* default size of decoding buffer */
+#define LSA_BUFFER_MIN   4096      /* minimal size of decoding buffer */
+#define LSA_ALIGN        64        /* alignment of decoding buffers */
+#define LSA_MAP_SIZE     (64 << 20) /* how much of a file is mapped into
+                                       memory at once */
+#define LSA_BATCH_MAX    64        /* max number of files a thread takes
+                                       at once */
+#define LSA_SPLIT_SIZE   (64 << 20) /* files that decode to more bytes are
+                                       split between threads */
+#define LSA_CHUNK_SIZE   (16 << 20) /* decoded bytes per part of split
+                                       file */
+#define LSA_FLAC_RATIO   2         /* assumed ratio of decoded size of FLAC
+                                       files to their size */
+#define LSA_DECODE_COST  8         /* how many times decoding is slower
+                                       than scanning of mapped samples */
+#define LSA_HEAVY_COST   (1 << 20) /* files that cost more are taken by
+                                       threads one at a time */
+#define LSA_HEADER_READ  (64 << 10) /* how much of a file is read ahead
+                                       when only its header is needed */
+#define STATS_MAX_CHANNELS 16      /* files with more channels get their
+                                      statistics from scalar code */
+#define LSA_OVERVIEW_MAX (1 << 16) /* max number of buckets of envelopes */
+#define LSA_SILENCE_BLOCK 4096     /* frames first read from an edge of a
+                                      file to find silence */
+#define LSA_SILENCE_SLICE 256      /* frames checked at once when looking
+                                      for the first loud sample */
+#define HASH_STRIPE      64        /* bytes taken at once by hash kernels */
+#define LSA_SAMPLE_BLOCK 16384     /* frames read at once when peaks are
+                                      sampled */
+#define LSA_LIST_WINDOW  4096      /* max number of listed paths that are
+                                      queued or being analyzed */
+#define LSA_DENTS_SIZE   (64 << 10) /* size of buffer for `getdents64' */
+#define LSA_ARENA_BLOCK  (1 << 20) /* size of blocks of arenas */
+#define LSA_RADIX_MIN    32        /* smaller groups of names are sorted
+                                      with insertion sort */
+
+/* Samples in mapped files are not necessarily aligned, so single samples
+   are loaded with `memcpy', which compiles to a plain move. */
+
+#define load_sample(type, frames, i)                                    \
+  ({ type _s; memcpy (&_s, (const type *)(frames) + (i), sizeof (_s)); _s; })
 
 /* structures */
 
-struct audio_params /* this structure contains various parameters of files
-                       that have been analyzed */
+struct lsa_context /* analysis context, see liblsa.c */
+{
+  int flags; /* set of `LSA_*' flags */
+  long threads; /* number of threads of `lsa_analyze_batch' */
+  long buffer_size; /* size of every decoding buffer in bytes */
+  long buckets; /* number of buckets of envelopes, 0 if they are not
+                   calculated */
+  double silence; /* threshold of silence, negative if silence is not
+                     detected */
+  double sample; /* part of blocks read to find peaks, 0 if all frames are
+                    read */
+  void **buffers; /* decoding buffer of every thread, `NULL' until it's
+                     used */
+  int timings; /* set if phases of work are timed, only the `lsa' program
+                  sets it after it has called `profile_init' */
+};
+
+enum /* sample formats that have their own peak kernels, formats after
+        `K_DOUBLE' only occur in mapped files */
+  { K_INT32, K_INT16, K_INT8, K_UINT32, K_UINT16, K_UINT8, K_FLOAT,
+    K_DOUBLE, K_INT24, K_INT32_BE, K_INT24_BE, K_INT16_BE, K_FLOAT_BE,
+    K_DOUBLE_BE, K_TOTAL };
+
+#define K_STATS (K_DOUBLE + 1) /* formats that have statistics kernels */
+
+enum /* instruction sets, from the least capable to the most capable */
+  { ISA_SCALAR, ISA_SSE2, ISA_SSE41, ISA_AVX2, ISA_AVX512, ISA_TOTAL };
+
+typedef double (*peak_kernel) (void *, AFframecount);
+
+struct sample_scale /* how samples of some format are normalized */
+{
+  float offset; /* subtracted from raw samples */
+  float inv; /* then they are multiplied by this */
+  float clip; /* normalized samples at or above this are clipped, as well
+                 as ones at -1 */
+};
+
+typedef void (*stats_kernel) (const void *,
+                              AFframecount,
+                              int,
+                              const struct sample_scale *,
+                              struct channel_stats *);
+
+typedef void (*hash_kernel) (uint64_t *,
+                             const void *,
+                             long,
+                             const void *,
+                             uint64_t);
+
+struct pcm_hash /* state of hash of samples of a file, see hash.c */
+{
+  uint64_t acc[8]; /* accumulators */
+  unsigned char tail[HASH_STRIPE]; /* bytes that don't make a stripe yet */
+  long tail_len;
+  int stripe; /* index of next stripe in current block */
+  uint64_t length; /* number of hashed bytes */
+  uint64_t mask; /* xor-ed with every 8 bytes of samples */
+  uint64_t format; /* rate, channels, width, and format of samples */
+};
+
+struct chunk /* part of a big file that is processed by single thread */
+{
+  long item; /* index of file in `items' */
+  AFframecount start;
+  AFframecount count;
+  double peak;
+  struct channel_stats *stats; /* `NULL' unless statistics are requested */
+  struct channel_stats *overview; /* buckets of envelope the part touches,
+                                     `NULL' unless it's requested */
+  int ok; /* set if the part has been processed successfully */
+};
+
+struct cache_key /* identity of file contents for the cache */
+{
+  uint64_t dev;
+  uint64_t ino;
+  uint64_t size;
+  uint64_t mtime; /* in nanoseconds */
+  int flags; /* set of `CACHE_*' flags, what is known about the file */
+};
+
+#define CACHE_PEAK 1 /* peak has been calculated */
+#define CACHE_HASH 2 /* hash of samples has been calculated */
+
+struct table /* layout and totals of a table of results */
 {
+  int show_hours; /* set if durations have hours */
+  int bound; /* set if some peaks may be lower bounds, they get a mark */
+  int max_channels; /* width of `--peaks' column in channels */
+  long files;
   AFframecount frames;
-  char *name;
+  AFframecount samples; /* samples that have statistics */
+  AFframecount clips;
   double duration;
-  double kbps;
+  double kbps; /* sum of bitrates weighted by duration */
   double peak;
-  int channels;
-  int compression;
-  int format;
-  int rate;
-  int width;
+  double sum2; /* sum of squares of samples that have statistics */
+  double true_peak;
+  int sampled; /* set if peak is a lower bound */
 };
 
+struct arena /* memory for objects that are freed together, see
+                arena.c */
+{
+  struct arena_block *block; /* current block, `NULL' if nothing has been
+                                allocated */
+  size_t used; /* bytes used in current block */
+};
+
+struct linux_dirent64 /* record returned by `getdents64' */
+{
+  uint64_t d_ino;
+  int64_t d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[];
+};
+
+struct cache; /* opaque, see cache.c */
+
+struct loudness; /* opaque, see loudness.c */
+
+enum /* phases of work that are timed with `--timings' */
+  { PH_SCAN, PH_OPEN, PH_READ, PH_DECODE, PH_KERNEL, PH_MAPPED, PH_CACHE,
+    PH_PRINT, PH_TOTAL };
+
+/* Hooks that time phases of work, they cost just a test of a flag unless
+   `--timings' is given. */
+
+#define PROFILE_START(t) double t = op_timings ? profile_now () : 0
+#define PROFILE_END(t, phase, bytes)                                    \
+  do { if (op_timings) profile_add ((phase), (t), (bytes)); } while (0)
+
+/* The same hooks for the library, which doesn't see options of the
+   program, it only times work of contexts that have `timings' set. */
+
+#define CTX_PROFILE_START(ctx, t)                                       \
+  double t = (ctx)->timings ? profile_now () : 0
+#define CTX_PROFILE_END(ctx, t, phase, bytes)                           \
+  do { if ((ctx)->timings) profile_add ((phase), (t), (bytes)); }       \
+  while (0)
+
 /* some declarations */
 
-extern int op_peak, op_peaks, op_comp;
-struct audio_params *analyze_file (char *);
+extern int op_total, op_peak, op_peaks, op_comp, op_no_mmap, op_no_cache,
+  op_rebuild_cache, op_stats, op_timings, op_pin, op_watch, op_recursive,
+  op_silence, op_true_peak, op_loudness, op_hash, op_dupes, op_null;
+extern long buffer_size, threads_total, read_ahead, io_threads, shard_index,
+  shard_count, overview_buckets;
+extern double peak_sample;
+extern struct lsa_context *context;
+struct audio_params *analyze_item (char *,
+                                   void *,
+                                   struct cache *,
+                                   struct cache_key *,
+                                   int *,
+                                   int *,
+                                   struct arena *);
+long claim_items (long *, long, long, long *);
+void *alloc_buffer (void);
+long read_dir (const char *, struct arena *, char ***);
+int is_audio (const char *, unsigned char);
+void print_table (struct audio_params **, long);
+void table_init (struct table *);
+void table_add (struct table *, const struct audio_params *);
+void print_header (const struct table *);
+void print_row (const struct table *, const struct audio_params *);
+void print_totals (const struct table *);
+char *make_path (char *, size_t *, size_t, const char *);
+long sort_by_cost (int, void **, long, size_t, int);
+void sort_by_name (struct audio_params **, long);
+void *arena_alloc (struct arena *, size_t);
+char *arena_string (struct arena *, const char *, size_t);
+void arena_free (struct arena *);
+void walk_tree (const char *);
+int list_files (char **, long, const char *);
+long cpu_count (void);
+void cpu_pin (void);
+int watch_open (const char *);
+int watch_dir (int, const char *, struct audio_params **, struct cache_key *,
+               long);
+int in_shard (const char *, const char *);
+int partial_open (const char *, const char *, int);
+void partial_add (const char *, struct audio_params **, long);
+int partial_close (void);
+int merge_partials (char **, long);
+void overview_save (const char *, struct audio_params **, long);
+void prefetch_start (const char *, void **, long, size_t, long *,
+                     struct cache *);
+void prefetch_wake (void);
+void prefetch_stop (void);
+double profile_now (void);
+void profile_init (long, long);
+void profile_thread (void);
+void profile_io_thread (void);
+void profile_add (int, double, uint64_t);
+void profile_busy (double, long);
+void profile_pool (double);
+void profile_report (const char *);
+int analyze_file (const struct lsa_context *,
+                  const char *,
+                  void *,
+                  struct audio_params *,
+                  int *);
+int analyze_range (const struct lsa_context *,
+                   const char *,
+                   struct audio_params *,
+                   AFframecount,
+                   AFframecount,
+                   void *,
+                   double *,
+                   struct channel_stats *,
+                   struct channel_stats *);
+long bucket_range (long, AFframecount, AFframecount, AFframecount, long *);
+double peak_limit (const struct audio_params *);
+int parse_header (const char *, struct audio_params *);
+struct cache *cache_open (const char *, int);
+void cache_key (const struct stat *, struct cache_key *);
+int cache_lookup (struct cache *, struct cache_key *, struct audio_params *);
+void cache_save (struct cache *,
+                 struct audio_params **,
+                 struct cache_key *,
+                 long);
+void cache_close (struct cache *);
+extern peak_kernel peak_kernels[K_TOTAL];
+extern const peak_kernel peak_kernel_table[ISA_TOTAL][K_TOTAL];
+extern const char *isa_names[ISA_TOTAL];
+int isa_supported (int);
+void select_kernels (void);
+extern stats_kernel stats_kernels[K_STATS];
+extern const stats_kernel stats_kernel_table[ISA_TOTAL][K_STATS];
+int stats_format (int, int, struct sample_scale *);
+struct channel_stats *stats_alloc (int);
+void stats_reset (struct channel_stats *, int);
+void stats_merge (struct channel_stats *, const struct channel_stats *, int);
+struct loudness *loudness_new (int, int, int);
+void loudness_reset (struct loudness *);
+void loudness_add (struct loudness *,
+                   const void *,
+                   AFframecount,
+                   int,
+                   const struct sample_scale *);
+void loudness_done (struct loudness *, struct audio_params *);
+extern hash_kernel hash_stripes;
+extern const hash_kernel hash_kernel_table[ISA_TOTAL];
+void hash_init (struct pcm_hash *, const struct audio_params *);
+void hash_add (struct pcm_hash *, const void *, size_t);
+uint64_t hash_done (struct pcm_hash *);
 
 #endif /* LSA_H */
@@ -24,20 +24,78 @@
 long sep_pos,  /* this value is set from `main', it's index of the first
                   char of base name part of full name of file */
   items_total, /* total number of files found in target directory */
-  prc_index; /* index of file to process */
-struct dirent **items; /* these structures hold information about files in
-                          target directory that are suitable for
-                          processing */
-pthread_mutex_t lock;  /* mutex lock */
+  heavy_total, /* number of files at the beginning of `items' that are
+                  taken one at a time, see `sort_by_cost' */
+  prc_index, /* index of next file (or chunk) to process, it's only
+                accessed atomically while threads are running */
+  threads_total, /* number of worker threads */
+  chunks_total; /* total number of chunks big files are split into */
+char **items; /* names of files in target directory that are suitable
+                 for processing, they are kept in `names' */
+struct arena names; /* names of files in target directory */
+struct arena *arenas; /* results of files, an arena per thread */
+char *wdir; /* target directory, it ends with '/' */
+struct chunk *chunks; /* parts of big files, they are processed after all
+                         files have been opened */
+int *item_chunks; /* number of parts files are split into, parallel to
+                     `items', zero for files processed as a whole */
 extern int optind; /* index of the next element to be processed by `getopt*/
 struct audio_params **outputs; /* vector of pointers to structures that
                                   contain descriptions for individual
-                                  files */
+                                  files, they are kept in `arenas' */
+struct cache *cache; /* cache of results for target directory, `NULL' if
+                        caching is disabled */
+struct cache_key *keys; /* cache keys of files, parallel to `items' */
+int cache_dirty; /* set if the cache should be written back */
+int buffer_failed; /* set if some thread cannot allocate its decoding
+                      buffer, then files it would take may be missing */
 int op_help, op_license, op_version, op_total, op_frames, op_kbps, op_peak,
-  op_comp; /* command line options (flags) */
+  op_peaks, op_rms, op_dc, op_clips, op_comp, op_recursive, op_no_mmap,
+  op_no_cache, op_rebuild_cache, op_pin,
+  op_watch, op_merge, op_silence, op_true_peak, op_loudness, op_hash,
+  op_dupes, op_null; /* command line options (flags) */
+int op_stats; /* set if any statistics of samples are requested */
+int op_timings; /* set if phases of work are timed, see profile.c */
+char *profile_json; /* where to write timings as JSON, `NULL' if they are
+                       only printed */
+long buffer_size = LSA_BUFFER_SIZE; /* size of per-thread decoding buffer
+                                       in bytes */
+long shard_index, /* `--shard' K - 1 */
+  shard_count; /* `--shard' N, 0 if all files are analyzed */
+char *partial_path; /* where to write partial results, `NULL' if they are
+                       printed */
+struct lsa_context *context; /* options of analysis and the kernels, see
+                               liblsa.c */
+long read_ahead, /* how many files ahead of workers are read, 0 disables
+                    read-ahead */
+  io_threads = 1; /* number of threads that read files ahead */
+long overview_buckets; /* number of buckets of envelopes, 0 if they are not
+                          saved */
+double silence_threshold; /* `--silence' level, full scale is 1 */
+double peak_sample; /* `--peak-sample' part of frames read to find peaks,
+                       0 if all frames are read */
+char *files_from; /* file with list of paths to analyze, `NULL' unless
+                     `--files-from' is given */
 
 /* structures & constants */
 
+struct costed_item /* item of vector that is sorted by `sort_by_cost' */
+{
+  long cost; /* estimated time to analyze the item, in bytes */
+  void *item;
+};
+
+struct name_key /* item of vector that is sorted by `sort_by_name' */
+{
+  uint64_t prefix; /* 8 bytes of name, see `sort_keys' */
+  struct audio_params *params;
+};
+
+enum /* codes of long options that have no short equivalents */
+  { OPT_BUFFER_SIZE = 256, OPT_TIMINGS_JSON, OPT_READ_AHEAD, OPT_IO_THREADS,
+    OPT_SHARD, OPT_EMIT_PARTIAL, OPT_OVERVIEW, OPT_SILENCE,
+    OPT_PEAK_SAMPLE, OPT_FILES_FROM };
+
 struct option options[] = /* structures for getopt_long */
   { { "help"       , no_argument, &op_help   , 1 },
     { "license"    , no_argument, &op_license, 1 },
@@ -47,6 +105,34 @@ struct option options[] = /* structures for getopt_long */
     { "bitrate"    , no_argument, &op_kbps   , 1 },
     { "peak"       , no_argument, &op_peak   , 1 },
     { "compression", no_argument, &op_comp   , 1 },
+    { "peaks"      , no_argument, &op_peaks  , 1 },
+    { "rms"        , no_argument, &op_rms    , 1 },
+    { "dc"         , no_argument, &op_dc     , 1 },
+    { "clips"      , no_argument, &op_clips  , 1 },
+    { "overview"   , required_argument, NULL , OPT_OVERVIEW },
+    { "silence"    , required_argument, NULL , OPT_SILENCE },
+    { "true-peak"  , no_argument, &op_true_peak, 1 },
+    { "loudness"   , no_argument, &op_loudness, 1 },
+    { "peak-sample", required_argument, NULL , OPT_PEAK_SAMPLE },
+    { "hash"       , no_argument, &op_hash   , 1 },
+    { "dupes"      , no_argument, &op_dupes  , 1 },
+    { "recursive"  , no_argument, &op_recursive, 1 },
+    { "files-from" , required_argument, NULL , OPT_FILES_FROM },
+    { "null"       , no_argument, &op_null   , 1 },
+    { "jobs"       , required_argument, NULL , 'j' },
+    { "pin"        , no_argument, &op_pin    , 1 },
+    { "watch"      , no_argument, &op_watch  , 1 },
+    { "shard"      , required_argument, NULL , OPT_SHARD },
+    { "emit-partial", required_argument, NULL, OPT_EMIT_PARTIAL },
+    { "merge"      , no_argument, &op_merge  , 1 },
+    { "buffer-size", required_argument, NULL , OPT_BUFFER_SIZE },
+    { "no-mmap"    , no_argument, &op_no_mmap, 1 },
+    { "read-ahead" , required_argument, NULL , OPT_READ_AHEAD },
+    { "io-threads" , required_argument, NULL , OPT_IO_THREADS },
+    { "no-cache"   , no_argument, &op_no_cache, 1 },
+    { "rebuild-cache", no_argument, &op_rebuild_cache, 1 },
+    { "timings"    , no_argument, &op_timings, 1 },
+    { "timings-json", required_argument, NULL , OPT_TIMINGS_JSON },
     { NULL         , 0          , NULL       , 0 } };
 
 const char *s_exts[] = /* extensions of supported file formats */
@@ -65,26 +151,30 @@ const char *s_exts[] = /* extensions of supported file formats */
 
 /* declarations */
 
+static void run_threads (void *(*) (void *), long);
 static void *run_thread (void *);
+static void *run_chunk_thread (void *);
+static void split_files (void);
 static const char *get_ext(const char *);
-static int ext_filter (const struct dirent *);
-static int cmpstrp (const void *, const void *);
+static int cmpcost (const void *, const void *);
+static void sort_keys (struct name_key *, struct name_key *, long, long);
+static uint64_t name_prefix (const char *);
+static int cmphash (const void *, const void *);
+static long keep_dupes (struct audio_params **, long);
+static void print_stats (const struct audio_params *, int);
 static char decode_format (int);
 static void decompose_time (double, int *, int *, int *);
 static char *decode_comp (int);
+static long parse_size (const char *);
+static double parse_level (const char *);
+static double parse_ratio (const char *);
 
 /* main */
 
 int main (int argc, char **argv)
 {
-  /* Before we do some serious stuff, we need to initialize mutex, we cannot
-     work without it. */
-  if (pthread_mutex_init(&lock, NULL) != 0)
-    {
-      fprintf (stderr, "lsa: cannot initialize pthread mutex, exit\n");
-      return EXIT_FAILURE;
-    }
-  /* Now let's check if SSE and SSE2 are supported by CPU and OS. */
+  /* Before we do some serious stuff, let's check if SSE and SSE2 are
+     supported by CPU and OS. */
   if (!(__builtin_cpu_supports ("sse") &&
         __builtin_cpu_supports ("sse2")))
     {
@@ -94,7 +184,8 @@ int main (int argc, char **argv)
   /* First, we process command line options with `getopt_long', see
      documentation for this function to understand what's going on here. */
   int opt;
-  while ((opt = getopt_long (argc, argv, "+tfbpc", options, NULL)) != -1)
+  while ((opt = getopt_long (argc, argv, "+tfbpcPrdR0j:", options, NULL))
+         != -1)
     {
       switch (opt)
         {
@@ -103,8 +194,103 @@ int main (int argc, char **argv)
         case 'b' : op_kbps   = 1; break;
         case 'p' : op_peak   = 1; break;
         case 'c' : op_comp   = 1; break;
+        case 'P' : op_peaks  = 1; break;
+        case 'r' : op_rms    = 1; break;
+        case 'd' : op_dc     = 1; break;
+        case 'R' : op_recursive = 1; break;
+        case '0' : op_null   = 1; break;
+        case 'j' :
+          threads_total = parse_size (optarg);
+          if (threads_total < 1)
+            {
+              fprintf (stderr, "lsa: invalid number of jobs '%s'\n", optarg);
+              return EXIT_FAILURE;
+            }
+          break;
+        case OPT_BUFFER_SIZE :
+          buffer_size = parse_size (optarg);
+          if (buffer_size < LSA_BUFFER_MIN)
+            {
+              fprintf (stderr, "lsa: invalid buffer size '%s'\n", optarg);
+              return EXIT_FAILURE;
+            }
+          break;
+        case OPT_READ_AHEAD :
+          read_ahead = parse_size (optarg);
+          if (read_ahead < 0)
+            {
+              fprintf (stderr, "lsa: invalid read-ahead '%s'\n", optarg);
+              return EXIT_FAILURE;
+            }
+          break;
+        case OPT_IO_THREADS :
+          io_threads = parse_size (optarg);
+          if (io_threads < 1)
+            {
+              fprintf (stderr, "lsa: invalid number of I/O threads '%s'\n",
+                       optarg);
+              return EXIT_FAILURE;
+            }
+          break;
+        case OPT_SHARD :
+          {
+            char c;
+            if (sscanf (optarg, "%ld/%ld%c", &shard_index, &shard_count, &c)
+                != 2 || shard_count < 1 || shard_index < 1 ||
+                shard_index > shard_count)
+              {
+                fprintf (stderr, "lsa: invalid shard '%s'\n", optarg);
+                return EXIT_FAILURE;
+              }
+            shard_index--;
+          }
+          break;
+        case OPT_OVERVIEW :
+          overview_buckets = parse_size (optarg);
+          if (overview_buckets < 1 || overview_buckets > LSA_OVERVIEW_MAX)
+            {
+              fprintf (stderr, "lsa: invalid number of buckets '%s'\n",
+                       optarg);
+              return EXIT_FAILURE;
+            }
+          break;
+        case OPT_SILENCE :
+          silence_threshold = parse_level (optarg);
+          if (silence_threshold < 0)
+            {
+              fprintf (stderr, "lsa: invalid silence threshold '%s'\n",
+                       optarg);
+              return EXIT_FAILURE;
+            }
+          op_silence = 1;
+          break;
+        case OPT_PEAK_SAMPLE :
+          peak_sample = parse_ratio (optarg);
+          if (peak_sample <= 0)
+            {
+              fprintf (stderr, "lsa: invalid sampling ratio '%s'\n",
+                       optarg);
+              return EXIT_FAILURE;
+            }
+          break;
+        case OPT_FILES_FROM :
+          files_from = optarg;
+          break;
+        case OPT_EMIT_PARTIAL :
+          partial_path = optarg;
+          break;
+        case OPT_TIMINGS_JSON :
+          profile_json = optarg;
+          op_timings = 1;
+          break;
         }
     }
+  /* All statistics are calculated together, in one pass. */
+  op_stats = op_peaks || op_rms || op_dc || op_clips;
+  /* Duplicates are found by hashes of samples. */
+  if (op_dupes) op_hash = 1;
+  /* Sampling only makes sense for peaks. */
+  if (peak_sample) op_peak = 1;
   /* Some options are informational by their nature and they cancel other
      options, so we just check if user wants to see some info and print it
      if it's the case. */
@@ -123,162 +309,535 @@ int main (int argc, char **argv)
       printf ("LSA %s, built %s %s\n", LSA_VERSION, __DATE__, __TIME__);
       return EXIT_SUCCESS;
     }
-  /* Find out current working directory, max length of string to hold full
-     file name, set `sep_pos'. */
-  char *temp = optind < argc ? *(argv + optind) : getcwd (NULL, 0);
-  long temp_len = strlen (temp);
-  if (!temp_len)
+  /* With `--merge', arguments are partial results rather than a
+     directory. */
+  if (op_merge) return merge_partials (argv + optind, argc - optind);
+  /* With `--files-from', several arguments, or a file argument, we
+     analyze a list of paths rather than a directory, see list.c. */
+  struct stat sb;
+  int list_mode = files_from || argc - optind > 1 ||
+    (optind < argc && !stat (*(argv + optind), &sb) &&
+     !S_ISDIR (sb.st_mode));
+  if (!list_mode)
     {
+      /* Find out current working directory, set `sep_pos'. */
+      char *temp = optind < argc ? *(argv + optind) : getcwd (NULL, 0);
+      long temp_len = strlen (temp);
+      if (!temp_len)
+        {
+          if (optind >= argc) free (temp);
+          return EXIT_FAILURE;
+        }
+      /* We add 2: one byte for terminating char and one for possible
+         '/'. */
+      wdir = malloc (temp_len + 2);
+      strcpy (wdir, temp);
+      if (*(temp + temp_len - 1) != '/')
+        {
+          *(wdir + temp_len) = '/';
+          sep_pos = temp_len + 1;
+          *(wdir + sep_pos) = '\0';
+        }
+      else sep_pos = temp_len;
       if (optind >= argc) free (temp);
+      /* First of all, we should check if the given directory exists. */
+      if (!(stat (wdir, &sb) == 0 && S_ISDIR (sb.st_mode)))
+        {
+          fprintf (stderr,
+                   "lsa: '%s' does not exist or it's not a directory\n",
+                   wdir);
+          free (wdir);
+          return EXIT_FAILURE;
+        }
+    }
+  /* Find out how many CPUs we may use, unless `-j' is given, we start a
+     thread per CPU. */
+  long cpus = cpu_count ();
+  if (!threads_total) threads_total = cpus;
+  if (op_timings) profile_init (threads_total, read_ahead ? io_threads : 0);
+  if (op_watch && (op_recursive || partial_path))
+    {
+      fprintf (stderr, "lsa: --watch cannot be used with --recursive or "
+               "--emit-partial\n");
+      free (wdir);
       return EXIT_FAILURE;
     }
-  long wdir_len = sizeof (char) * (temp_len + BASENAME_MAX_LEN + 2);
-  /* We add 2: one byte for terminating char and one for possible '/'. */
-  char *wdir = malloc (wdir_len);
-  strcpy (wdir, temp);
-  if (*(temp + temp_len - 1) != '/')
+  if (list_mode && (op_watch || overview_buckets))
     {
-      *(wdir + temp_len) = '/';
-      sep_pos = temp_len + 1;
-      *(wdir + sep_pos) = '\0';
+      fprintf (stderr, "lsa: --watch and --overview need a single "
+               "directory\n");
+      return EXIT_FAILURE;
     }
-  else sep_pos = temp_len;
-  if (optind >= argc) free (temp);
-  /* First of all, we should check if the given directory exists. */
-  struct stat sb;
-  if (!(stat (wdir, &sb) == 0 && S_ISDIR (sb.st_mode)))
+  /* Files are only read ahead in a single directory, where the whole
+     list is known before workers start. */
+  if ((read_ahead || io_threads != 1) && (op_recursive || list_mode))
+    {
+      fprintf (stderr, "lsa: --read-ahead and --io-threads need a single "
+               "directory\n");
+      free (wdir);
+      return EXIT_FAILURE;
+    }
+  if (overview_buckets && shard_count)
+    {
+      fprintf (stderr, "lsa: --overview cannot be used with --shard\n");
+      free (wdir);
+      return EXIT_FAILURE;
+    }
+  if (peak_sample && (op_stats || overview_buckets || op_true_peak ||
+                      op_loudness || op_hash))
+    {
+      fprintf (stderr, "lsa: --peak-sample cannot be used with statistics, "
+               "--overview, --true-peak, --loudness, or --hash\n");
+      free (wdir);
+      return EXIT_FAILURE;
+    }
+  if (partial_path && partial_open (partial_path, list_mode ? "" : wdir,
+                                    op_recursive && !list_mode))
     {
-      fprintf (stderr,
-               "lsa: '%s' does not exist or it's not a directory\n", wdir);
+      fprintf (stderr, "lsa: cannot write '%s'\n", partial_path);
       free (wdir);
       return EXIT_FAILURE;
     }
+  /* Everything that is needed to analyze files is kept in the context of
+     the library, creating it picks the fastest kernels for this CPU. */
+  context = lsa_new ((op_peak ? LSA_PEAK : 0) |
+                     (op_stats ? LSA_STATS : 0) |
+                     (op_true_peak ? LSA_TRUE_PEAK : 0) |
+                     (op_loudness ? LSA_LOUDNESS : 0) |
+                     (op_hash ? LSA_HASH : 0) |
+                     (op_no_mmap ? LSA_NO_MMAP : 0),
+                     threads_total,
+                     buffer_size);
+  if (!context)
+    {
+      fprintf (stderr, "lsa: cannot dynamically allocate memory\n");
+      free (wdir);
+      return EXIT_FAILURE;
+    }
+  context->timings = op_timings;
+  lsa_set_overview (context, overview_buckets);
+  lsa_set_silence (context, op_silence ? silence_threshold : -1);
+  lsa_set_peak_sample (context, peak_sample);
+  if (list_mode || op_recursive)
+    {
+      int status = EXIT_SUCCESS;
+      if (list_mode)
+        status = list_files (argv + optind, argc - optind, files_from);
+      else walk_tree (wdir);
+      free (wdir);
+      lsa_free (context);
+      if (partial_close ())
+        {
+          fprintf (stderr, "lsa: cannot write '%s'\n", partial_path);
+          status = EXIT_FAILURE;
+        }
+      if (buffer_failed) status = EXIT_FAILURE;
+      if (op_timings) profile_report (profile_json);
+      return status;
+    }
+  /* In watch mode, we subscribe to changes before the directory is
+     listed, so nothing that happens in between is missed. */
+  int watch_fd = -1;
+  if (op_watch && (watch_fd = watch_open (wdir)) < 0)
+    {
+      fprintf (stderr, "lsa: cannot watch directory '%s'\n", wdir);
+      free (wdir);
+      lsa_free (context);
+      return EXIT_FAILURE;
+    }
   /* Scan working directory, save number of items we can process and items
      themselves in global variables. */
-  items_total = scandir (wdir, &items, ext_filter, NULL);
-  /* Allocate memory for vector of result structures. */
-  outputs = malloc (sizeof (struct audioParams *) * items_total);
-  /* Get number of cores, start a thread per core, every thread gets string
-     with copy of working directory, the string should have enough space to
-     `strcat' base names to it later. We also need to allocate enough space
-     for a vector of all thread ids. */
-  long ncores = sysconf (_SC_NPROCESSORS_ONLN);
-  pthread_t *tidv = malloc (sizeof (pthread_t) * ncores);
+  PROFILE_START (t);
+  items_total = read_dir (wdir, &names, &items);
+  PROFILE_END (t, PH_SCAN, 0);
+  if (items_total < 0)
+    {
+      fprintf (stderr, "lsa: cannot read directory '%s'\n", wdir);
+      free (wdir);
+      lsa_free (context);
+      return EXIT_FAILURE;
+    }
+  /* When files are going to be decoded, start with the most expensive
+     ones, so a big file at the end of the directory doesn't keep one
+     thread busy after all the others are done. Files are sorted by name
+     before printing anyway. Files are not split when loudness, true
+     peak, or hash is calculated. */
+  if ((op_peak || op_stats || overview_buckets || op_true_peak ||
+       op_loudness || op_hash) && items_total > 1)
+    {
+      int dfd = open (wdir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+      if (dfd >= 0)
+        {
+          heavy_total = sort_by_cost (dfd, (void **)items, items_total, 0,
+                                      !op_true_peak && !op_loudness &&
+                                      !op_hash);
+          close (dfd);
+        }
+    }
+  /* Allocate memory for vector of result structures, the structures
+     themselves are allocated in arenas of threads. */
+  outputs = calloc (items_total + 1, sizeof (struct audio_params *));
+  arenas = calloc (threads_total, sizeof (struct arena));
+  /* Open cache of the directory, with `--rebuild-cache' we don't read
+     it, only write. */
+  PROFILE_START (u);
+  if (!op_no_cache) cache = cache_open (wdir, !op_rebuild_cache);
+  PROFILE_END (u, PH_CACHE, 0);
+  if (op_rebuild_cache) cache_dirty = 1;
+  keys = calloc (items_total ? items_total : 1, sizeof (struct cache_key));
+  item_chunks = calloc (items_total ? items_total : 1, sizeof (int));
+  long i;
+  /* Reading of files ahead of workers is done by separate threads, see
+     prefetch.c. */
+  prefetch_start (wdir, (void **)items, items_total, 0, &prc_index, cache);
+  run_threads (run_thread,
+               threads_total < items_total ? threads_total : items_total);
+  prefetch_stop ();
+  /* Big files have not been scanned yet, they are split into chunks and
+     now all threads work on the chunks together. */
+  split_files ();
+  if (chunks_total)
+    {
+      prc_index = 0;
+      run_threads (run_chunk_thread,
+                   threads_total < chunks_total ? threads_total
+                   : chunks_total);
+      for (i = 0; i < chunks_total; i++)
+        {
+          struct chunk *c = chunks + i;
+          struct audio_params *p = *(outputs + c->item);
+          if (c->ok)
+            {
+              if (c->peak > p->peak) p->peak = c->peak;
+              if (c->stats) stats_merge (p->stats, c->stats, p->channels);
+              if (c->overview)
+                {
+                  long first, nb = bucket_range (overview_buckets, p->frames,
+                                                 c->start, c->count, &first);
+                  stats_merge (p->overview + first * p->channels,
+                               c->overview, nb * p->channels);
+                }
+              (*(item_chunks + c->item))--;
+            }
+          free (c->stats);
+          free (c->overview);
+        }
+      /* If some chunk of file has failed, we know nothing about its
+         peak, statistics, and envelope, so the file is dropped like
+         files that cannot be analyzed at all and it's not cached. */
+      for (i = 0; i < items_total; i++)
+        {
+          struct audio_params *p = *(outputs + i);
+          if (p && *(item_chunks + i))
+            {
+              free (p->stats);
+              free (p->overview);
+              *(outputs + i) = NULL;
+            }
+        }
+      free (chunks);
+    }
+  free (item_chunks);
+  /* Write new results to the cache, this must be done before `outputs' is
+     sorted, because `keys' go in the same order as `items'. */
+  PROFILE_START (v);
+  if (cache && cache_dirty) cache_save (cache, outputs, keys, items_total);
+  cache_close (cache);
+  PROFILE_END (v, PH_CACHE, 0);
+  if (overview_buckets) overview_save (wdir, outputs, items_total);
+  /* In watch mode, results are kept and updated as files change, it only
+     returns when the directory is gone. */
+  int status = EXIT_SUCCESS;
+  if (op_watch)
+    status = watch_dir (watch_fd, wdir, outputs, keys, items_total);
+  free (keys);
+  free (wdir);
+  partial_add ("", outputs, items_total);
+  if (partial_close ())
+    {
+      fprintf (stderr, "lsa: cannot write '%s'\n", partial_path);
+      status = EXIT_FAILURE;
+    }
+  /* Now, it's time to sort our strings and print results. */
+  PROFILE_START (w);
+  if (!op_watch) print_table (outputs, items_total);
+  PROFILE_END (w, PH_PRINT, 0);
+  /* Now that we're done displaying information, we can free output
+     structures. Only their statistics and envelopes are freed one by one
+     (in watch mode they belong to `watch_dir'), the structures and names
+     of files are freed with their arenas. */
+  for (i = 0; !op_watch && i < items_total; i++)
+    {
+      if (!*(outputs + i)) continue;
+      free ((*(outputs + i))->stats);
+      free ((*(outputs + i))->overview);
+    }
+  for (i = 0; i < threads_total; i++)
+    {
+      arena_free (arenas + i);
+    }
+  free (arenas);
+  free (outputs);
+  arena_free (&names);
+  free (items);
+  lsa_free (context);
+  if (buffer_failed) status = EXIT_FAILURE;
+  if (op_timings) profile_report (profile_json);
+  return status;
+}
+
+/* functions */
+
+static void run_threads (void *(*routine) (void *), long n)
+/* Start `n' threads executing `routine' and wait for them to finish. Every
+   thread gets its own arena from `arenas'. */
+{
+  PROFILE_START (t);
+  pthread_t *tidv = malloc (sizeof (pthread_t) * n);
   long i;
-  for (i = 0; i < ncores; i++)
+  for (i = 0; i < n; i++)
     {
-      char *temp = malloc (sizeof (char) * wdir_len);
-      strcpy (temp, wdir);
-      pthread_create (tidv + i, NULL, run_thread, temp);
+      pthread_create (tidv + i, NULL, routine, arenas + i);
     }
-  /* Wait for all threads to finish using vector of ids. Now free the
-     vector and working directory, destroy mutex. */
-  for (i = 0; i < ncores; i++)
+  for (i = 0; i < n; i++)
     {
       pthread_join (*(tidv + i), NULL);
     }
   free (tidv);
-  free (wdir);
-  pthread_mutex_destroy(&lock);
-  /* Now, it's time to sort our strings and print results. */
-  qsort (outputs, items_total, sizeof (struct audioParams *), cmpstrp);
-  /* Here we determine if we should display hours + some auxiliary
-     calculations for `--total' option. */
-  AFframecount total_frames = 0;
-  char show_hours = 0;
-  double total_dur = 0, total_kbps = 0, total_peak = 0;
+  if (op_timings) profile_pool (t);
+}
+
+static void *run_thread (void *arena)
+/* This function describes behavior of an individual thread. It takes new
+   item from vector of items (if there's any), builds full name of the
+   file, calls function `analyze_item' with this name and takes result of
+   this call. Result structures are allocated in `arena' of the thread.
+   Finally this routine copies pointer to result structure to `outputs'.
+   Every thread allocates one aligned decoding buffer and reuses it for
+   all files it processes. Files that are found in the cache are not
+   opened at all. */
+{
+  if (op_pin) cpu_pin ();
+  if (op_timings) profile_thread ();
+  void *buffer = alloc_buffer ();
+  if (!buffer) return NULL;
+  size_t size = sep_pos + 1;
+  char *dir = malloc (size);
+  memcpy (dir, wdir, size);
+  long i, end;
+  while ((i = claim_items (&prc_index, items_total,
+                           __atomic_load_n (&prc_index, __ATOMIC_RELAXED)
+                           < heavy_total ? 1 : LSA_BATCH_MAX, &end))
+         >= 0)
+    {
+      prefetch_wake ();
+      PROFILE_START (t);
+      long n = end - i;
+      for (; i < end; i++)
+        {
+          dir = make_path (dir, &size, sep_pos, *(items + i));
+          *(outputs + i) =
+            analyze_item (dir, buffer, cache, keys + i, &cache_dirty,
+                          item_chunks + i, arena);
+          if (*(outputs + i)) (**(outputs + i)).name = *(items + i);
+        }
+      if (op_timings) profile_busy (t, n);
+    }
+  free (buffer);
+  free (dir);
+  return NULL;
+}
+
+static void *run_chunk_thread (void *arena)
+/* This is like `run_thread', but it takes chunks of big files from
+   `chunks' and calculates their peaks with `analyze_range'. Results are
+   stored in chunks themselves and merged by `main'. When only peaks are
+   calculated, a chunk that reaches full scale settles peak of its file,
+   so the chunks of the file that are left are skipped. */
+{
+  if (op_pin) cpu_pin ();
+  if (op_timings) profile_thread ();
+  void *buffer = alloc_buffer ();
+  if (!buffer) return NULL;
+  size_t size = sep_pos + 1;
+  char *dir = malloc (size);
+  memcpy (dir, wdir, size);
+  long i, end;
+  while ((i = claim_items (&prc_index, chunks_total, 1, &end)) >= 0)
+    {
+      PROFILE_START (t);
+      struct chunk *c = chunks + i;
+      struct audio_params *p = *(outputs + c->item);
+      double full = op_stats || overview_buckets ? HUGE_VAL
+        : peak_limit (p), peak;
+      __atomic_load (&p->peak, &peak, __ATOMIC_RELAXED);
+      if (peak >= full)
+        {
+          c->ok = 1;
+          if (op_timings) profile_busy (t, 1);
+          continue;
+        }
+      dir = make_path (dir, &size, sep_pos, *(items + c->item));
+      c->ok = !analyze_range (context,
+                              dir,
+                              p,
+                              c->start,
+                              c->count,
+                              buffer,
+                              &c->peak,
+                              c->stats,
+                              c->overview);
+      if (c->ok && c->peak >= full)
+        __atomic_store (&p->peak, &c->peak, __ATOMIC_RELAXED);
+      if (op_timings) profile_busy (t, 1);
+    }
+  free (buffer);
+  free (dir);
+  return NULL;
+}
+
+static void split_files (void)
+/* Build vector of chunks for all files that `analyze_file' has decided to
+   split. Chunks of one file are of equal length, except for the last
+   one. */
+{
+  long i, j = 0;
+  chunks_total = 0;
   for (i = 0; i < items_total; i++)
     {
-      struct audio_params *a = *(outputs + i);
-      if (a->duration > 3600) show_hours = 1;
-      total_dur += a->duration;
-      total_frames += a->frames;
-      total_kbps += a->kbps * a->duration;
-      if (a->peak > total_peak) total_peak = a->peak;
+      chunks_total += *(item_chunks + i);
     }
-  if (op_total && total_dur > 3600) show_hours = 1;
-  if (op_total && total_dur) total_kbps /= total_dur;
-  /* Print header of our table. */
-  printf ("rate   B  f # ");
-  if (show_hours) printf ("hh:");
-  printf ("mm:ss ");
-  if (op_frames) printf ("frames     ");
-  if (op_kbps) printf ("kbps ");
-  if (op_peak) printf ("peak     ");
-  if (op_comp) printf ("compression ");
-  printf ("file\n");
-  /* Print items and free output structures. */
+  if (!chunks_total) return;
+  chunks = malloc (sizeof (struct chunk) * chunks_total);
   for (i = 0; i < items_total; i++)
     {
       struct audio_params *p = *(outputs + i);
-      if (p)
+      int *n = item_chunks + i;
+      if (!*n) continue;
+      AFframecount per = (p->frames + *n - 1) / *n, start;
+      *n = 0;
+      for (start = 0; start < p->frames; start += per, j++, (*n)++)
         {
-          int dur_h, dur_m, dur_s;
-          decompose_time (p->duration, &dur_h, &dur_m, &dur_s);
-          printf ("%6d %-2d %c %d ",
-                  p->rate,
-                  p->width,
-                  decode_format (p->format),
-                  p->channels);
-          if (show_hours) printf ("%02d:", dur_h);
-          printf ("%02d:%02d ", dur_m, dur_s);
-          if (op_frames) printf ("%10ld ", p->frames);
-          if (op_kbps) printf ("%4d ", (int)round(p->kbps));
-          if (op_peak) printf ("%8f ", p->peak);
-          if (op_comp) printf ("%11s ", decode_comp (p->compression));
-          printf ("%s\n", p->name);
-          free (p);
+          struct chunk *c = chunks + j;
+          c->item = i;
+          c->start = start;
+          c->count = p->frames - start < per ? p->frames - start : per;
+          c->peak = 0;
+          c->stats = op_stats ? stats_alloc (p->channels) : NULL;
+          c->overview = NULL;
+          if (overview_buckets)
+            {
+              long first, nb = bucket_range (overview_buckets, p->frames,
+                                             c->start, c->count, &first);
+              c->overview = stats_alloc (nb * p->channels);
+            }
+          c->ok = 0;
         }
     }
-  /* Optionally print totals. */
-  if (op_total)
-    {
-      int dur_h, dur_m, dur_s;
-      decompose_time (total_dur, &dur_h, &dur_m, &dur_s);
-      printf ("              ");
-      if (show_hours) printf ("%02d:", dur_h);
-      printf ("%02d:%02d ", dur_m, dur_s);
-      if (op_frames) printf ("%10ld ", total_frames);
-      if (op_kbps) printf ("%4d ", (int)round(total_kbps));
-      if (op_peak) printf ("%8f ", total_peak);
-      if (op_comp) printf ("            ");
-      printf ("%ld file%s\n", items_total, items_total == 1 ? "" : "s");
-    }
-  /* Now that we're done displaying information, we can free vector of
-     output structures (structures are already freed, see above). */
-  free (outputs);
-  /* Free directory items. */
-  for (i = 0; i < items_total; i++)
+  chunks_total = j;
+}
+
+long claim_items (long *index, long total, long max_batch, long *end)
+/* Atomically claim a batch of consecutive items (files or chunks) from
+   `*index' without any locks. Batches start big, so threads don't fight
+   over the counter when there are lots of small files, and shrink towards
+   the end of the vector, so work stays balanced between threads. Return
+   index of the first claimed item and put index past the last one into
+   `end', or return -1 if there's nothing left. */
+{
+  long left = total - __atomic_load_n (index, __ATOMIC_RELAXED);
+  long n = left / (threads_total * 4);
+  if (n > max_batch) n = max_batch;
+  if (n < 1) n = 1;
+  long i = __atomic_fetch_add (index, n, __ATOMIC_RELAXED);
+  if (i >= total) return -1;
+  *end = i + n < total ? i + n : total;
+  return i;
+}
+
+struct audio_params *analyze_item (char *path,
+                                   void *buffer,
+                                   struct cache *c,
+                                   struct cache_key *k,
+                                   int *dirty,
+                                   int *chunks,
+                                   struct arena *a)
+/* Get parameters of file on `path' from cache `c' or analyze the file if
+   it's not there (or `c' is `NULL'). Key of the file is put into `k',
+   `*dirty' is set if the cache should be written back, `*chunks' is set
+   if the file is to be split, see `analyze_file'. If `chunks' is `NULL',
+   there are no other threads to process chunks, so big files are scanned
+   as a whole right here, and a file is dropped if this fails. Result is
+   allocated in arena `a', or with `malloc' if `a' is `NULL'. */
+{
+  struct audio_params r;
+  struct stat sb;
+  int found = 0, failed = 0, n = 0;
+  if (chunks) *chunks = 0;
+  if (c && !stat (path, &sb))
     {
-      free (*(items + i));
+      cache_key (&sb, k);
+      found = !cache_lookup (c, k, &r);
     }
-  free (items);
-  return EXIT_SUCCESS;
+  if (!found)
+    {
+      failed = analyze_file (context, path, buffer, &r, &n);
+      if (!failed && n && !chunks &&
+          analyze_range (context, path, &r, 0, r.frames, buffer, &r.peak,
+                         r.stats, r.overview))
+        {
+          free (r.stats);
+          free (r.overview);
+          failed = 1;
+        }
+      if (chunks) *chunks = n;
+      k->flags = (op_peak && !failed && !r.sampled ? CACHE_PEAK : 0) |
+        (op_hash ? CACHE_HASH : 0);
+      if (c) __atomic_store_n (dirty, 1, __ATOMIC_RELAXED);
+    }
+  if (failed) return NULL;
+  struct audio_params *p = a ? arena_alloc (a, sizeof (*p))
+    : malloc (sizeof (*p));
+  if (!p)
+    {
+      fprintf (stderr, "lsa: cannot dynamically allocate memory\n");
+      free (r.stats);
+      free (r.overview);
+      return NULL;
+    }
+  *p = r;
+  return p;
 }
 
-/* functions */
+char *make_path (char *path, size_t *size, size_t dir_len, const char *name)
+/* Put `name' after the first `dir_len' chars of `path' (its directory
+   part), growing `path' of `*size' bytes if it's too short. Return the
+   path, it may have moved. */
+{
+  size_t n = dir_len + strlen (name) + 1;
+  if (n > *size)
+    {
+      *size = n * 2;
+      path = realloc (path, *size);
+    }
+  memcpy (path + dir_len, name, n - dir_len);
+  return path;
+}
 
-static void *run_thread (void *dir)
-/* This function describes behavior of an individual thread. It takes new
-   item from vector of items (if there's any), updates name of file `dir',
-   calls function `analyzeFile' with this name and takes result of this
-   call. Note that `analyzeFile' allocates memory for its result structure
-   with `malloc'. Finally this routine copies pointer to result structure to
-   `outputs'. */
-{
-  while (prc_index < items_total)
-    {
-      pthread_mutex_lock (&lock);
-      long i = prc_index++;
-      pthread_mutex_unlock (&lock);
-      *((char *)dir + sep_pos) = '\0';
-      strcat ((char *)dir, (**(items + i)).d_name);
-      *(outputs + i) = analyze_file ((char *)dir);
-      if (*(outputs + i))
-        (**(outputs + i)).name = (**(items + i)).d_name;
+void *alloc_buffer (void)
+/* Allocate aligned decoding buffer of `buffer_size' bytes. When threads
+   are pinned to CPUs, the calling thread touches the buffer right away, so
+   its pages are allocated on the NUMA node of the thread's CPU. */
+{
+  void *buffer = NULL;
+  if (posix_memalign (&buffer, LSA_ALIGN, buffer_size))
+    {
+      fprintf (stderr, "lsa: cannot dynamically allocate aligned memory\n");
+      __atomic_store_n (&buffer_failed, 1, __ATOMIC_RELAXED);
+      return NULL;
     }
-  free (dir);
-  return NULL;
+  if (op_pin) memset (buffer, 0, buffer_size);
+  return buffer;
 }
 
 static const char *get_ext (const char *arg)
@@ -289,13 +848,68 @@ static const char *get_ext (const char *arg)
     return dot + 1;
 }
 
-static int ext_filter (const struct dirent *arg)
-/* This function filters every item of type `struct dirent'. It only accepts
-   regular files and links and those items must have one of supported
-   extensions. */
+long read_dir (const char *dir, struct arena *a, char ***v)
+/* Put names of files in directory `dir' we can process into arena `a'
+   and vector of them into `*v'. Only regular files and links with one of
+   supported extensions are taken, with `--shard' files of other shards
+   are skipped too. Return number of files or -1 if the directory cannot
+   be read. */
+{
+  int fd = open (dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd < 0) return -1;
+  char *dents = malloc (LSA_DENTS_SIZE);
+  long total = 0, size = 0, n;
+  *v = NULL;
+  while ((n = syscall (SYS_getdents64, fd, dents, LSA_DENTS_SIZE)) > 0)
+    {
+      long off;
+      for (off = 0; off < n;)
+        {
+          struct linux_dirent64 *d = (struct linux_dirent64 *)(dents + off);
+          unsigned char type = d->d_type;
+          off += d->d_reclen;
+          if (type == DT_UNKNOWN)
+            {
+              struct stat sb;
+              if (fstatat (fd, d->d_name, &sb, AT_SYMLINK_NOFOLLOW))
+                continue;
+              type = S_ISLNK (sb.st_mode) ? DT_LNK :
+                S_ISREG (sb.st_mode) ? DT_REG : DT_UNKNOWN;
+            }
+          if (!is_audio (d->d_name, type) || !in_shard ("", d->d_name))
+            continue;
+          if (total == size)
+            {
+              size = size ? size * 2 : 256;
+              *v = realloc (*v, sizeof (char *) * size);
+            }
+          char *name = arena_string (a, d->d_name, strlen (d->d_name));
+          if (!name)
+            {
+              fprintf (stderr, "lsa: cannot dynamically allocate memory\n");
+              n = -1;
+              break;
+            }
+          *(*v + total++) = name;
+        }
+      if (n < 0) break;
+    }
+  free (dents);
+  close (fd);
+  if (n < 0)
+    {
+      free (*v);
+      return -1;
+    }
+  return total;
+}
+
+int is_audio (const char *name, unsigned char type)
+/* Check if directory entry with given name and type (`DT_*' constant)
+   should be processed. */
 {
-  if (arg->d_type != DT_REG && arg->d_type != DT_LNK) return 0;
-  const char *ext = get_ext (arg->d_name);
+  if (type != DT_REG && type != DT_LNK) return 0;
+  const char *ext = get_ext (name);
   unsigned int i;
   for (i = 0; i < (sizeof (s_exts) / sizeof (s_exts[0])); i++)
     {
@@ -304,11 +918,371 @@ static int ext_filter (const struct dirent *arg)
   return 0;
 }
 
-static int cmpstrp (const void *a, const void *b)
-/* This is wrapper around `strcmp' to sort output structures with `qsort'. */
+static int cmpcost (const void *a, const void *b)
+/* Order items by descending cost. */
+{
+  long x = ((const struct costed_item *)a)->cost;
+  long y = ((const struct costed_item *)b)->cost;
+  return (x < y) - (x > y);
+}
+
+long sort_by_cost (int dfd,
+                   void **v,
+                   long total,
+                   size_t name_offset,
+                   int split)
+/* Reorder vector `v' of `total' items which names (relative to directory
+   `dfd') are found `name_offset' bytes into every item, so items that are
+   expected to take longer to analyze go first. Cost is the number of
+   bytes of samples, which is frames times channels times width, it is
+   taken from size of the file, because reading headers here would cost as
+   much as analysis of small files. Decoded files are more expensive than
+   files scanned in memory. If `split' is set, big files are going to be
+   split into chunks later, so here they cost just opening. Return number
+   of items at the beginning that cost at least `LSA_HEAVY_COST'. */
+{
+  struct costed_item *c = malloc (sizeof (struct costed_item) * total);
+  long i, heavy = 0;
+  for (i = 0; i < total; i++)
+    {
+      const char *name = (const char *)*(v + i) + name_offset;
+      struct stat sb;
+      long cost = 0;
+      if (!fstatat (dfd, name, &sb, 0))
+        {
+          int flac = !strcmp (get_ext (name), "flac");
+          cost = sb.st_size * (flac ? LSA_FLAC_RATIO : 1);
+          if (split && cost > LSA_SPLIT_SIZE) cost = 0;
+          else if (flac || op_no_mmap) cost *= LSA_DECODE_COST;
+        }
+      (c + i)->cost = cost;
+      (c + i)->item = *(v + i);
+    }
+  qsort (c, total, sizeof (struct costed_item), cmpcost);
+  for (i = 0; i < total; i++)
+    {
+      *(v + i) = (c + i)->item;
+      if ((c + i)->cost >= LSA_HEAVY_COST) heavy++;
+    }
+  free (c);
+  return heavy;
+}
+
+void sort_by_name (struct audio_params **v, long n)
+/* Sort `n' results in `v' by names of files. Sorting takes 8 byte
+   prefixes of names into a compact vector of keys first, so most of the
+   work is done without touching names and results scattered over memory,
+   see `sort_keys'. */
+{
+  if (n < 2) return;
+  struct name_key *keys = malloc (sizeof (struct name_key) * n * 2);
+  long i;
+  for (i = 0; i < n; i++)
+    {
+      (keys + i)->prefix = name_prefix ((*(v + i))->name);
+      (keys + i)->params = *(v + i);
+    }
+  sort_keys (keys, keys + n, n, 0);
+  for (i = 0; i < n; i++)
+    {
+      *(v + i) = (keys + i)->params;
+    }
+  free (keys);
+}
+
+static void sort_keys (struct name_key *v,
+                       struct name_key *tmp,
+                       long n,
+                       long depth)
+/* Sort `n' keys in `v' with MSD radix sort, one byte of names at a time,
+   `tmp' has room for `n' keys. Names of all keys agree on the first
+   `depth' bytes, `prefix' of every key holds the 8 bytes that start at
+   `depth' rounded down to multiple of 8, it's reloaded every 8 bytes.
+   Small groups are finished with insertion sort. */
+{
+  long count[256], i, j;
+  while (n > 1)
+    {
+      if (depth && !(depth % 8))
+        {
+          /* Names of all keys are longer than `depth', because a name
+             that ends gets byte 0 and is never sorted further. */
+          for (i = 0; i < n; i++)
+            {
+              (v + i)->prefix = name_prefix ((v + i)->params->name + depth);
+            }
+        }
+      if (n < LSA_RADIX_MIN)
+        {
+          for (i = 1; i < n; i++)
+            {
+              struct name_key k = *(v + i);
+              for (j = i; j > 0 &&
+                     (k.prefix < (v + j - 1)->prefix ||
+                      (k.prefix == (v + j - 1)->prefix &&
+                       strcmp (k.params->name + depth,
+                               (v + j - 1)->params->name + depth) < 0));
+                   j--)
+                *(v + j) = *(v + j - 1);
+              *(v + j) = k;
+            }
+          return;
+        }
+      int shift = 56 - 8 * (depth % 8);
+      memset (count, 0, sizeof (count));
+      for (i = 0; i < n; i++)
+        {
+          count[((v + i)->prefix >> shift) & 255]++;
+        }
+      int b = (v->prefix >> shift) & 255;
+      if (count[b] == n)
+        {
+          /* All names have the same byte here, there's nothing to
+             distribute. If it's 0, all names are equal. */
+          if (!b) return;
+          depth++;
+          continue;
+        }
+      long start[256], pos = 0;
+      for (i = 0; i < 256; i++)
+        {
+          start[i] = pos;
+          pos += count[i];
+        }
+      for (i = 0; i < n; i++)
+        {
+          *(tmp + start[((v + i)->prefix >> shift) & 255]++) = *(v + i);
+        }
+      memcpy (v, tmp, sizeof (struct name_key) * n);
+      /* Names that end here (byte 0) are equal, the other groups are
+         sorted by the next byte. The biggest group is sorted by this
+         loop rather than recursively, so depth of recursion is
+         logarithmic. */
+      long big = 1, big_pos = count[0];
+      for (i = 2, pos = count[0] + count[1]; i < 256; pos += count[i++])
+        {
+          if (count[i] > count[big])
+            {
+              big = i;
+              big_pos = pos;
+            }
+        }
+      for (i = 1, pos = count[0]; i < 256; pos += count[i++])
+        {
+          if (i != big && count[i] > 1)
+            sort_keys (v + pos, tmp + pos, count[i], depth + 1);
+        }
+      v += big_pos;
+      tmp += big_pos;
+      n = count[big];
+      depth++;
+    }
+}
+
+static uint64_t name_prefix (const char *name)
+/* Return the first 8 bytes of `name' as a big-endian number, so numbers
+   compare like names. Names shorter than that are padded with zeros. */
+{
+  uint64_t x = 0;
+  int i;
+  for (i = 0; i < 8 && *(name + i); i++)
+    {
+      x |= (uint64_t)(unsigned char)*(name + i) << (56 - 8 * i);
+    }
+  return x;
+}
+
+void print_table (struct audio_params **outputs, long total)
+/* Sort `total' results in `outputs' by name (or only keep duplicates
+   with `--dupes') and print them as a table. Elements of `outputs' that
+   are `NULL' are skipped, `outputs' itself is not changed. */
 {
-  return strcmp((**(struct audio_params **)a).name,
-                (**(struct audio_params **)b).name);
+  /* Files that could not be analyzed are left out. */
+  struct audio_params **v = malloc (sizeof (*v) * (total + 1));
+  long i, n = 0;
+  for (i = 0; i < total; i++)
+    {
+      if (*(outputs + i)) *(v + n++) = *(outputs + i);
+    }
+  if (op_dupes) n = keep_dupes (v, n);
+  else sort_by_name (v, n);
+  /* Here we determine if we should display hours + some auxiliary
+     calculations for `--total' option. */
+  struct table t;
+  table_init (&t);
+  for (i = 0; i < n; i++)
+    {
+      struct audio_params *a = *(v + i);
+      if (a->duration > 3600) t.show_hours = 1;
+      if (a->sampled) t.bound = 1;
+      if (a->stats && a->channels > t.max_channels)
+        t.max_channels = a->channels;
+      table_add (&t, a);
+    }
+  if (op_total && t.duration > 3600) t.show_hours = 1;
+  print_header (&t);
+  for (i = 0; i < n; i++)
+    {
+      print_row (&t, *(v + i));
+    }
+  /* Optionally print totals. */
+  if (op_total) print_totals (&t);
+  free (v);
+}
+
+void table_init (struct table *t)
+/* Start empty table: no hours, `--peaks' column for one channel. */
+{
+  memset (t, 0, sizeof (*t));
+  t->max_channels = 1;
+}
+
+void table_add (struct table *t, const struct audio_params *a)
+/* Add file `a' to totals of table `t'. */
+{
+  t->files++;
+  t->duration += a->duration;
+  t->frames += a->frames;
+  t->kbps += a->kbps * a->duration;
+  if (a->peak > t->peak) t->peak = a->peak;
+  if (a->sampled) t->sampled = 1;
+  if (a->true_peak > t->true_peak) t->true_peak = a->true_peak;
+  if (a->stats)
+    {
+      double rms = stats_rms (a->stats, a->channels, a->frames);
+      t->samples += a->frames * a->channels;
+      t->sum2 += rms * rms * a->frames * a->channels;
+      t->clips += stats_clips (a->stats, a->channels);
+    }
+}
+
+void print_header (const struct table *t)
+/* Print header of table `t' with requested columns. */
+{
+  printf ("rate   B  f # ");
+  if (t->show_hours) printf ("hh:");
+  printf ("mm:ss ");
+  if (op_frames) printf ("frames     ");
+  if (op_kbps) printf ("kbps ");
+  if (op_peak) printf (t->bound ? "peak      " : "peak     ");
+  if (op_peaks) printf ("%-*s", t->max_channels * 9, "peaks");
+  if (op_rms) printf ("rms      ");
+  if (op_dc) printf ("dc        ");
+  if (op_clips) printf ("clips      ");
+  if (op_silence) printf ("lead    trail   ");
+  if (op_true_peak) printf ("dBTP    ");
+  if (op_loudness) printf ("LUFS    LRA     ");
+  if (op_hash) printf ("hash             ");
+  if (op_comp) printf ("compression ");
+  printf ("file\n");
+}
+
+void print_row (const struct table *t, const struct audio_params *p)
+/* Print row of file `p' in table `t'. */
+{
+  int dur_h, dur_m, dur_s;
+  decompose_time (p->duration, &dur_h, &dur_m, &dur_s);
+  printf ("%6d %-2d %c %d ",
+          p->rate,
+          p->width,
+          decode_format (p->format),
+          p->channels);
+  if (t->show_hours) printf ("%02d:", dur_h);
+  printf ("%02d:%02d ", dur_m, dur_s);
+  if (op_frames) printf ("%10ld ", p->frames);
+  if (op_kbps) printf ("%4d ", (int)round(p->kbps));
+  if (op_peak)
+    printf ("%8f%s ", p->peak, !t->bound ? "" : p->sampled ? "+" : " ");
+  if (op_stats) print_stats (p, t->max_channels);
+  if (op_silence)
+    printf ("%7.3f %7.3f ", (double)p->lead / p->rate,
+            (double)p->trail / p->rate);
+  if (op_true_peak) printf ("%7.2f ", 20 * log10 (p->true_peak));
+  if (op_loudness) printf ("%7.1f %7.1f ", p->loudness, p->lra);
+  if (op_hash) printf ("%016llx ", (unsigned long long)p->hash);
+  if (op_comp) printf ("%11s ", decode_comp (p->compression));
+  printf ("%s\n", p->name);
+}
+
+void print_totals (const struct table *t)
+/* Print totals of table `t'. */
+{
+  int dur_h, dur_m, dur_s;
+  decompose_time (t->duration, &dur_h, &dur_m, &dur_s);
+  printf ("              ");
+  if (t->show_hours) printf ("%02d:", dur_h);
+  printf ("%02d:%02d ", dur_m, dur_s);
+  if (op_frames) printf ("%10ld ", t->frames);
+  if (op_kbps)
+    printf ("%4d ", (int)round(t->duration ? t->kbps / t->duration : 0));
+  if (op_peak)
+    printf ("%8f%s ", t->peak, !t->bound ? "" : t->sampled ? "+" : " ");
+  if (op_peaks) printf ("%*s", t->max_channels * 9, "");
+  if (op_rms) printf ("%8f ", t->samples ? sqrt (t->sum2 / t->samples) : 0);
+  if (op_dc) printf ("          ");
+  if (op_clips) printf ("%10ld ", t->clips);
+  if (op_silence) printf ("                ");
+  if (op_true_peak) printf ("%7.2f ", 20 * log10 (t->true_peak));
+  if (op_loudness) printf ("                ");
+  if (op_hash) printf ("                 ");
+  if (op_comp) printf ("            ");
+  printf ("%ld file%s\n", t->files, t->files == 1 ? "" : "s");
+}
+
+static int cmphash (const void *a, const void *b)
+/* Compare output structures by hash of samples and then by name. */
+{
+  const struct audio_params *x = *(struct audio_params * const *)a;
+  const struct audio_params *y = *(struct audio_params * const *)b;
+  if (x->hash != y->hash) return x->hash < y->hash ? -1 : 1;
+  return strcmp (x->name, y->name);
+}
+
+static long keep_dupes (struct audio_params **outputs, long n)
+/* Leave only those of `n' results in `outputs' which samples are the same
+   as samples of some other file (according to their hashes), grouped by
+   hash. Return number of results left. */
+{
+  long i, j = 0;
+  uint64_t prev = 0; /* hash of previous result, it may be overwritten */
+  qsort (outputs, n, sizeof (struct audio_params *), cmphash);
+  for (i = 0; i < n; i++)
+    {
+      struct audio_params *p = *(outputs + i);
+      int same = p->hash && ((i > 0 && prev == p->hash) ||
+                             (i + 1 < n &&
+                              (*(outputs + i + 1))->hash == p->hash));
+      prev = p->hash;
+      if (same) *(outputs + j++) = p;
+    }
+  return j;
+}
+
+static void print_stats (const struct audio_params *p, int max_channels)
+/* Print columns of requested statistics of file `p', `--peaks' column
+   has room for peaks of `max_channels' channels. */
+{
+  int i, n = p->stats && p->channels > max_channels ? p->channels
+    : max_channels; /* rows of a streamed table may be wider */
+  if (op_peaks)
+    {
+      for (i = 0; i < n; i++)
+        {
+          if (p->stats && i < p->channels)
+            printf ("%8f ", stats_peak (p->stats + i));
+          else printf ("         ");
+        }
+    }
+  if (!p->stats)
+    {
+      if (op_rms) printf ("         ");
+      if (op_dc) printf ("          ");
+      if (op_clips) printf ("           ");
+      return;
+    }
+  if (op_rms) printf ("%8f ", stats_rms (p->stats, p->channels, p->frames));
+  if (op_dc) printf ("%9f ", stats_dc (p->stats, p->channels, p->frames));
+  if (op_clips) printf ("%10ld ", stats_clips (p->stats, p->channels));
 }
 
 static char decode_format (int arg)
@@ -358,3 +1332,48 @@ static char *decode_comp (int arg)
     }
   return "unknown";
 }
+
+static long parse_size (const char *arg)
+/* Parse size in bytes, optionally followed by `K' or `M' suffix. Return -1
+   if the argument is malformed. */
+{
+  char *end;
+  long n = strtol (arg, &end, 10);
+  if (end == arg || n < 0 || n > (LONG_MAX >> 20)) return -1;
+  switch (*end)
+    {
+    case 'k' : case 'K' : n <<= 10; end++; break;
+    case 'm' : case 'M' : n <<= 20; end++; break;
+    }
+  return *end ? -1 : n;
+}
+
+static double parse_level (const char *arg)
+/* Parse level relative to full scale, either as a number from 0 to 1 or
+   in decibels with `dB' suffix (e.g. -60dB). Return -1 if the argument is
+   malformed or out of range. */
+{
+  char *end;
+  double x = strtod (arg, &end);
+  if (end == arg) return -1;
+  if (!strcasecmp (end, "db"))
+    {
+      if (x > 0) return -1;
+      x = pow (10, x / 20);
+    }
+  else if (*end) return -1;
+  return x >= 0 && x <= 1 ? x : -1;
+}
+
+static double parse_ratio (const char *arg)
+/* Parse part of a whole, either as a number from 0 to 1 or in percents
+   with `%' suffix (e.g. 5%). Return -1 if the argument is malformed or out
+   of range. */
+{
+  char *end;
+  double x = strtod (arg, &end);
+  if (end == arg) return -1;
+  if (!strcmp (end, "%")) x /= 100;
+  else if (*end) return -1;
+  return x >= 0 && x <= 1 ? x : -1;
+}
@@ -0,0 +1,152 @@
+/*
+ * This file is part of LSA.
+ *
+ * Copyright © 2014–2017 Mark Karpov
+ *
+ * LSA is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * LSA is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "lsa.h"
+
+/* Envelopes of files (`--overview=N'), e.g. for waveform thumbnails. They
+   are built by `analyze_file' during the same pass that finds peaks, here
+   we only write them. Envelopes of all files of a directory are packed
+   into a single archive in that directory.
+
+   The archive starts with a header, followed by a record per file, sorted
+   by name. Every record is followed by base name of the file and then
+   `buckets' buckets, bucket after bucket, every bucket holds minimum,
+   maximum, and RMS level of every channel as floats, normalized so that
+   full scale is 1. Buckets that have no frames (files shorter than
+   `buckets' frames) or couldn't be decoded are zeros. Numbers are stored
+   in native byte order. */
+
+/* structures & constants */
+
+#define OVERVIEW_FILE    ".lsa-overview"
+#define OVERVIEW_MAGIC   "LSAO"
+#define OVERVIEW_VERSION 1
+
+struct overview_header
+{
+  char magic[4];
+  uint32_t version;
+  uint32_t buckets; /* number of buckets per file */
+  uint32_t count; /* number of records */
+};
+
+struct overview_record
+{
+  int64_t frames;
+  uint32_t channels;
+  uint32_t name_len;
+};
+
+/* declarations */
+
+static int write_record (FILE *, const struct audio_params *, float *);
+
+/* functions */
+
+void overview_save (const char *dir, struct audio_params **outputs, long n)
+/* Replace archive of envelopes in directory `dir' (it ends with '/') with
+   envelopes of `n' files in `outputs', files that have `NULL' parameters
+   or no envelope are skipped. Like the cache, the archive is written under
+   temporary name and then renamed. Failure is reported, but it doesn't
+   change exit status, listing is what we are asked for in the first
+   place. */
+{
+  PROFILE_START (t);
+  struct audio_params **v = malloc (sizeof (*v) * (n ? n : 1));
+  long i, count = 0;
+  int max_channels = 0;
+  for (i = 0; i < n; i++)
+    {
+      struct audio_params *p = *(outputs + i);
+      if (!p || !p->overview) continue;
+      *(v + count++) = p;
+      if (p->channels > max_channels) max_channels = p->channels;
+    }
+  sort_by_name (v, count);
+  struct overview_header h;
+  memcpy (h.magic, OVERVIEW_MAGIC, 4);
+  h.version = OVERVIEW_VERSION;
+  h.buckets = overview_buckets;
+  h.count = count;
+  long dir_len = strlen (dir);
+  char *path = malloc (dir_len + sizeof (OVERVIEW_FILE));
+  char *temp = malloc (dir_len + sizeof (OVERVIEW_FILE) + 32);
+  sprintf (path, "%s%s", dir, OVERVIEW_FILE);
+  sprintf (temp, "%s.%ld", path, (long)getpid ());
+  float *row = malloc (sizeof (float) * 3 * (max_channels + 1));
+  FILE *f = fopen (temp, "wb");
+  int ok = f && fwrite (&h, sizeof (h), 1, f) == 1;
+  for (i = 0; ok && i < count; i++)
+    {
+      ok = !write_record (f, *(v + i), row);
+    }
+  if (f && fclose (f)) ok = 0;
+  if (ok) ok = !rename (temp, path);
+  if (!ok)
+    {
+      if (f) unlink (temp);
+      fprintf (stderr, "lsa: cannot write '%s'\n", path);
+    }
+  free (row);
+  free (temp);
+  free (path);
+  free (v);
+  PROFILE_END (t, PH_CACHE, 0);
+}
+
+static int write_record (FILE *f, const struct audio_params *p, float *row)
+/* Write record of file `p' with its envelope into `f', `row' has room for
+   a bucket. Return 0 on success. */
+{
+  struct overview_record r;
+  r.frames = p->frames;
+  r.channels = p->channels;
+  r.name_len = strlen (p->name);
+  if (fwrite (&r, sizeof (r), 1, f) != 1 ||
+      fwrite (p->name, 1, r.name_len, f) != r.name_len)
+    return -1;
+  long b;
+  int ch;
+  for (b = 0; b < overview_buckets; b++)
+    {
+      /* Number of frames in the bucket is found the same way
+         `bucket_range' assigns frames to buckets. */
+      AFframecount from =
+        (b * p->frames + overview_buckets - 1) / overview_buckets;
+      AFframecount to =
+        ((b + 1) * p->frames + overview_buckets - 1) / overview_buckets;
+      for (ch = 0; ch < p->channels; ch++)
+        {
+          const struct channel_stats *s =
+            p->overview + b * p->channels + ch;
+          float *x = row + ch * 3;
+          if (to > from && s->min <= s->max)
+            {
+              *x = s->min;
+              *(x + 1) = s->max;
+              *(x + 2) = sqrt (s->sum2 / (to - from));
+            }
+          else *x = *(x + 1) = *(x + 2) = 0;
+        }
+      if (fwrite (row, sizeof (float) * 3, p->channels, f)
+          != (size_t)p->channels)
+        return -1;
+    }
+  return 0;
+}
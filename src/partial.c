@@ -0,0 +1,414 @@
+/*
+ * This file is part of LSA.
+ *
+ * Copyright © 2014–2017 Mark Karpov
+ *
+ * LSA is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * LSA is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "lsa.h"
+
+/* Runs split between several processes or machines. With `--shard=K/N'
+   only files which names hash to shard K are analyzed, with
+   `--emit-partial=FILE' results are written into a file, and `--merge'
+   reads such files and prints the same tables as a single run would. Names
+   are hashed relative to the listed directory, so shards don't depend on
+   where the directory is mounted. When paths are listed rather than a
+   directory (see list.c), they are hashed and stored as given, and merged
+   results are printed in one table. Totals are always computed by
+   `print_table' from results sorted by name, so they don't depend on how
+   files have been split between shards.
+
+   Partial file starts with a header, followed by path of the listed
+   directory and records. Every record is followed by name of the file
+   relative to the listed directory and, if the record has them,
+   statistics of its channels. Numbers are stored in native byte order. */
+
+/* structures & constants */
+
+#define PARTIAL_MAGIC   "LSAP"
+#define PARTIAL_VERSION 4
+#define PARTIAL_NAME_MAX 4096 /* longest relative name we accept */
+
+enum /* flags of partial files and their records */
+  { PARTIAL_RECURSIVE = 1, /* produced with `-R' */
+    PARTIAL_PEAK = 2, /* peaks have been calculated */
+    PARTIAL_STATS = 4, /* statistics of samples follow the record */
+    PARTIAL_SILENCE = 8, /* silence has been detected */
+    PARTIAL_TRUE_PEAK = 16, /* true peaks have been calculated */
+    PARTIAL_LOUDNESS = 32, /* loudness has been measured */
+    PARTIAL_HASH = 64, /* hashes of samples have been calculated */
+    PARTIAL_SAMPLED = 128 /* peak of the file is a lower bound */ };
+
+struct partial_header
+{
+  char magic[4];
+  uint32_t version;
+  uint32_t flags; /* set of `PARTIAL_*' flags */
+  uint32_t root_len; /* length of path of listed directory */
+  uint64_t count; /* number of records */
+  uint64_t frames; /* total number of frames */
+  double duration; /* total duration in seconds */
+  double kbps_sum; /* sum of bitrates weighted by duration */
+  double peak; /* max peak */
+};
+
+struct partial_record
+{
+  int64_t frames;
+  int64_t lead; /* silent frames at the beginning */
+  int64_t trail; /* silent frames at the end */
+  double kbps;
+  double peak;
+  double true_peak;
+  double loudness;
+  double lra;
+  uint64_t hash;
+  int32_t channels;
+  int32_t compression;
+  int32_t format;
+  int32_t rate;
+  int32_t width;
+  uint32_t name_len;
+  uint32_t flags; /* `PARTIAL_STATS' and `PARTIAL_SAMPLED' */
+};
+
+/* global variables */
+
+static pthread_mutex_t partial_mutex = PTHREAD_MUTEX_INITIALIZER;
+static FILE *partial_file; /* file being written */
+static struct partial_header partial_totals; /* its header */
+static int partial_failed; /* set if writing has failed */
+
+/* declarations */
+
+static int cmp_rel (const void *, const void *);
+static long dir_len (const char *);
+
+/* functions */
+
+int in_shard (const char *dir, const char *name)
+/* Check if file `name' in directory `dir' (relative to the listed
+   directory) belongs to our shard. Names are hashed with FNV-1a. */
+{
+  if (!shard_count) return 1;
+  uint64_t h = 14695981039346656037ULL;
+  const unsigned char *s;
+  for (s = (const unsigned char *)dir; *s; s++)
+    {
+      h = (h ^ *s) * 1099511628211ULL;
+    }
+  for (s = (const unsigned char *)name; *s; s++)
+    {
+      h = (h ^ *s) * 1099511628211ULL;
+    }
+  return (long)(h % shard_count) == shard_index;
+}
+
+int partial_open (const char *path, const char *root, int recursive)
+/* Start writing partial results into file on `path', `root' is the
+   listed directory, empty if paths are listed. If `recursive' is set,
+   results are printed in a table per directory when merged. Return 0 on
+   success. */
+{
+  partial_file = fopen (path, "wb");
+  if (!partial_file) return -1;
+  memcpy (partial_totals.magic, PARTIAL_MAGIC, 4);
+  partial_totals.version = PARTIAL_VERSION;
+  partial_totals.flags = (recursive ? PARTIAL_RECURSIVE : 0) |
+    (op_peak ? PARTIAL_PEAK : 0) | (op_stats ? PARTIAL_STATS : 0) |
+    (op_silence ? PARTIAL_SILENCE : 0) |
+    (op_true_peak ? PARTIAL_TRUE_PEAK : 0) |
+    (op_loudness ? PARTIAL_LOUDNESS : 0) | (op_hash ? PARTIAL_HASH : 0);
+  partial_totals.root_len = strlen (root);
+  /* The header is written again with final totals by `partial_close'. */
+  if (fwrite (&partial_totals, sizeof (partial_totals), 1, partial_file) != 1
+      || fwrite (root, 1, partial_totals.root_len, partial_file)
+      != partial_totals.root_len)
+    partial_failed = 1;
+  return 0;
+}
+
+void partial_add (const char *dir, struct audio_params **outputs, long total)
+/* Write `total' results of files in directory `dir' (relative to the
+   listed directory, empty or ending with '/') from `outputs', elements
+   that are `NULL' are skipped. This may be called from several threads. */
+{
+  if (!partial_file) return;
+  long dir_n = strlen (dir), i;
+  pthread_mutex_lock (&partial_mutex);
+  for (i = 0; i < total; i++)
+    {
+      struct audio_params *p = *(outputs + i);
+      if (!p) continue;
+      size_t name_n = strlen (p->name);
+      struct partial_record r;
+      memset (&r, 0, sizeof (r));
+      r.frames = p->frames;
+      r.lead = p->lead;
+      r.trail = p->trail;
+      r.kbps = p->kbps;
+      r.peak = p->peak;
+      r.true_peak = p->true_peak;
+      r.loudness = p->loudness;
+      r.lra = p->lra;
+      r.hash = p->hash;
+      r.channels = p->channels;
+      r.compression = p->compression;
+      r.format = p->format;
+      r.rate = p->rate;
+      r.width = p->width;
+      r.name_len = dir_n + name_n;
+      r.flags = (p->stats ? PARTIAL_STATS : 0) |
+        (p->sampled ? PARTIAL_SAMPLED : 0);
+      if (fwrite (&r, sizeof (r), 1, partial_file) != 1 ||
+          fwrite (dir, 1, dir_n, partial_file) != (size_t)dir_n ||
+          fwrite (p->name, 1, name_n, partial_file) != name_n ||
+          (p->stats && fwrite (p->stats, sizeof (struct channel_stats),
+                               p->channels, partial_file)
+           != (size_t)p->channels))
+        partial_failed = 1;
+      partial_totals.count++;
+      partial_totals.frames += p->frames;
+      partial_totals.duration += p->duration;
+      partial_totals.kbps_sum += p->kbps * p->duration;
+      if (p->peak > partial_totals.peak) partial_totals.peak = p->peak;
+    }
+  pthread_mutex_unlock (&partial_mutex);
+}
+
+int partial_close (void)
+/* Finish writing partial results. Return 0 on success. */
+{
+  if (!partial_file) return 0;
+  if (fseek (partial_file, 0, SEEK_SET) ||
+      fwrite (&partial_totals, sizeof (partial_totals), 1, partial_file) != 1)
+    partial_failed = 1;
+  if (fclose (partial_file)) partial_failed = 1;
+  partial_file = NULL;
+  return partial_failed ? -1 : 0;
+}
+
+int merge_partials (char **files, long n)
+/* Read partial results from `n' `files' and print them like a single run
+   over all shards would. Return exit status. */
+{
+  struct audio_params **outputs = NULL;
+  struct arena arena = { NULL, 0 }; /* results and their names */
+  long total = 0, size = 0, i;
+  uint32_t flags = 0;
+  char *root = NULL;
+  int status = EXIT_SUCCESS;
+  if (!n)
+    {
+      fprintf (stderr, "lsa: no partial results to merge\n");
+      return EXIT_FAILURE;
+    }
+  for (i = 0; i < n && status == EXIT_SUCCESS; i++)
+    {
+      FILE *f = fopen (*(files + i), "rb");
+      struct partial_header h;
+      if (!f || fread (&h, sizeof (h), 1, f) != 1 ||
+          memcmp (h.magic, PARTIAL_MAGIC, 4) ||
+          h.version != PARTIAL_VERSION || h.root_len > PARTIAL_NAME_MAX)
+        {
+          fprintf (stderr, "lsa: '%s' is not a partial result\n",
+                   *(files + i));
+          status = EXIT_FAILURE;
+          if (f) fclose (f);
+          break;
+        }
+      int damaged = 0;
+      char *r = malloc (h.root_len + 1);
+      if (fread (r, 1, h.root_len, f) != h.root_len) damaged = 1;
+      *(r + h.root_len) = '\0';
+      if (!root)
+        {
+          root = r;
+          flags = h.flags;
+        }
+      else
+        {
+          if ((h.flags & PARTIAL_RECURSIVE) != (flags & PARTIAL_RECURSIVE))
+            {
+              fprintf (stderr, "lsa: '%s' doesn't match other partial "
+                       "results\n", *(files + i));
+              status = EXIT_FAILURE;
+            }
+          flags &= h.flags;
+          free (r);
+        }
+      uint64_t k;
+      for (k = 0; k < h.count && !damaged && status == EXIT_SUCCESS; k++)
+        {
+          struct partial_record rec;
+          if (fread (&rec, sizeof (rec), 1, f) != 1 ||
+              rec.name_len > PARTIAL_NAME_MAX || rec.channels < 1 ||
+              rec.channels > 65536)
+            {
+              damaged = 1;
+              break;
+            }
+          struct audio_params *p = arena_alloc (&arena, sizeof (*p));
+          char *name = arena_alloc (&arena, rec.name_len + 1);
+          p->stats = NULL;
+          p->overview = NULL;
+          if (fread (name, 1, rec.name_len, f) != rec.name_len) damaged = 1;
+          *(name + rec.name_len) = '\0';
+          if (rec.flags & PARTIAL_STATS)
+            {
+              p->stats = malloc (sizeof (struct channel_stats) *
+                                 rec.channels);
+              if (fread (p->stats, sizeof (struct channel_stats),
+                         rec.channels, f) != (size_t)rec.channels)
+                damaged = 1;
+            }
+          else if (op_stats) p->stats = stats_alloc (rec.channels);
+          p->name = name;
+          p->frames = rec.frames;
+          p->lead = rec.lead;
+          p->trail = rec.trail;
+          p->kbps = rec.kbps;
+          p->peak = rec.peak;
+          p->true_peak = rec.true_peak;
+          p->loudness = rec.loudness;
+          p->lra = rec.lra;
+          p->hash = rec.hash;
+          p->sampled = !!(rec.flags & PARTIAL_SAMPLED);
+          p->channels = rec.channels;
+          p->compression = rec.compression;
+          p->format = rec.format;
+          p->rate = rec.rate;
+          p->width = rec.width;
+          p->duration = (double)p->frames / p->rate;
+          if (total == size)
+            {
+              size = size ? size * 2 : 256;
+              outputs = realloc (outputs, sizeof (*outputs) * size);
+            }
+          *(outputs + total++) = p;
+        }
+      if (damaged)
+        {
+          fprintf (stderr, "lsa: '%s' is damaged\n", *(files + i));
+          status = EXIT_FAILURE;
+        }
+      fclose (f);
+    }
+  if (status == EXIT_SUCCESS && op_peak && !(flags & PARTIAL_PEAK))
+    {
+      fprintf (stderr, "lsa: peaks have not been calculated\n");
+      status = EXIT_FAILURE;
+    }
+  if (status == EXIT_SUCCESS && op_stats && !(flags & PARTIAL_STATS))
+    {
+      fprintf (stderr, "lsa: statistics have not been calculated\n");
+      status = EXIT_FAILURE;
+    }
+  if (status == EXIT_SUCCESS && op_silence && !(flags & PARTIAL_SILENCE))
+    {
+      fprintf (stderr, "lsa: silence has not been detected\n");
+      status = EXIT_FAILURE;
+    }
+  if (status == EXIT_SUCCESS && op_true_peak && !(flags & PARTIAL_TRUE_PEAK))
+    {
+      fprintf (stderr, "lsa: true peaks have not been calculated\n");
+      status = EXIT_FAILURE;
+    }
+  if (status == EXIT_SUCCESS && op_loudness && !(flags & PARTIAL_LOUDNESS))
+    {
+      fprintf (stderr, "lsa: loudness has not been measured\n");
+      status = EXIT_FAILURE;
+    }
+  if (status == EXIT_SUCCESS && op_hash && !(flags & PARTIAL_HASH))
+    {
+      fprintf (stderr, "lsa: hashes have not been calculated\n");
+      status = EXIT_FAILURE;
+    }
+  /* Group files by directory, then print a table per directory like
+     `-R' does, or just one table. */
+  if (flags & PARTIAL_RECURSIVE)
+    qsort (outputs, total, sizeof (*outputs), cmp_rel);
+  else sort_by_name (outputs, total);
+  char **names = malloc (sizeof (char *) * (total ? total : 1));
+  long start, j;
+  for (i = 0; i < total; i++)
+    {
+      *(names + i) = (char *)(*(outputs + i))->name;
+    }
+  for (start = 0; status == EXIT_SUCCESS && start < total; start = i)
+    {
+      long d = flags & PARTIAL_RECURSIVE ? dir_len (*(names + start)) : 0;
+      for (i = start; i < total; i++)
+        {
+          if ((flags & PARTIAL_RECURSIVE) &&
+              (dir_len (*(names + i)) != d ||
+               strncmp (*(names + i), *(names + start), d)))
+            break;
+          (*(outputs + i))->name = *(names + i) + d;
+        }
+      /* The same file may come from more than one partial result. */
+      for (j = start + 1; j < i; j++)
+        {
+          if (*(outputs + j) && !strcmp (*(names + j), *(names + j - 1)))
+            {
+              fprintf (stderr, "lsa: '%s' is found more than once\n",
+                       *(names + j));
+              free ((*(outputs + j))->stats);
+              *(outputs + j) = NULL;
+            }
+        }
+      if (flags & PARTIAL_RECURSIVE)
+        {
+          long root_len = strlen (root);
+          if (start) printf ("\n");
+          if (!d && root_len > 1 && *(root + root_len - 1) == '/')
+            root_len--;
+          printf ("%.*s%.*s:\n", (int)root_len, root,
+                  d > 1 ? (int)d - 1 : 0, *(names + start));
+        }
+      print_table (outputs + start, i - start);
+    }
+  /* Results and their names are freed with the arena. */
+  for (i = 0; i < total; i++)
+    {
+      if (*(outputs + i)) free ((*(outputs + i))->stats);
+    }
+  arena_free (&arena);
+  free (names);
+  free (outputs);
+  free (root);
+  return status;
+}
+
+static int cmp_rel (const void *a, const void *b)
+/* Order results by directory part of their relative names first, then by
+   base names, so files of every directory go together. */
+{
+  const char *x = (*(struct audio_params **)a)->name;
+  const char *y = (*(struct audio_params **)b)->name;
+  long dx = dir_len (x), dy = dir_len (y);
+  int c = strncmp (x, y, dx < dy ? dx : dy);
+  if (c) return c;
+  if (dx != dy) return dx < dy ? -1 : 1;
+  return strcmp (x + dx, y + dy);
+}
+
+static long dir_len (const char *name)
+/* Return length of directory part of relative `name' including the final
+   '/', or 0 if there's none. */
+{
+  const char *s = strrchr (name, '/');
+  return s ? s - name + 1 : 0;
+}
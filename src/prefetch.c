@@ -0,0 +1,173 @@
+/*
+ * This file is part of LSA.
+ *
+ * Copyright © 2014–2017 Mark Karpov
+ *
+ * LSA is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * LSA is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE /* readahead */
+
+#include "lsa.h"
+
+/* Read-ahead (`--read-ahead'). A separate pool of `io_threads' threads
+   reads files into the page cache a few files ahead of worker threads, so
+   workers find data in memory and don't wait for the disk. Every I/O
+   thread reads one file at a time with `readahead', which returns once
+   the data is read, so number of I/O threads is the number of requests
+   the disk sees at once, no matter how many workers there are. Where
+   `readahead' is not supported, `posix_fadvise' is used instead, it only
+   starts reading. I/O threads never get further than `read_ahead' files
+   ahead of the index workers take files from. */
+
+/* global variables */
+
+static pthread_mutex_t ra_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ra_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t *ra_tidv; /* I/O threads */
+static int ra_dfd; /* directory names of items are relative to */
+static void **ra_items; /* vector of items to read */
+static long ra_total; /* number of items */
+static size_t ra_name_offset; /* offset of name in every item */
+static long *ra_index; /* index of next item workers take, it's accessed
+                          atomically */
+static long ra_next; /* index of next item to read */
+static struct cache *ra_cache; /* cached files are not read */
+static int ra_stop; /* set when workers are done */
+
+/* declarations */
+
+static void *read_thread (void *);
+static void read_file (const char *);
+
+/* functions */
+
+void prefetch_start (const char *dir,
+                     void **v,
+                     long total,
+                     size_t name_offset,
+                     long *index,
+                     struct cache *c)
+/* Start reading ahead files from vector `v' of `total' items which names
+   (relative to `dir') are found `name_offset' bytes into every item.
+   Workers take items at `*index', cache `c' (may be `NULL') tells which
+   files don't need to be read. Nothing is done if `read_ahead' is 0. */
+{
+  if (!read_ahead || !total) return;
+  ra_dfd = open (dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (ra_dfd < 0) return;
+  ra_items = v;
+  ra_total = total;
+  ra_name_offset = name_offset;
+  ra_index = index;
+  ra_next = 0;
+  ra_cache = c;
+  ra_stop = 0;
+  ra_tidv = malloc (sizeof (pthread_t) * io_threads);
+  long i;
+  for (i = 0; i < io_threads; i++)
+    {
+      pthread_create (ra_tidv + i, NULL, read_thread, NULL);
+    }
+}
+
+void prefetch_wake (void)
+/* Let I/O threads know that workers have taken more items. */
+{
+  if (!ra_tidv) return;
+  pthread_mutex_lock (&ra_mutex);
+  pthread_cond_broadcast (&ra_cond);
+  pthread_mutex_unlock (&ra_mutex);
+}
+
+void prefetch_stop (void)
+/* Stop I/O threads and wait for them to finish. */
+{
+  if (!ra_tidv) return;
+  pthread_mutex_lock (&ra_mutex);
+  ra_stop = 1;
+  pthread_cond_broadcast (&ra_cond);
+  pthread_mutex_unlock (&ra_mutex);
+  long i;
+  for (i = 0; i < io_threads; i++)
+    {
+      pthread_join (*(ra_tidv + i), NULL);
+    }
+  free (ra_tidv);
+  ra_tidv = NULL;
+  close (ra_dfd);
+}
+
+static void *read_thread (void *arg)
+/* This function describes behavior of an individual I/O thread. It takes
+   the next item as long as it's not too far ahead of workers, and sleeps
+   otherwise. Items workers have already taken are skipped. */
+{
+  if (op_timings) profile_io_thread ();
+  pthread_mutex_lock (&ra_mutex);
+  while (!ra_stop && ra_next < ra_total)
+    {
+      long taken = __atomic_load_n (ra_index, __ATOMIC_RELAXED);
+      if (ra_next < taken) ra_next = taken;
+      if (ra_next >= ra_total) break;
+      if (ra_next >= taken + read_ahead)
+        {
+          pthread_cond_wait (&ra_cond, &ra_mutex);
+          continue;
+        }
+      long i = ra_next++;
+      pthread_mutex_unlock (&ra_mutex);
+      read_file ((const char *)*(ra_items + i) + ra_name_offset);
+      pthread_mutex_lock (&ra_mutex);
+    }
+  pthread_mutex_unlock (&ra_mutex);
+  return NULL;
+}
+
+static void read_file (const char *name)
+/* Read file `name' into the page cache unless its results are cached.
+   Only the first `LSA_SPLIT_SIZE' bytes are read, bigger files are split
+   into chunks and read by several threads anyway. When nothing is going
+   to be decoded (or peaks are sampled, so only scattered blocks are
+   read), only beginning of the file with its header is read. */
+{
+  PROFILE_START (t);
+  int fd = openat (ra_dfd, name, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) return;
+  struct stat sb;
+  if (fstat (fd, &sb))
+    {
+      close (fd);
+      return;
+    }
+  if (ra_cache)
+    {
+      struct cache_key k;
+      struct audio_params p;
+      cache_key (&sb, &k);
+      if (!cache_lookup (ra_cache, &k, &p))
+        {
+          close (fd);
+          return;
+        }
+    }
+  size_t n = (op_peak && !peak_sample) || op_stats || overview_buckets ||
+    op_true_peak || op_loudness || op_hash ? LSA_SPLIT_SIZE
+    : LSA_HEADER_READ;
+  if ((size_t)sb.st_size < n) n = sb.st_size;
+  if (readahead (fd, 0, n))
+    posix_fadvise (fd, 0, n, POSIX_FADV_WILLNEED);
+  close (fd);
+  PROFILE_END (t, PH_READ, n);
+}
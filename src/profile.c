@@ -0,0 +1,188 @@
+/*
+ * This file is part of LSA.
+ *
+ * Copyright © 2014–2017 Mark Karpov
+ *
+ * LSA is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * LSA is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "lsa.h"
+
+/* Timing of phases of work for `--timings'. Every thread has its own slot
+   with time spent in every phase, so recording doesn't need any locks.
+   Worker threads of every pool take slots 0 to `workers' - 1 (there
+   are never more of them at once), I/O threads (see prefetch.c) take the
+   following ones, and the main thread takes the last one.
+   When `op_timings' is not set, hooks (see `PROFILE_START' and
+   `PROFILE_END' in lsa.h) don't even read the clock, hooks of the library
+   test `timings' of its context instead, so liblsa doesn't depend on
+   options of the program. */
+
+/* structures */
+
+struct profile /* timings of one thread */
+{
+  double time[PH_TOTAL]; /* seconds spent in every phase */
+  uint64_t bytes[PH_TOTAL]; /* bytes processed in every phase */
+  long calls[PH_TOTAL]; /* how many times every phase has been entered */
+  double busy; /* seconds spent on files */
+  long files; /* number of files (or chunks) processed */
+};
+
+/* global variables */
+
+static struct profile *slots; /* `workers' + `extra_slots' + 1 slots */
+static long workers; /* number of slots for worker threads */
+static long extra_slots; /* number of slots for I/O threads */
+static __thread struct profile *slot; /* slot of the current thread */
+static long next_slot, next_extra_slot; /* accessed atomically */
+static double start_time; /* when `profile_init' has been called */
+static double pool_time; /* total wall time of thread pools */
+
+static const char *phase_names[PH_TOTAL] =
+  { [PH_SCAN]   = "scan",
+    [PH_OPEN]   = "open",
+    [PH_READ]   = "read",
+    [PH_DECODE] = "decode",
+    [PH_KERNEL] = "kernel",
+    [PH_MAPPED] = "mapped",
+    [PH_CACHE]  = "cache",
+    [PH_PRINT]  = "print" };
+
+/* functions */
+
+double profile_now (void)
+/* Return monotonic time in seconds. */
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+void profile_init (long threads, long extra)
+/* Allocate slots for `threads' worker threads and `extra' I/O threads. */
+{
+  workers = threads;
+  extra_slots = extra;
+  slots = calloc (threads + extra + 1, sizeof (struct profile));
+  slot = slots + threads + extra;
+  start_time = profile_now ();
+}
+
+void profile_thread (void)
+/* Take a slot for the calling worker thread. */
+{
+  long i = __atomic_fetch_add (&next_slot, 1, __ATOMIC_RELAXED);
+  slot = slots + i % workers;
+}
+
+void profile_io_thread (void)
+/* Take a slot for the calling I/O thread. */
+{
+  long i = __atomic_fetch_add (&next_extra_slot, 1, __ATOMIC_RELAXED);
+  slot = slots + workers + i % extra_slots;
+}
+
+void profile_add (int phase, double start, uint64_t bytes)
+/* Record that calling thread has spent time since `start' in `phase'
+   processing `bytes' bytes. */
+{
+  slot->time[phase] += profile_now () - start;
+  slot->bytes[phase] += bytes;
+  slot->calls[phase]++;
+}
+
+void profile_busy (double start, long files)
+/* Record that calling thread has spent time since `start' processing
+   `files' files. */
+{
+  slot->busy += profile_now () - start;
+  slot->files += files;
+}
+
+void profile_pool (double start)
+/* Record that a pool of worker threads has been running since `start',
+   this is called by the main thread after the pool is joined. */
+{
+  pool_time += profile_now () - start;
+}
+
+void profile_report (const char *json)
+/* Print report to `stderr', and if `json' is not `NULL', write the same
+   report as JSON into file on this path. */
+{
+  double wall = profile_now () - start_time;
+  double time[PH_TOTAL] = { 0 };
+  uint64_t bytes[PH_TOTAL] = { 0 };
+  long calls[PH_TOTAL] = { 0 }, files = 0, i;
+  int p;
+  for (i = 0; i <= workers + extra_slots; i++)
+    {
+      struct profile *s = slots + i;
+      for (p = 0; p < PH_TOTAL; p++)
+        {
+          time[p] += s->time[p];
+          bytes[p] += s->bytes[p];
+          calls[p] += s->calls[p];
+        }
+      files += s->files;
+    }
+  fprintf (stderr, "\nphase     calls  time, s         MB      MB/s\n");
+  for (p = 0; p < PH_TOTAL; p++)
+    {
+      fprintf (stderr, "%-6s %8ld %8.3f", phase_names[p], calls[p], time[p]);
+      if (bytes[p])
+        fprintf (stderr, " %10.1f %9.1f", bytes[p] / 1e6,
+                 time[p] > 0 ? bytes[p] / 1e6 / time[p] : 0);
+      fprintf (stderr, "\n");
+    }
+  fprintf (stderr, "\nthread  busy, s  idle, s    files\n");
+  for (i = 0; i < workers; i++)
+    {
+      struct profile *s = slots + i;
+      double idle = pool_time - s->busy;
+      fprintf (stderr, "%6ld %8.3f %8.3f %8ld\n", i, s->busy,
+               idle > 0 ? idle : 0, s->files);
+    }
+  fprintf (stderr,
+           "\nwall %.3f s, %ld files, %.1f files/s, %.1f MB decoded\n",
+           wall, files, wall > 0 ? files / wall : 0,
+           (bytes[PH_DECODE] + bytes[PH_MAPPED]) / 1e6);
+  if (!json) return;
+  FILE *f = fopen (json, "w");
+  if (!f)
+    {
+      fprintf (stderr, "lsa: cannot write '%s'\n", json);
+      return;
+    }
+  fprintf (f, "{\n  \"wall\": %.6f,\n  \"files\": %ld,\n  \"phases\": {\n",
+           wall, files);
+  for (p = 0; p < PH_TOTAL; p++)
+    {
+      fprintf (f, "    \"%s\": { \"calls\": %ld, \"time\": %.6f, "
+               "\"bytes\": %llu }%s\n", phase_names[p], calls[p], time[p],
+               (unsigned long long)bytes[p], p < PH_TOTAL - 1 ? "," : "");
+    }
+  fprintf (f, "  },\n  \"threads\": [\n");
+  for (i = 0; i < workers; i++)
+    {
+      struct profile *s = slots + i;
+      double idle = pool_time - s->busy;
+      fprintf (f, "    { \"busy\": %.6f, \"idle\": %.6f, "
+               "\"files\": %ld }%s\n", s->busy, idle > 0 ? idle : 0, s->files,
+               i < workers - 1 ? "," : "");
+    }
+  fprintf (f, "  ]\n}\n");
+  fclose (f);
+}
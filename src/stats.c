@@ -0,0 +1,533 @@
+/*
+ * This file is part of LSA.
+ *
+ * Copyright © 2014–2017 Mark Karpov
+ *
+ * LSA is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * LSA is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "lsa.h"
+
+/* Statistics kernels take `n' interleaved frames of `channels' channels
+   and fold them into per-channel `struct channel_stats': minimum, maximum,
+   sum and sum of squares of samples, and number of samples at full scale.
+   Everything is calculated in one pass, so all statistics share a single
+   read of every block. Samples are converted to normalized floats in
+   registers: (raw - offset) * inv, see `stats_format'.
+
+   Vector kernels load `lanes' samples at a time. A row of `channels'
+   vectors holds exactly `lanes' frames, so every lane of every vector in
+   the row always gets samples of the same channel and we can keep
+   separate accumulators per vector without shuffling anything. Lanes are
+   folded into channels only once per kernel call. Sums are accumulated in
+   single precision for at most `STATS_ROWS' rows and then added to double
+   precision sums, so long blocks don't lose precision. Files with more
+   than `STATS_MAX_CHANNELS' channels and tails shorter than a row are
+   processed with scalar code. */
+
+#define STATS_ROWS 1024
+
+/* global variables */
+
+stats_kernel stats_kernels[K_STATS]; /* kernels selected by
+                                        `select_kernels' */
+
+/* kernel templates */
+
+/* `conv' turns single raw sample into float exactly like vector loads do,
+   so scalar tails give the same values as vector code. */
+
+#define PLAIN(x) ((float)(x))
+#define FLIP32(x) ((float)(int32_t)((x) ^ 0x80000000u))
+
+#define SCALAR_STATS(name, type, conv)                                  \
+  static void name (const void *frames,                                 \
+                    AFframecount n,                                     \
+                    int channels,                                       \
+                    const struct sample_scale *sc,                      \
+                    struct channel_stats *st)                           \
+  {                                                                     \
+    AFframecount c = n * channels;                                      \
+    register AFframecount i;                                            \
+    int ch = 0;                                                         \
+    for (i = 0; i < c; i++)                                             \
+      {                                                                 \
+        float x = (conv (load_sample (type, frames, i)) - sc->offset)   \
+          * sc->inv;                                                    \
+        struct channel_stats *s = st + ch;                              \
+        if (x < s->min) s->min = x;                                     \
+        if (x > s->max) s->max = x;                                     \
+        s->sum += x;                                                    \
+        s->sum2 += (double)x * x;                                       \
+        if (x >= sc->clip || x <= -1) s->clips++;                       \
+        if (++ch == channels) ch = 0;                                   \
+      }                                                                 \
+  }
+
+/* `p' is prefix of intrinsics of the instruction set, `load' converts
+   `lanes' samples to vector of floats, `cmpge' and `cmple' return masks
+   of lanes, `cast' turns a mask into integer vector, so it can be
+   subtracted from counters of clipped samples. */
+
+#define VECTOR_STATS(name, isa, type, p, vec, ivec, lanes, load, cmpge,  \
+                     cmple, cast, scalar)                               \
+  __attribute__ ((target (isa)))                                        \
+  static void name (const void *frames,                                 \
+                    AFframecount n,                                     \
+                    int channels,                                       \
+                    const struct sample_scale *sc,                      \
+                    struct channel_stats *st)                           \
+  {                                                                     \
+    if (channels > STATS_MAX_CHANNELS)                                  \
+      {                                                                 \
+        scalar (frames, n, channels, sc, st);                           \
+        return;                                                         \
+      }                                                                 \
+    const type *src = frames;                                           \
+    AFframecount rows = n / lanes, r, end;                              \
+    vec off = p##_set1_ps (sc->offset), inv = p##_set1_ps (sc->inv);    \
+    vec hi = p##_set1_ps (sc->clip), lo = p##_set1_ps (-1);             \
+    vec mn[STATS_MAX_CHANNELS], mx[STATS_MAX_CHANNELS];                 \
+    vec s1[STATS_MAX_CHANNELS], s2[STATS_MAX_CHANNELS];                 \
+    ivec cl[STATS_MAX_CHANNELS];                                        \
+    double d1[STATS_MAX_CHANNELS * lanes] = { 0 };                      \
+    double d2[STATS_MAX_CHANNELS * lanes] = { 0 };                      \
+    AFframecount dc[STATS_MAX_CHANNELS * lanes] = { 0 };                \
+    int a, j;                                                           \
+    for (a = 0; a < channels; a++)                                      \
+      {                                                                 \
+        mn[a] = p##_set1_ps (INFINITY);                                 \
+        mx[a] = p##_set1_ps (-INFINITY);                                \
+      }                                                                 \
+    for (r = 0; r < rows; r = end)                                      \
+      {                                                                 \
+        end = rows - r < STATS_ROWS ? rows : r + STATS_ROWS;            \
+        for (a = 0; a < channels; a++)                                  \
+          {                                                             \
+            s1[a] = p##_setzero_ps ();                                  \
+            s2[a] = p##_setzero_ps ();                                  \
+            cl[a] = cast (p##_setzero_ps ());                           \
+          }                                                             \
+        AFframecount i;                                                 \
+        for (i = r; i < end; i++)                                       \
+          {                                                             \
+            for (a = 0; a < channels; a++, src += lanes)                \
+              {                                                         \
+                vec x = p##_mul_ps (p##_sub_ps (load ((const void *)src), \
+                                                off), inv);             \
+                mn[a] = p##_min_ps (mn[a], x);                          \
+                mx[a] = p##_max_ps (mx[a], x);                          \
+                s1[a] = p##_add_ps (s1[a], x);                          \
+                s2[a] = p##_add_ps (s2[a], p##_mul_ps (x, x));          \
+                cl[a] = p##_sub_epi32 (cl[a],                           \
+                                       cast (p##_or_ps (cmpge (x, hi),  \
+                                                        cmple (x, lo)))); \
+              }                                                         \
+          }                                                             \
+        for (a = 0; a < channels; a++)                                  \
+          {                                                             \
+            union { vec m; float n[lanes]; } u1, u2;                    \
+            union { ivec m; int32_t n[lanes]; } uc;                     \
+            u1.m = s1[a];                                               \
+            u2.m = s2[a];                                               \
+            uc.m = cl[a];                                               \
+            for (j = 0; j < lanes; j++)                                 \
+              {                                                         \
+                *(d1 + a * lanes + j) += *(u1.n + j);                   \
+                *(d2 + a * lanes + j) += *(u2.n + j);                   \
+                *(dc + a * lanes + j) += *(uc.n + j);                   \
+              }                                                         \
+          }                                                             \
+      }                                                                 \
+    for (a = 0; a < channels; a++)                                      \
+      {                                                                 \
+        union { vec m; float n[lanes]; } un, ux;                        \
+        un.m = mn[a];                                                   \
+        ux.m = mx[a];                                                   \
+        for (j = 0; j < lanes; j++)                                     \
+          {                                                             \
+            struct channel_stats *s = st + (a * lanes + j) % channels;  \
+            if (*(un.n + j) < s->min) s->min = *(un.n + j);             \
+            if (*(ux.n + j) > s->max) s->max = *(ux.n + j);             \
+            s->sum += *(d1 + a * lanes + j);                            \
+            s->sum2 += *(d2 + a * lanes + j);                           \
+            s->clips += *(dc + a * lanes + j);                          \
+          }                                                             \
+      }                                                                 \
+    scalar ((const type *)frames + rows * lanes * channels,             \
+            n - rows * lanes, channels, sc, st);                        \
+  }
+
+/* loaders for SSE4.1 */
+
+__attribute__ ((target ("sse4.1")))
+static inline __m128 load_int8_sse41 (const void *src)
+{
+  int32_t v;
+  memcpy (&v, src, sizeof (v));
+  return _mm_cvtepi32_ps (_mm_cvtepi8_epi32 (_mm_cvtsi32_si128 (v)));
+}
+
+__attribute__ ((target ("sse4.1")))
+static inline __m128 load_uint8_sse41 (const void *src)
+{
+  int32_t v;
+  memcpy (&v, src, sizeof (v));
+  return _mm_cvtepi32_ps (_mm_cvtepu8_epi32 (_mm_cvtsi32_si128 (v)));
+}
+
+__attribute__ ((target ("sse4.1")))
+static inline __m128 load_int16_sse41 (const void *src)
+{
+  return _mm_cvtepi32_ps
+    (_mm_cvtepi16_epi32 (_mm_loadl_epi64 ((const __m128i *)src)));
+}
+
+__attribute__ ((target ("sse4.1")))
+static inline __m128 load_uint16_sse41 (const void *src)
+{
+  return _mm_cvtepi32_ps
+    (_mm_cvtepu16_epi32 (_mm_loadl_epi64 ((const __m128i *)src)));
+}
+
+__attribute__ ((target ("sse4.1")))
+static inline __m128 load_int32_sse41 (const void *src)
+{
+  return _mm_cvtepi32_ps (_mm_loadu_si128 ((const __m128i *)src));
+}
+
+__attribute__ ((target ("sse4.1")))
+static inline __m128 load_uint32_sse41 (const void *src)
+{
+  return _mm_cvtepi32_ps
+    (_mm_xor_si128 (_mm_loadu_si128 ((const __m128i *)src),
+                    _mm_set1_epi32 (INT32_MIN)));
+}
+
+__attribute__ ((target ("sse4.1")))
+static inline __m128 load_float_sse41 (const void *src)
+{
+  return _mm_loadu_ps ((const float *)src);
+}
+
+__attribute__ ((target ("sse4.1")))
+static inline __m128 load_double_sse41 (const void *src)
+{
+  const double *d = src;
+  return _mm_movelh_ps (_mm_cvtpd_ps (_mm_loadu_pd (d)),
+                        _mm_cvtpd_ps (_mm_loadu_pd (d + 2)));
+}
+
+/* loaders for AVX2 */
+
+__attribute__ ((target ("avx2")))
+static inline __m256 load_int8_avx2 (const void *src)
+{
+  return _mm256_cvtepi32_ps
+    (_mm256_cvtepi8_epi32 (_mm_loadl_epi64 ((const __m128i *)src)));
+}
+
+__attribute__ ((target ("avx2")))
+static inline __m256 load_uint8_avx2 (const void *src)
+{
+  return _mm256_cvtepi32_ps
+    (_mm256_cvtepu8_epi32 (_mm_loadl_epi64 ((const __m128i *)src)));
+}
+
+__attribute__ ((target ("avx2")))
+static inline __m256 load_int16_avx2 (const void *src)
+{
+  return _mm256_cvtepi32_ps
+    (_mm256_cvtepi16_epi32 (_mm_loadu_si128 ((const __m128i *)src)));
+}
+
+__attribute__ ((target ("avx2")))
+static inline __m256 load_uint16_avx2 (const void *src)
+{
+  return _mm256_cvtepi32_ps
+    (_mm256_cvtepu16_epi32 (_mm_loadu_si128 ((const __m128i *)src)));
+}
+
+__attribute__ ((target ("avx2")))
+static inline __m256 load_int32_avx2 (const void *src)
+{
+  return _mm256_cvtepi32_ps (_mm256_loadu_si256 ((const __m256i *)src));
+}
+
+__attribute__ ((target ("avx2")))
+static inline __m256 load_uint32_avx2 (const void *src)
+{
+  return _mm256_cvtepi32_ps
+    (_mm256_xor_si256 (_mm256_loadu_si256 ((const __m256i *)src),
+                       _mm256_set1_epi32 (INT32_MIN)));
+}
+
+__attribute__ ((target ("avx2")))
+static inline __m256 load_float_avx2 (const void *src)
+{
+  return _mm256_loadu_ps ((const float *)src);
+}
+
+__attribute__ ((target ("avx2")))
+static inline __m256 load_double_avx2 (const void *src)
+{
+  const double *d = src;
+  return _mm256_set_m128 (_mm256_cvtpd_ps (_mm256_loadu_pd (d + 4)),
+                          _mm256_cvtpd_ps (_mm256_loadu_pd (d)));
+}
+
+/* comparisons */
+
+__attribute__ ((target ("sse4.1")))
+static inline __m128 cmpge_sse41 (__m128 a, __m128 b)
+{
+  return _mm_cmpge_ps (a, b);
+}
+
+__attribute__ ((target ("sse4.1")))
+static inline __m128 cmple_sse41 (__m128 a, __m128 b)
+{
+  return _mm_cmple_ps (a, b);
+}
+
+__attribute__ ((target ("avx2")))
+static inline __m256 cmpge_avx2 (__m256 a, __m256 b)
+{
+  return _mm256_cmp_ps (a, b, _CMP_GE_OQ);
+}
+
+__attribute__ ((target ("avx2")))
+static inline __m256 cmple_avx2 (__m256 a, __m256 b)
+{
+  return _mm256_cmp_ps (a, b, _CMP_LE_OQ);
+}
+
+/* kernels */
+
+SCALAR_STATS (stats_int32_scalar, int32_t, PLAIN)
+SCALAR_STATS (stats_int16_scalar, int16_t, PLAIN)
+SCALAR_STATS (stats_int8_scalar, int8_t, PLAIN)
+SCALAR_STATS (stats_uint32_scalar, uint32_t, FLIP32)
+SCALAR_STATS (stats_uint16_scalar, uint16_t, PLAIN)
+SCALAR_STATS (stats_uint8_scalar, uint8_t, PLAIN)
+SCALAR_STATS (stats_float_scalar, float, PLAIN)
+SCALAR_STATS (stats_double_scalar, double, PLAIN)
+
+VECTOR_STATS (stats_int32_sse41, "sse4.1", int32_t, _mm, __m128, __m128i,
+              4, load_int32_sse41, cmpge_sse41, cmple_sse41,
+              _mm_castps_si128, stats_int32_scalar)
+VECTOR_STATS (stats_int16_sse41, "sse4.1", int16_t, _mm, __m128, __m128i,
+              4, load_int16_sse41, cmpge_sse41, cmple_sse41,
+              _mm_castps_si128, stats_int16_scalar)
+VECTOR_STATS (stats_int8_sse41, "sse4.1", int8_t, _mm, __m128, __m128i,
+              4, load_int8_sse41, cmpge_sse41, cmple_sse41,
+              _mm_castps_si128, stats_int8_scalar)
+VECTOR_STATS (stats_uint32_sse41, "sse4.1", uint32_t, _mm, __m128, __m128i,
+              4, load_uint32_sse41, cmpge_sse41, cmple_sse41,
+              _mm_castps_si128, stats_uint32_scalar)
+VECTOR_STATS (stats_uint16_sse41, "sse4.1", uint16_t, _mm, __m128, __m128i,
+              4, load_uint16_sse41, cmpge_sse41, cmple_sse41,
+              _mm_castps_si128, stats_uint16_scalar)
+VECTOR_STATS (stats_uint8_sse41, "sse4.1", uint8_t, _mm, __m128, __m128i,
+              4, load_uint8_sse41, cmpge_sse41, cmple_sse41,
+              _mm_castps_si128, stats_uint8_scalar)
+VECTOR_STATS (stats_float_sse41, "sse4.1", float, _mm, __m128, __m128i,
+              4, load_float_sse41, cmpge_sse41, cmple_sse41,
+              _mm_castps_si128, stats_float_scalar)
+VECTOR_STATS (stats_double_sse41, "sse4.1", double, _mm, __m128, __m128i,
+              4, load_double_sse41, cmpge_sse41, cmple_sse41,
+              _mm_castps_si128, stats_double_scalar)
+
+VECTOR_STATS (stats_int32_avx2, "avx2", int32_t, _mm256, __m256, __m256i,
+              8, load_int32_avx2, cmpge_avx2, cmple_avx2,
+              _mm256_castps_si256, stats_int32_scalar)
+VECTOR_STATS (stats_int16_avx2, "avx2", int16_t, _mm256, __m256, __m256i,
+              8, load_int16_avx2, cmpge_avx2, cmple_avx2,
+              _mm256_castps_si256, stats_int16_scalar)
+VECTOR_STATS (stats_int8_avx2, "avx2", int8_t, _mm256, __m256, __m256i,
+              8, load_int8_avx2, cmpge_avx2, cmple_avx2,
+              _mm256_castps_si256, stats_int8_scalar)
+VECTOR_STATS (stats_uint32_avx2, "avx2", uint32_t, _mm256, __m256, __m256i,
+              8, load_uint32_avx2, cmpge_avx2, cmple_avx2,
+              _mm256_castps_si256, stats_uint32_scalar)
+VECTOR_STATS (stats_uint16_avx2, "avx2", uint16_t, _mm256, __m256, __m256i,
+              8, load_uint16_avx2, cmpge_avx2, cmple_avx2,
+              _mm256_castps_si256, stats_uint16_scalar)
+VECTOR_STATS (stats_uint8_avx2, "avx2", uint8_t, _mm256, __m256, __m256i,
+              8, load_uint8_avx2, cmpge_avx2, cmple_avx2,
+              _mm256_castps_si256, stats_uint8_scalar)
+VECTOR_STATS (stats_float_avx2, "avx2", float, _mm256, __m256, __m256i,
+              8, load_float_avx2, cmpge_avx2, cmple_avx2,
+              _mm256_castps_si256, stats_float_scalar)
+VECTOR_STATS (stats_double_avx2, "avx2", double, _mm256, __m256, __m256i,
+              8, load_double_avx2, cmpge_avx2, cmple_avx2,
+              _mm256_castps_si256, stats_double_scalar)
+
+/* structures & constants */
+
+const stats_kernel stats_kernel_table[ISA_TOTAL][K_STATS] =
+  /* SSE2 has no sign/zero extensions, AVX-512 gives little over AVX2
+     here, because kernels are bound by conversions */
+  { [ISA_SCALAR] =
+    { [K_INT32]  = stats_int32_scalar,
+      [K_INT16]  = stats_int16_scalar,
+      [K_INT8]   = stats_int8_scalar,
+      [K_UINT32] = stats_uint32_scalar,
+      [K_UINT16] = stats_uint16_scalar,
+      [K_UINT8]  = stats_uint8_scalar,
+      [K_FLOAT]  = stats_float_scalar,
+      [K_DOUBLE] = stats_double_scalar },
+    [ISA_SSE41] =
+    { [K_INT32]  = stats_int32_sse41,
+      [K_INT16]  = stats_int16_sse41,
+      [K_INT8]   = stats_int8_sse41,
+      [K_UINT32] = stats_uint32_sse41,
+      [K_UINT16] = stats_uint16_sse41,
+      [K_UINT8]  = stats_uint8_sse41,
+      [K_FLOAT]  = stats_float_sse41,
+      [K_DOUBLE] = stats_double_sse41 },
+    [ISA_AVX2] =
+    { [K_INT32]  = stats_int32_avx2,
+      [K_INT16]  = stats_int16_avx2,
+      [K_INT8]   = stats_int8_avx2,
+      [K_UINT32] = stats_uint32_avx2,
+      [K_UINT16] = stats_uint16_avx2,
+      [K_UINT8]  = stats_uint8_avx2,
+      [K_FLOAT]  = stats_float_avx2,
+      [K_DOUBLE] = stats_double_avx2 } };
+
+/* functions */
+
+int stats_format (int format, int width, struct sample_scale *sc)
+/* Find statistics kernel for samples of given format as they come from
+   the library (right-justified in containers of 1, 2, or 4 bytes) and
+   fill `sc' so they are normalized to [-1, 1) by full scale of their real
+   width. Unsigned samples are centered around zero first. Return -1 if
+   there's no such kernel. */
+{
+  double full = ldexp (1, width - 1);
+  int k;
+  sc->offset = 0;
+  sc->inv = 1;
+  sc->clip = 1;
+  switch (format)
+    {
+    case AF_SAMPFMT_TWOSCOMP :
+      k = width > 16 ? K_INT32 : width > 8 ? K_INT16 : K_INT8;
+      break;
+    case AF_SAMPFMT_UNSIGNED :
+      k = width > 16 ? K_UINT32 : width > 8 ? K_UINT16 : K_UINT8;
+      /* 32 bit containers are flipped to signed ones by the kernels. */
+      sc->offset = k == K_UINT32 ? full - ldexp (1, 31) : full;
+      break;
+    case AF_SAMPFMT_FLOAT  : return K_FLOAT;
+    case AF_SAMPFMT_DOUBLE : return K_DOUBLE;
+    default : return -1;
+    }
+  sc->inv = 1 / full;
+  sc->clip = (full - 1) / full;
+  return k;
+}
+
+struct channel_stats *stats_alloc (int channels)
+/* Allocate empty statistics for `channels' channels. */
+{
+  struct channel_stats *st = malloc (sizeof (*st) * channels);
+  stats_reset (st, channels);
+  return st;
+}
+
+void stats_reset (struct channel_stats *st, int channels)
+/* Make statistics of `channels' channels empty. */
+{
+  int i;
+  for (i = 0; i < channels; i++)
+    {
+      (st + i)->min = INFINITY;
+      (st + i)->max = -INFINITY;
+      (st + i)->sum = 0;
+      (st + i)->sum2 = 0;
+      (st + i)->clips = 0;
+    }
+}
+
+void stats_merge (struct channel_stats *dst,
+                  const struct channel_stats *src,
+                  int channels)
+/* Add statistics of some frames in `src' to statistics of other frames
+   in `dst', this is how results of parts of big files are combined. */
+{
+  int i;
+  for (i = 0; i < channels; i++)
+    {
+      struct channel_stats *d = dst + i;
+      const struct channel_stats *s = src + i;
+      if (s->min < d->min) d->min = s->min;
+      if (s->max > d->max) d->max = s->max;
+      d->sum += s->sum;
+      d->sum2 += s->sum2;
+      d->clips += s->clips;
+    }
+}
+
+double stats_peak (const struct channel_stats *s)
+/* Return peak of a channel. */
+{
+  double h = s->max, l = -s->min;
+  h = h > l ? h : l;
+  return h > 0 ? h : 0;
+}
+
+double stats_rms (const struct channel_stats *st,
+                  int channels,
+                  AFframecount frames)
+/* Return RMS level of all channels together. */
+{
+  double sum2 = 0;
+  int i;
+  for (i = 0; i < channels; i++)
+    {
+      sum2 += (st + i)->sum2;
+    }
+  return frames > 0 && channels > 0 ? sqrt (sum2 / (frames * channels)) : 0;
+}
+
+double stats_dc (const struct channel_stats *st,
+                 int channels,
+                 AFframecount frames)
+/* Return DC offset of the channel where it's the greatest by magnitude,
+   DC offsets of different channels shouldn't cancel each other. */
+{
+  double result = 0;
+  int i;
+  if (frames <= 0) return 0;
+  for (i = 0; i < channels; i++)
+    {
+      double dc = (st + i)->sum / frames;
+      if (fabs (dc) > fabs (result)) result = dc;
+    }
+  return result;
+}
+
+AFframecount stats_clips (const struct channel_stats *st, int channels)
+/* Return total number of clipped samples in all channels. */
+{
+  AFframecount result = 0;
+  int i;
+  for (i = 0; i < channels; i++)
+    {
+      result += (st + i)->clips;
+    }
+  return result;
+}
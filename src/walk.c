@@ -0,0 +1,370 @@
+/*
+ * This file is part of LSA.
+ *
+ * Copyright © 2014–2017 Mark Karpov
+ *
+ * LSA is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * LSA is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "lsa.h"
+
+/* Recursive mode (`-R'). All threads share two queues: directories that
+   are waiting to be listed and directories which files are being
+   analyzed (jobs). A thread always prefers files of jobs, it only lists
+   another directory when there are no files to take, so listing never
+   runs far ahead of analysis and memory consumption depends on how many
+   directories are in progress, not on size of the tree. The thread that
+   finishes the last file of a directory prints its table right away, so
+   tables appear in order in which directories are done, files in every
+   table are sorted. Threads are started as work appears and no thread is
+   waiting for it, up to `threads_total', so a small tree doesn't start a
+   thread (with a decoding buffer) per CPU. Directories are listed with
+   `getdents64' and symbolic links to directories are not followed. */
+
+/* structures */
+
+struct dir_task /* directory that is waiting to be listed */
+{
+  char *path; /* ends with '/' */
+  struct dir_task *next;
+};
+
+struct dir_job /* listed directory which files are being analyzed */
+{
+  char *path; /* ends with '/' */
+  long path_len;
+  char **names; /* base names of files to analyze, in `arena' */
+  struct arena arena;
+  long total; /* number of files */
+  long heavy; /* number of files that are taken one at a time */
+  long index; /* index of next file to process, accessed atomically */
+  long done; /* number of processed files, accessed atomically */
+  struct audio_params **outputs;
+  struct cache *cache; /* cache of the directory, may be `NULL' */
+  struct cache_key *keys; /* cache keys of files, parallel to `names' */
+  int cache_dirty; /* set if the cache should be written back */
+  struct dir_job *next;
+};
+
+/* global variables */
+
+static pthread_mutex_t queue_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+static pthread_mutex_t print_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct dir_task *tasks; /* stack of directories to list, so the
+                                  tree is walked depth first */
+static struct dir_job *jobs, *jobs_last; /* queue of jobs that have files
+                                            nobody has taken yet */
+static long listing; /* number of threads that are listing directories */
+static pthread_t *tidv; /* threads, `threads_total' at most */
+static long started, /* number of started threads */
+  waiting; /* number of threads that are waiting for work */
+static int printed; /* set after the first table has been printed */
+static long root_len; /* length of path of the listed directory */
+
+/* declarations */
+
+static void *walk_thread (void *);
+static void add_worker (void);
+static void push_task (char *);
+static void list_dir (char *);
+static void run_job (struct dir_job *, long, long, void *);
+static void finish_job (struct dir_job *);
+
+/* functions */
+
+void walk_tree (const char *root)
+/* List directory `root' and all its subdirectories using `threads_total'
+   threads. `root' must end with '/'. */
+{
+  PROFILE_START (t);
+  root_len = strlen (root);
+  char *path = malloc (root_len + 1);
+  strcpy (path, root);
+  tidv = malloc (sizeof (pthread_t) * threads_total);
+  push_task (path);
+  /* Threads may start more threads until they quit, once all started
+     threads are joined, no more can appear. */
+  long i;
+  for (i = 0;; i++)
+    {
+      pthread_mutex_lock (&queue_mutex);
+      long n = started;
+      pthread_mutex_unlock (&queue_mutex);
+      if (i == n) break;
+      pthread_join (*(tidv + i), NULL);
+    }
+  free (tidv);
+  if (op_timings) profile_pool (t);
+}
+
+static void *walk_thread (void *arg)
+/* This function describes behavior of an individual thread in recursive
+   mode. It takes files from the first job in the queue or lists the next
+   directory when there are no files. It quits when there's nothing to
+   take and no other thread is listing a directory, because only listing
+   can produce more work. */
+{
+  if (op_pin) cpu_pin ();
+  if (op_timings) profile_thread ();
+  void *buffer = alloc_buffer ();
+  if (!buffer) return NULL;
+  pthread_mutex_lock (&queue_mutex);
+  for (;;)
+    {
+      if (jobs)
+        {
+          struct dir_job *j = jobs;
+          long end, i =
+            claim_items (&j->index, j->total,
+                         j->index < j->heavy ? 1 : LSA_BATCH_MAX, &end);
+          if (i < 0 || end == j->total)
+            {
+              jobs = j->next;
+              if (!jobs) jobs_last = NULL;
+            }
+          if (i < 0) continue;
+          if (jobs || tasks) add_worker ();
+          pthread_mutex_unlock (&queue_mutex);
+          run_job (j, i, end, buffer);
+          pthread_mutex_lock (&queue_mutex);
+        }
+      else if (tasks)
+        {
+          struct dir_task *t = tasks;
+          tasks = t->next;
+          listing++;
+          if (jobs || tasks) add_worker ();
+          pthread_mutex_unlock (&queue_mutex);
+          list_dir (t->path);
+          free (t);
+          pthread_mutex_lock (&queue_mutex);
+          listing--;
+          if (!listing) pthread_cond_broadcast (&queue_cond);
+        }
+      else if (listing)
+        {
+          waiting++;
+          pthread_cond_wait (&queue_cond, &queue_mutex);
+          waiting--;
+        }
+      else break;
+    }
+  pthread_mutex_unlock (&queue_mutex);
+  free (buffer);
+  return NULL;
+}
+
+static void add_worker (void)
+/* Start another thread if none is waiting for work and fewer than
+   `threads_total' have been started, `queue_mutex' must be locked. */
+{
+  if (waiting || started == threads_total) return;
+  if (!pthread_create (tidv + started, NULL, walk_thread, NULL)) started++;
+}
+
+static void push_task (char *path)
+/* Put directory on `path' on top of stack of directories to list, the
+   stack takes ownership of `path'. */
+{
+  struct dir_task *t = malloc (sizeof (*t));
+  t->path = path;
+  pthread_mutex_lock (&queue_mutex);
+  t->next = tasks;
+  tasks = t;
+  pthread_cond_signal (&queue_cond);
+  add_worker ();
+  pthread_mutex_unlock (&queue_mutex);
+}
+
+static void list_dir (char *path)
+/* Read entries of directory on `path' (which is freed here), push its
+   subdirectories as new tasks and files we can process as a new job. */
+{
+  PROFILE_START (t);
+  long path_len = strlen (path);
+  int fd = openat (AT_FDCWD, path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd < 0)
+    {
+      fprintf (stderr, "lsa: cannot read directory '%s'\n", path);
+      free (path);
+      return;
+    }
+  char *dents = malloc (LSA_DENTS_SIZE);
+  char **names = NULL;
+  struct arena arena = { NULL, 0 };
+  long total = 0, size = 0, n;
+  int nomem = 0;
+  while ((n = syscall (SYS_getdents64, fd, dents, LSA_DENTS_SIZE)) > 0)
+    {
+      long off;
+      for (off = 0; off < n;)
+        {
+          struct linux_dirent64 *d =
+            (struct linux_dirent64 *)(dents + off);
+          off += d->d_reclen;
+          unsigned char type = d->d_type;
+          if (!strcmp (d->d_name, ".") || !strcmp (d->d_name, ".."))
+            continue;
+          if (type == DT_UNKNOWN)
+            {
+              struct stat sb;
+              if (fstatat (fd, d->d_name, &sb, AT_SYMLINK_NOFOLLOW))
+                continue;
+              type = S_ISDIR (sb.st_mode) ? DT_DIR :
+                S_ISLNK (sb.st_mode) ? DT_LNK :
+                S_ISREG (sb.st_mode) ? DT_REG : DT_UNKNOWN;
+            }
+          long name_len = strlen (d->d_name);
+          if (type == DT_DIR)
+            {
+              char *sub = malloc (path_len + name_len + 2);
+              memcpy (sub, path, path_len);
+              memcpy (sub + path_len, d->d_name, name_len);
+              *(sub + path_len + name_len) = '/';
+              *(sub + path_len + name_len + 1) = '\0';
+              push_task (sub);
+            }
+          else if (is_audio (d->d_name, type) &&
+                   in_shard (path + root_len, d->d_name))
+            {
+              if (total == size)
+                {
+                  size = size ? size * 2 : 16;
+                  names = realloc (names, sizeof (char *) * size);
+                }
+              char *name = arena_string (&arena, d->d_name, name_len);
+              if (!name)
+                {
+                  fprintf (stderr,
+                           "lsa: cannot dynamically allocate memory\n");
+                  nomem = 1;
+                  break;
+                }
+              *(names + total++) = name;
+            }
+        }
+      if (nomem) break;
+    }
+  free (dents);
+  if (nomem)
+    {
+      /* Files that have been found are not analyzed either, so the
+         directory is never listed partially. */
+      total = 0;
+      arena_free (&arena);
+    }
+  long heavy = 0;
+  if ((op_peak || op_stats || overview_buckets || op_true_peak ||
+       op_loudness || op_hash) && total > 1)
+    heavy = sort_by_cost (fd, (void **)names, total, 0, 0);
+  close (fd);
+  PROFILE_END (t, PH_SCAN, 0);
+  if (!total)
+    {
+      free (names);
+      free (path);
+      return;
+    }
+  struct dir_job *j = malloc (sizeof (*j));
+  j->path = path;
+  j->path_len = path_len;
+  j->names = names;
+  j->arena = arena;
+  j->total = total;
+  j->heavy = heavy;
+  j->index = 0;
+  j->done = 0;
+  j->outputs = malloc (sizeof (struct audio_params *) * total);
+  /* Only directories with files of this shard get here, so the cache
+     isn't touched for the other ones. */
+  PROFILE_START (u);
+  j->cache = op_no_cache ? NULL : cache_open (path, !op_rebuild_cache);
+  PROFILE_END (u, PH_CACHE, 0);
+  j->keys = calloc (total, sizeof (struct cache_key));
+  j->cache_dirty = op_rebuild_cache;
+  j->next = NULL;
+  pthread_mutex_lock (&queue_mutex);
+  if (jobs_last) jobs_last->next = j;
+  else jobs = j;
+  jobs_last = j;
+  pthread_cond_broadcast (&queue_cond);
+  add_worker ();
+  pthread_mutex_unlock (&queue_mutex);
+}
+
+static void run_job (struct dir_job *j, long i, long end, void *buffer)
+/* Analyze files from `i' to `end' of job `j'. There are no other threads
+   to process chunks of big files here, so `analyze_item' scans them as a
+   whole. If these are the last files of the job, finish it. */
+{
+  PROFILE_START (t);
+  size_t size = j->path_len + 1;
+  char *path = malloc (size);
+  long k;
+  memcpy (path, j->path, j->path_len);
+  for (k = i; k < end; k++)
+    {
+      path = make_path (path, &size, j->path_len, *(j->names + k));
+      struct audio_params *p =
+        analyze_item (path, buffer, j->cache, j->keys + k, &j->cache_dirty,
+                      NULL, NULL);
+      if (p) p->name = *(j->names + k);
+      *(j->outputs + k) = p;
+    }
+  free (path);
+  if (op_timings) profile_busy (t, end - i);
+  /* Once `done' is updated, `j' may be freed by another thread. */
+  long total = j->total;
+  if (__atomic_add_fetch (&j->done, end - i, __ATOMIC_ACQ_REL) == total)
+    finish_job (j);
+}
+
+static void finish_job (struct dir_job *j)
+/* Save cache (and envelopes) of finished job `j', print its table, and
+   free it. */
+{
+  PROFILE_START (t);
+  if (j->cache && j->cache_dirty)
+    cache_save (j->cache, j->outputs, j->keys, j->total);
+  cache_close (j->cache);
+  PROFILE_END (t, PH_CACHE, 0);
+  free (j->keys);
+  if (overview_buckets) overview_save (j->path, j->outputs, j->total);
+  partial_add (j->path + root_len, j->outputs, j->total);
+  pthread_mutex_lock (&print_mutex);
+  PROFILE_START (u);
+  if (printed) printf ("\n");
+  printed = 1;
+  if (j->path_len > 1) *(j->path + j->path_len - 1) = '\0';
+  printf ("%s:\n", j->path);
+  print_table (j->outputs, j->total);
+  fflush (stdout);
+  PROFILE_END (u, PH_PRINT, 0);
+  pthread_mutex_unlock (&print_mutex);
+  long k;
+  for (k = 0; k < j->total; k++)
+    {
+      struct audio_params *p = *(j->outputs + k);
+      if (!p) continue;
+      free (p->stats);
+      free (p->overview);
+      free (p);
+    }
+  arena_free (&j->arena);
+  free (j->names);
+  free (j->outputs);
+  free (j->path);
+  free (j);
+}
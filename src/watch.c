@@ -0,0 +1,398 @@
+/*
+ * This file is part of LSA.
+ *
+ * Copyright © 2014–2017 Mark Karpov
+ *
+ * LSA is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * LSA is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "lsa.h"
+#include <sys/inotify.h> /* inotify */
+#include <poll.h>        /* poll */
+
+/* Watch mode (`--watch'). Results of the first listing are kept in memory
+   sorted by name, then we wait for inotify events and analyze only files
+   that have been written, moved into the directory, or deleted. Events
+   that come in quick succession are handled together, then the table is
+   printed again. Changed files are analyzed by a pool of threads like the
+   one of recursive mode, big files are not split. If the queue of events
+   overflows, we cannot know what has changed, so the directory is listed
+   again and files are checked against their cache keys. */
+
+#define WATCH_EVENTS (IN_CLOSE_WRITE | IN_MOVED_TO | IN_DELETE |       \
+                      IN_MOVED_FROM | IN_DELETE_SELF | IN_MOVE_SELF)
+#define WATCH_BUFFER (64 << 10) /* size of buffer for inotify events */
+#define WATCH_QUIET  200        /* how long to wait for more events before
+                                   handling them, in milliseconds */
+
+/* structures */
+
+struct watch_entry /* file we know about */
+{
+  char *name; /* base name */
+  struct audio_params *params;
+  struct cache_key key;
+};
+
+/* global variables */
+
+static struct watch_entry *entries; /* vector sorted by name */
+static long entries_total, entries_size;
+static char **changed; /* names of files to analyze */
+static long changed_total, changed_size;
+static struct watch_entry *fresh; /* results of analysis of `changed' */
+static long fresh_index; /* index of next file to analyze, accessed
+                            atomically */
+static int printed; /* set after the first table has been printed */
+static const char *watch_path; /* watched directory, ends with '/' */
+static struct cache *watch_cache; /* used to get cache keys and to save
+                                     results, never for lookups */
+
+/* declarations */
+
+static void *watch_thread (void *);
+static long find_entry (const char *, int *);
+static void remove_entry (const char *);
+static void insert_entry (struct watch_entry *);
+static void add_changed (const char *);
+static void resync_entries (const char *);
+static void print_entries (void);
+
+/* functions */
+
+int watch_open (const char *dir)
+/* Start watching directory `dir' for changes. This is done before the
+   directory is listed, so no change is missed. Return inotify descriptor
+   or -1 on failure. */
+{
+  int fd = inotify_init1 (IN_CLOEXEC);
+  if (fd < 0) return -1;
+  if (inotify_add_watch (fd, dir, WATCH_EVENTS | IN_ONLYDIR) < 0)
+    {
+      close (fd);
+      return -1;
+    }
+  return fd;
+}
+
+int watch_dir (int fd,
+               const char *dir,
+               struct audio_params **outputs,
+               struct cache_key *keys,
+               long total)
+/* Take `total' results of the first listing of `dir' in `outputs' (with
+   cache keys in `keys'), print them, and keep updating and printing them
+   as inotify descriptor `fd' reports changes. The results are copied,
+   because they live in arenas, but their statistics and envelopes are
+   taken over. Return exit status once the directory is gone. */
+{
+  long i;
+  watch_path = dir;
+  for (i = 0; i < total; i++)
+    {
+      struct audio_params *p = *(outputs + i);
+      if (!p) continue;
+      struct watch_entry e;
+      e.name = malloc (strlen (p->name) + 1);
+      strcpy (e.name, p->name);
+      e.params = malloc (sizeof (*p));
+      *e.params = *p;
+      e.params->name = e.name;
+      e.key = *(keys + i);
+      insert_entry (&e);
+    }
+  print_entries ();
+  char *events = malloc (WATCH_BUFFER);
+  int gone = 0;
+  while (!gone)
+    {
+      /* Collect names of changed files until events stop coming for a
+         while. */
+      struct pollfd pfd = { fd, POLLIN, 0 };
+      int timeout = -1, overflow = 0;
+      while (!gone && poll (&pfd, 1, timeout) > 0)
+        {
+          ssize_t n = read (fd, events, WATCH_BUFFER);
+          if (n <= 0) break;
+          ssize_t off;
+          for (off = 0; off < n;)
+            {
+              struct inotify_event *ev =
+                (struct inotify_event *)(events + off);
+              off += sizeof (*ev) + ev->len;
+              if (ev->mask & IN_Q_OVERFLOW) overflow = 1;
+              if (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED))
+                gone = 1;
+              if (!ev->len || (ev->mask & IN_ISDIR) ||
+                  !is_audio (ev->name, DT_REG))
+                continue;
+              remove_entry (ev->name);
+              if (ev->mask & (IN_CLOSE_WRITE | IN_MOVED_TO))
+                add_changed (ev->name);
+            }
+          timeout = WATCH_QUIET;
+        }
+      if (gone) break;
+      if (overflow) resync_entries (dir);
+      /* Analyze changed files, some of them may have been deleted since
+         then, they are just skipped. */
+      PROFILE_START (t);
+      watch_cache = op_no_cache ? NULL : cache_open (dir, 0);
+      PROFILE_END (t, PH_CACHE, 0);
+      fresh = calloc (changed_total ? changed_total : 1, sizeof (*fresh));
+      fresh_index = 0;
+      long n = threads_total < changed_total ? threads_total : changed_total;
+      pthread_t *tidv = malloc (sizeof (pthread_t) * (n ? n : 1));
+      for (i = 0; i < n; i++)
+        {
+          pthread_create (tidv + i, NULL, watch_thread, NULL);
+        }
+      for (i = 0; i < n; i++)
+        {
+          pthread_join (*(tidv + i), NULL);
+        }
+      free (tidv);
+      for (i = 0; i < changed_total; i++)
+        {
+          if ((fresh + i)->params) insert_entry (fresh + i);
+          else free (*(changed + i));
+        }
+      free (fresh);
+      changed_total = 0;
+      /* The cache and envelopes are rewritten with everything we
+         know. */
+      struct audio_params **params =
+        malloc (sizeof (struct audio_params *) * (entries_total + 1));
+      struct cache_key *k =
+        malloc (sizeof (struct cache_key) * (entries_total + 1));
+      for (i = 0; i < entries_total; i++)
+        {
+          *(params + i) = (entries + i)->params;
+          *(k + i) = (entries + i)->key;
+        }
+      PROFILE_START (u);
+      if (watch_cache) cache_save (watch_cache, params, k, entries_total);
+      cache_close (watch_cache);
+      PROFILE_END (u, PH_CACHE, 0);
+      if (overview_buckets) overview_save (dir, params, entries_total);
+      free (params);
+      free (k);
+      print_entries ();
+    }
+  free (events);
+  for (i = 0; i < entries_total; i++)
+    {
+      free ((entries + i)->params->stats);
+      free ((entries + i)->params->overview);
+      free ((entries + i)->params);
+      free ((entries + i)->name);
+    }
+  free (entries);
+  for (i = 0; i < changed_total; i++)
+    {
+      free (*(changed + i));
+    }
+  free (changed);
+  close (fd);
+  fprintf (stderr, "lsa: '%s' is no longer available\n", dir);
+  return EXIT_FAILURE;
+}
+
+static void *watch_thread (void *arg)
+/* This function describes behavior of a thread that analyzes changed
+   files. Results are put into `fresh', parallel to `changed'. */
+{
+  if (op_pin) cpu_pin ();
+  if (op_timings) profile_thread ();
+  void *buffer = alloc_buffer ();
+  if (!buffer) return NULL;
+  size_t path_len = strlen (watch_path), size = path_len + 1;
+  char *path = malloc (size);
+  int dirty;
+  memcpy (path, watch_path, path_len);
+  long i, end;
+  while ((i = claim_items (&fresh_index, changed_total, 1, &end)) >= 0)
+    {
+      PROFILE_START (t);
+      struct watch_entry *e = fresh + i;
+      e->name = *(changed + i);
+      path = make_path (path, &size, path_len, e->name);
+      e->params =
+        analyze_item (path, buffer, watch_cache, &e->key, &dirty, NULL,
+                      NULL);
+      if (e->params) e->params->name = e->name;
+      if (op_timings) profile_busy (t, 1);
+    }
+  free (path);
+  free (buffer);
+  return NULL;
+}
+
+static long find_entry (const char *name, int *found)
+/* Return index of entry with given `name' or index where it should be
+   inserted, `*found' tells which is the case. */
+{
+  long lo = 0, hi = entries_total;
+  *found = 0;
+  while (lo < hi)
+    {
+      long mid = lo + (hi - lo) / 2;
+      int c = strcmp ((entries + mid)->name, name);
+      if (!c)
+        {
+          *found = 1;
+          return mid;
+        }
+      if (c < 0) lo = mid + 1;
+      else hi = mid;
+    }
+  return lo;
+}
+
+static void remove_entry (const char *name)
+/* Forget file `name', if it has been changed but not analyzed yet, it
+   won't be analyzed. */
+{
+  int found;
+  long i = find_entry (name, &found);
+  if (found)
+    {
+      struct watch_entry *e = entries + i;
+      free (e->params->stats);
+      free (e->params->overview);
+      free (e->params);
+      free (e->name);
+      memmove (e, e + 1, sizeof (*e) * (entries_total - i - 1));
+      entries_total--;
+    }
+  for (i = 0; i < changed_total; i++)
+    {
+      if (!strcmp (*(changed + i), name))
+        {
+          free (*(changed + i));
+          *(changed + i) = *(changed + --changed_total);
+          return;
+        }
+    }
+}
+
+static void insert_entry (struct watch_entry *e)
+/* Insert copy of `e' into `entries' keeping them sorted, there must be no
+   entry with the same name. */
+{
+  int found;
+  long i = find_entry (e->name, &found);
+  if (entries_total == entries_size)
+    {
+      entries_size = entries_size ? entries_size * 2 : 64;
+      entries = realloc (entries, sizeof (*entries) * entries_size);
+    }
+  memmove (entries + i + 1, entries + i,
+           sizeof (*entries) * (entries_total - i));
+  *(entries + i) = *e;
+  entries_total++;
+}
+
+static void add_changed (const char *name)
+/* Remember that file `name' should be analyzed. */
+{
+  if (changed_total == changed_size)
+    {
+      changed_size = changed_size ? changed_size * 2 : 16;
+      changed = realloc (changed, sizeof (char *) * changed_size);
+    }
+  *(changed + changed_total) = malloc (strlen (name) + 1);
+  strcpy (*(changed + changed_total++), name);
+}
+
+static void resync_entries (const char *dir)
+/* Some events have been lost, so list directory `dir' again: files that
+   are gone are forgotten, files that are new or don't match their cache
+   keys are to be analyzed. Keys are unknown if caching is disabled, then
+   all files are analyzed again. */
+{
+  struct arena a = { NULL, 0 };
+  char **v;
+  long n = read_dir (dir, &a, &v), i, stale_total = 0;
+  int dfd = open (dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (n < 0 || dfd < 0)
+    {
+      if (n >= 0) free (v);
+      if (dfd >= 0) close (dfd);
+      arena_free (&a);
+      return;
+    }
+  char *seen = calloc (entries_total ? entries_total : 1, 1);
+  char **stale = malloc (sizeof (char *) * (n ? n : 1));
+  for (i = 0; i < n; i++)
+    {
+      int found;
+      long j = find_entry (*(v + i), &found);
+      struct stat sb;
+      struct cache_key k;
+      if (found)
+        {
+          const struct cache_key *e = &(entries + j)->key;
+          *(seen + j) = 1;
+          if (!fstatat (dfd, *(v + i), &sb, 0))
+            {
+              cache_key (&sb, &k);
+              if ((e->dev || e->ino) && k.dev == e->dev && k.ino == e->ino &&
+                  k.size == e->size && k.mtime == e->mtime)
+                continue;
+            }
+        }
+      *(stale + stale_total++) = *(v + i);
+    }
+  /* Entries are removed from the end, so indices in `seen' stay valid. */
+  for (i = entries_total - 1; i >= 0; i--)
+    {
+      if (*(seen + i)) continue;
+      char *name = malloc (strlen ((entries + i)->name) + 1);
+      strcpy (name, (entries + i)->name);
+      remove_entry (name);
+      free (name);
+    }
+  for (i = 0; i < stale_total; i++)
+    {
+      remove_entry (*(stale + i));
+      add_changed (*(stale + i));
+    }
+  free (stale);
+  free (seen);
+  free (v);
+  close (dfd);
+  arena_free (&a);
+}
+
+static void print_entries (void)
+/* Print table of all known files. When output goes to a terminal, the
+   screen is cleared first, so the table stays in place. */
+{
+  PROFILE_START (t);
+  struct audio_params **params =
+    malloc (sizeof (struct audio_params *) * (entries_total + 1));
+  long i;
+  for (i = 0; i < entries_total; i++)
+    {
+      *(params + i) = (entries + i)->params;
+    }
+  if (isatty (STDOUT_FILENO)) printf ("\033[H\033[2J");
+  else if (printed) printf ("\n");
+  printed = 1;
+  print_table (params, entries_total);
+  fflush (stdout);
+  free (params);
+  PROFILE_END (t, PH_PRINT, 0);
+}